@@ -1,11 +1,14 @@
 #include <assert.h>
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "bufio.h"
 #include "log.h"
+#include "mem.h"
+#include "trace.h"
 
 static char *
 scan_newline(struct bufio *b)
@@ -52,6 +55,15 @@ bufio_readable(struct bufio *b, int fd)
 	char *msg;
 	assert(b != NULL);
 
+	// We do not reset recvbuf at the end of this function, but rather at
+	// the beginning because it allows processing to continue normally
+	// without a need to call something like bufio_done_read().
+	if (b->last_recvptr) {
+		memmove(b->recvbuf, b->recvbuf+b->last_recvptr, b->recvptr - b->last_recvptr);
+		b->recvptr -= b->last_recvptr;
+		b->last_recvptr = 0;
+	}
+
 	// IRC messages are supposed to be at most 2048 characters in length
 	// (technically 512 going by the RFC) so provided recvbuf is still 4096
 	// we can store up to 8 RFC length messages at full length, or 2 full
@@ -65,15 +77,6 @@ bufio_readable(struct bufio *b, int fd)
 		return -1;
 	}
 
-	// We do not reset recvbuf at the end of this function, but rather at
-	// the beginning because it allows processing to continue normally
-	// without a need to call something like bufio_done_read().
-	if (b->last_recvptr) {
-		memmove(b->recvbuf, b->recvbuf+b->last_recvptr, b->recvptr - b->last_recvptr);
-		b->recvptr -= b->last_recvptr;
-		b->last_recvptr = 0;
-	}
-
 	/* This region kinda sucks but I don't know how else to do it. I'll
 	 * explain:
 	 *
@@ -138,7 +141,9 @@ bufio_writable(struct bufio *b, int fd)
 	// but the previous data invalidated by a call, we need not worry about
 	// when data is valid because the users of bufio aren't supposed to
 	// care about it once they send it.
-	memmove(b->sendbuf, b->sendbuf+b->sendptr, b->sendptr-n);
+	uint64_t t = TRACE_BEGIN();
+	memmove(b->sendbuf, b->sendbuf+n, b->sendptr-n);
+	TRACE_END("memmove", b->sendptr-n, t);
 	b->sendptr -= n;
 
 	// 1 if true, 0 if false.
@@ -148,6 +153,9 @@ bufio_writable(struct bufio *b, int fd)
 /* bufio_write writes data to the send buffer, which will eventually be sent
  * when bufio_writable is called.
  *
+ * The send buffer grows as needed, in powers of two, up to sendmax bytes or
+ * BUFIO_SENDBUF_MAX if that is not set.
+ *
  * If an error occurs, -1 is returned and errno is set. This will only happen
  * when you try to send data faster than the client can receive it.
  *
@@ -160,8 +168,24 @@ bufio_write(struct bufio *b, void *data, size_t n)
 	assert(b != NULL);
 
 	// Ensure data can fit.
-	if (b->sendptr + n + 1 > sizeof(b->sendbuf))
-		return -1;
+	if (b->sendptr + n + 1 > b->sendcap) {
+		size_t cap = b->sendcap ? b->sendcap : 4096;
+		char *buf;
+
+		while (cap < b->sendptr + n + 1)
+			cap *= 2;
+
+		if (cap > (b->sendmax ? b->sendmax : BUFIO_SENDBUF_MAX)) {
+			errno = ENOBUFS;
+			return -1;
+		}
+
+		if (!(buf = mem_realloc(MEM_BUFIO, b->sendbuf, cap)))
+			return -1;
+
+		b->sendbuf = buf;
+		b->sendcap = cap;
+	}
 
 	// Copy.
 	memmove(b->sendbuf+b->sendptr, data, n);
@@ -169,3 +193,12 @@ bufio_write(struct bufio *b, void *data, size_t n)
 
 	return n;
 }
+
+/* bufio_free frees the send buffer. The bufio object may be reused after. */
+void
+bufio_free(struct bufio *b)
+{
+	mem_free(MEM_BUFIO, b->sendbuf);
+	b->sendbuf = NULL;
+	b->sendptr = b->sendcap = 0;
+}
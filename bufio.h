@@ -2,14 +2,20 @@
 #define BUFIO_H_INC
 #include <stddef.h>
 
+#ifndef BUFIO_SENDBUF_MAX
+#define BUFIO_SENDBUF_MAX (256 << 10)
+#endif
+
 struct bufio {
-	char sendbuf[4096];
+	char *sendbuf;
 	char recvbuf[4096];
-	int sendptr;
+	int sendptr, sendcap;
+	int sendmax; // Bytes the send buffer may grow to, 0 for BUFIO_SENDBUF_MAX
 	int recvptr, last_recvptr;
 };
 
 int bufio_readable(struct bufio *b, int fd);
 int bufio_writable(struct bufio *b, int fd);
 int bufio_write(struct bufio *b, void *data, size_t n);
+void bufio_free(struct bufio *b);
 #endif
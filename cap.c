@@ -0,0 +1,94 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+
+#include "cap.h"
+#include "clk.h"
+
+static struct {
+	char *name;
+	int cap;
+	char *tag; // The tag this capability controls, if any
+} caps[] = {
+	{ "message-tags",	CAP_MESSAGE_TAGS,	NULL },
+	{ "server-time",	CAP_SERVER_TIME,	"time" },
+	{ "account-tag",	CAP_ACCOUNT_TAG,	"account" },
+	{ "batch",		CAP_BATCH,		"batch" },
+	{ "icbm/netsplit-summary", CAP_SPLIT_SUMMARY,	NULL },
+};
+
+/* cap_find returns the capability called name, or 0 if we don't support it.
+ * Anything after an '=' in name is ignored. */
+int
+cap_find(const char *name)
+{
+	size_t n = strcspn(name, "=");
+
+	for (size_t i = 0; i < sizeof(caps)/sizeof(*caps); ++i)
+		if (strlen(caps[i].name) == n && strncmp(caps[i].name, name, n) == 0)
+			return caps[i].cap;
+	return 0;
+}
+
+/* cap_list writes the names of every capability in caps to buf, separated by
+ * spaces. The length of the list is returned. */
+int
+cap_list(int c, char *buf, size_t n)
+{
+	int ptr = 0;
+
+	*buf = 0;
+	for (size_t i = 0; i < sizeof(caps)/sizeof(*caps); ++i)
+		if (c & caps[i].cap && ptr < n)
+			ptr += snprintf(buf+ptr, n-ptr, "%s%s", ptr ? " " : "", caps[i].name);
+
+	return ptr < n ? ptr : n - 1;
+}
+
+/* tag_allowed reports whether a client with caps may see the tag at key,
+ * which is klen bytes long. */
+static int
+tag_allowed(int c, const char *key, size_t klen)
+{
+	for (size_t i = 0; i < sizeof(caps)/sizeof(*caps); ++i)
+		if (caps[i].tag && strlen(caps[i].tag) == klen && strncmp(caps[i].tag, key, klen) == 0)
+			return c & caps[i].cap;
+
+	// Everything else needs message-tags.
+	return c & CAP_MESSAGE_TAGS;
+}
+
+/* cap_tags writes the tags out of tags (without the leading '@', may be NULL)
+ * that a client with caps should see to buf.
+ *
+ * Clients with server-time always get a time tag, even if there was none to
+ * begin with.
+ *
+ * The length of the tags is returned, which is zero if there are none.
+ */
+int
+cap_tags(int c, const char *tags, char *buf, size_t n)
+{
+	int ptr = 0, time_seen = 0;
+
+	*buf = 0;
+	while (tags && *tags) {
+		size_t len = strcspn(tags, ";"), klen = strcspn(tags, "=;");
+
+		if (klen == 4 && strncmp(tags, "time", 4) == 0)
+			time_seen = 1;
+
+		if (tag_allowed(c, tags, klen) && ptr < n)
+			ptr += snprintf(buf+ptr, n-ptr, "%s%.*s", ptr ? ";" : "", (int)len, tags);
+
+		tags += len;
+		if (*tags == ';')
+			tags++;
+	}
+
+	if (c & CAP_SERVER_TIME && !time_seen && ptr < n)
+		ptr += snprintf(buf+ptr, n-ptr, "%stime=%s", ptr ? ";" : "", clk_iso());
+
+	return ptr < n ? ptr : n - 1;
+}
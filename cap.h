@@ -0,0 +1,25 @@
+#ifndef CAP_H_INC
+#define CAP_H_INC
+#include <stddef.h>
+
+/* Capabilities that change what a client gets sent. */
+enum {
+	CAP_MESSAGE_TAGS = 1 << 0,
+	CAP_SERVER_TIME = 1 << 1,
+	CAP_ACCOUNT_TAG = 1 << 2,
+	CAP_BATCH = 1 << 3,
+
+	CAP_ALL = (1 << 4) - 1,
+
+	// Changes what a client gets sent, but not how: netsplits and netjoins
+	// are summed up rather than passed on, with -N.
+	CAP_SPLIT_SUMMARY = 1 << 4,
+};
+
+/* The number of distinct ways a message may be serialized. */
+#define CAP_VARIANTS (CAP_ALL + 1)
+
+int cap_find(const char *name);
+int cap_list(int caps, char *buf, size_t n);
+int cap_tags(int caps, const char *tags, char *buf, size_t n);
+#endif
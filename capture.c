@@ -0,0 +1,88 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+#include "log.h"
+#include "mem.h"
+
+#define CAPTURE_BUFSZ (1 << 20)
+
+static FILE *capture_file = NULL;
+static char *capture_buf = NULL;
+static struct timespec capture_start;
+
+/* capture_open starts recording traffic to path, replacing whatever was
+ * there.
+ *
+ * On error, -1 is returned and errno is set.
+ */
+int
+capture_open(const char *path)
+{
+	if (!(capture_file = fopen(path, "wb")))
+		return -1;
+
+	// Records are small and many; only write out in large chunks.
+	if ((capture_buf = mem_malloc(MEM_CAPTURE, CAPTURE_BUFSZ)))
+		setvbuf(capture_file, capture_buf, _IOFBF, CAPTURE_BUFSZ);
+
+	clock_gettime(CLOCK_MONOTONIC, &capture_start);
+	fwrite(CAPTURE_MAGIC, 1, 8, capture_file);
+	return 0;
+}
+
+/* capture_close flushes and closes the capture, if there is one. */
+void
+capture_close(void)
+{
+	if (!capture_file)
+		return;
+
+	fclose(capture_file);
+	mem_free(MEM_CAPTURE, capture_buf);
+	capture_file = NULL;
+	capture_buf = NULL;
+}
+
+static void
+record(int conn, int type, const char *data, size_t n)
+{
+	struct capture_rec rec = {0};
+	struct timespec ts;
+
+	// The loop's cached clock is too coarse to replay from, so this reads
+	// the real one.
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	rec.ns = (uint64_t)(ts.tv_sec - capture_start.tv_sec) * 1000000000 +
+		ts.tv_nsec - capture_start.tv_nsec;
+	rec.len = n;
+	rec.conn = conn;
+	rec.type = type;
+
+	if (fwrite(&rec, sizeof(rec), 1, capture_file) != 1 ||
+	    (n && fwrite(data, 1, n, capture_file) != n)) {
+		warnf("Failed writing capture, stopping it");
+		capture_close();
+	}
+}
+
+/* capture_line records a line received on conn. */
+void
+capture_line(int conn, const char *line, size_t n)
+{
+	if (capture_file)
+		record(conn, CAPTURE_LINE, line, n);
+}
+
+/* capture_event records a client connecting or going away. */
+void
+capture_event(int conn, int type)
+{
+	if (capture_file)
+		record(conn, type, NULL, 0);
+}
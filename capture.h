@@ -0,0 +1,33 @@
+#ifndef CAPTURE_H_INC
+#define CAPTURE_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "ICBMCAP1"
+
+/* The connection a record belongs to: the upstream server, or the fd of a
+ * client. Fds are reused, so a client's records are bracketed by its
+ * CAPTURE_OPEN and CAPTURE_CLOSE. */
+#define CAPTURE_SERVER -1
+
+enum {
+	CAPTURE_LINE, // A line received, without its "\r\n"
+	CAPTURE_OPEN, // A client connected
+	CAPTURE_CLOSE, // A client went away
+};
+
+/* A capture file is CAPTURE_MAGIC followed by records, each of which is a
+ * capture_rec followed by len bytes, in host byte order. */
+struct capture_rec {
+	uint64_t ns; // Since the capture started, monotonic
+	uint32_t len;
+	int32_t conn;
+	uint8_t type;
+	uint8_t pad[7];
+};
+
+int capture_open(const char *path);
+void capture_close(void);
+void capture_line(int conn, const char *line, size_t n);
+void capture_event(int conn, int type);
+#endif
@@ -5,23 +5,30 @@
 #include <poll.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
 
+#include "cap.h"
+#include "capture.h"
 #include "client.h"
+#include "cmd.h"
 #include "ev.h"
+#include "history.h"
+#include "intern.h"
 #include "log.h"
-#include "main.h"
+#include "network.h"
+#include "probe.h"
 #include "server.h"
+#include "split.h"
+#include "trace.h"
 #include "vec.h"
-
-int clientsz = 8;
-int clientptr = 0;
-struct client *clients;
+#include "worker.h"
 
 static int cli_cap(struct client *c, struct irc_message *msg);
 static int cli_login(struct client *c, struct irc_message *msg);
+static int cli_pass(struct client *c, struct irc_message *msg);
 static int cli_ping(struct client *c, struct irc_message *msg);
 
 static struct {
@@ -29,23 +36,106 @@ static struct {
 	int (*f)(struct client *c, struct irc_message *msg);
 } client_dispatch[] = {
 	{ "CAP",	cli_cap },
+	{ "PASS",	cli_pass },
 	{ "USER",	cli_login },
 	{ "NICK",	cli_login },
 
 	{ "PING",	cli_ping },
 	{ "PONG",	cli_ping },
+
+	{ "ICBM",	cmd_icbm },
 };
 
+/* client_dispatch_find returns the index of the handler for command in
+ * client_dispatch, or -1 if the message should go to the server instead. */
+int
+client_dispatch_find(const char *command)
+{
+	for (size_t i = 0; i < sizeof(client_dispatch)/sizeof(*client_dispatch); ++i)
+		if (strcmp(client_dispatch[i].command, command) == 0)
+			return i;
+	return -1;
+}
+
 static struct client *
 find_client(int fd)
 {
-	for (int i = 0; i < clientptr; ++i) {
-		if (clients[i].fd == fd)
-			return &clients[i];
+	for (int i = 0; i < net->clientptr; ++i) {
+		if (net->clients[i].fd == fd)
+			return &net->clients[i];
 	}
 	return NULL;
 }
 
+/* client_write queues n bytes of buf to be sent to the client. buf must
+ * already end in "\r\n".
+ *
+ * The number of bytes written to the send buffer is returned, or -1 upon
+ * failure.
+ */
+int
+client_write(struct client *c, char *buf, int n)
+{
+	struct iobuf *b;
+	int r;
+
+	if (c->io) {
+		b = iobuf_new(buf, n);
+		r = client_put(c, b);
+		iobuf_put(b);
+		return r;
+	}
+
+	// Tell the event loop we want to write out
+	mca_ev_set_write(ev, c->fd, 1);
+
+	r = bufio_write(&c->b, buf, n);
+	stats_out(&c->st, n, c->b.sendptr, r != -1);
+
+	if (r == -1) {
+		PROBE3(drop, c->fd, n, c->b.sendptr);
+	} else {
+		PROBE3(enqueue, c->fd, n, c->b.sendptr);
+		stats_queued(&net->stats, &c->lat, c->st.bytes_out);
+	}
+	return r;
+}
+
+/* client_put queues b for a client whose writes are done by an I/O worker.
+ * b may be queued for any number of clients; the caller keeps its reference.
+ *
+ * The number of bytes queued is returned, or -1 if the worker is too far
+ * behind to take it.
+ */
+int
+client_put(struct client *c, struct iobuf *b)
+{
+	int r = worker_write(c->io, b, net->stats.rx);
+
+	// The worker counts the rest, once it has the line.
+	stats_out(&c->st, b ? b->len : 0, 0, r != -1);
+	return r == -1 ? -1 : (int)b->len;
+}
+
+/* client_view points st, b and lat at what c has sent so far. For a client
+ * with an I/O worker, the worker's counters are merged in, so the caller has
+ * to hold worker_lock_all. */
+void
+client_view(struct client *c, struct stats_conn *st, struct bufio **b, struct stats_lat **lat)
+{
+	*st = c->st;
+	*b = &c->b;
+	*lat = &c->lat;
+
+	if (!c->io)
+		return;
+
+	st->dropped += c->io->dropped;
+	st->sendq_max = c->io->sendq_max;
+	*b = &c->io->b;
+	*lat = &c->io->lat;
+}
+
 /* client_sendf sends a formatted response (ideally like IRC) to the client
  * The \r\n delimiters are automatically appended.
  *
@@ -57,9 +147,6 @@ client_sendf(struct client *c, const char *fmt, ...)
 {
 	char buf[2048];
 
-	// Tell the event loop we want to write out
-	mca_ev_set_write(ev, c->fd, 1);
-
 	// Chuck stuff onto the buffer
 	va_list ap;
 
@@ -74,7 +161,7 @@ client_sendf(struct client *c, const char *fmt, ...)
 	// TODO: Handle overfull scenarios gracefully. *printf ALWAYS returns
 	// what it would have written.
 
-	return bufio_write(&c->b, buf, n);
+	return client_write(c, buf, n);
 }
 
 /* client_sendmsg sends an IRC message to the client.
@@ -91,9 +178,6 @@ client_sendmsg(struct client *c, struct irc_message *msg)
 	if ((n = irc_string(msg, buf, sizeof(buf))) == -1)
 		return -1;
 
-	// Tell the event loop we want to write out
-	mca_ev_set_write(ev, c->fd, 1);
-
 	// Chuck stuff onto the buffer
 	debugf("%d >> %s", c->fd, buf);
 
@@ -102,19 +186,19 @@ client_sendmsg(struct client *c, struct irc_message *msg)
 	// TODO: Handle overfull scenarios gracefully. *printf ALWAYS returns
 	// what it would have written.
 
-	return bufio_write(&c->b, buf, n);
+	return client_write(c, buf, n);
 }
 
 int
 client_readable(int fd)
 {
-	int n;
+	int n, i;
 	struct client *c = find_client(fd);
 	assert(c != NULL);
 
 	if ((n = bufio_readable(&c->b, fd)) == -1) {
 		warnf("failed reading from client fd %d: %s", fd, strerror(errno));
-		close(c->fd);
+		loop_close(fd);
 		return 0;
 	}
 
@@ -122,22 +206,32 @@ client_readable(int fd)
 		return 0;
 	
 	debugf("%d << %s", fd, c->b.recvbuf);
+	PROBE3(receive, fd, c->b.recvbuf, n);
+	stats_in(&c->st, n);
+	capture_line(fd, c->b.recvbuf, strlen(c->b.recvbuf));
 
 	// Parse message
 	struct irc_message msg = {0};
 
 	if (irc_parse(c->b.recvbuf, &msg)) {
 		warnf("Failed to parse IRC message from client fd %d. Disconnecting.", fd);
-		close(fd);
+		loop_close(fd);
 		return 0;
 	}
+	PROBE2(parse, fd, msg.command);
 
 	// Try to hit a recognized command.
-	for (size_t i = 0; i < sizeof(client_dispatch)/sizeof(*client_dispatch); ++i)
-		if (strcmp(client_dispatch[i].command, msg.command) == 0)
-			return client_dispatch[i].f(c, &msg);
+	if ((i = client_dispatch_find(msg.command)) != -1) {
+		uint64_t t = TRACE_BEGIN();
+
+		PROBE2(dispatch, fd, msg.command);
+		n = client_dispatch[i].f(c, &msg);
+		TRACE_END("dispatch", fd, t);
+		return n;
+	}
 
 	// Pass onto server if all else fails
+	history_log(&net->history, &msg, intern_str(net->names, c->nick));
 	server_sendmsg(&msg);
 
 	return 1;
@@ -149,46 +243,47 @@ client_writable(int fd)
 	struct client *c = find_client(fd);
 	assert(c != NULL);
 
+	int queued = c->b.sendptr;
 	int n = bufio_writable(&c->b, fd);
 
+	if (n != -1) {
+		PROBE3(write, fd, queued - c->b.sendptr, c->b.sendptr);
+		stats_written(&net->stats, &c->lat, queued - c->b.sendptr);
+	}
+
 	if (n > 0) {
 		// Tell the event loop we no longer want to write out
 		mca_ev_set_write(ev, c->fd, 0);
 	} else if (n == -1) {
 		warnf("Write failed to fd %d: %s", fd, strerror(errno));
-		close(fd);
+		loop_close(fd);
 	}
 }
 
-/*
- * The rest of the file handles commands.
- */
-
-int
-cli_cap(struct client *c, struct irc_message *msg)
+/* client_register welcomes the client once it has sent both NICK and USER
+ * and is done negotiating capabilities. */
+static void
+client_register(struct client *c)
 {
+	const char *nick = intern_str(net->names, c->nick);
 
-}
+	if (c->registered || c->capping || !c->nick || !c->user)
+		return;
 
-int
-cli_login(struct client *c, struct irc_message *msg)
-{
-	if (c->nick)
-		free(c->nick);
-	c->nick = strdup(msg->params[0]);
+	c->registered = 1;
 
-	client_sendf(c, ":%s 001 %s :Welcome to icbm, %s", "example.com", c->nick, c->nick);
+	client_sendf(c, ":%s 001 %s :Welcome to icbm, %s", "example.com", nick, nick);
 
 	struct irc_message out = {0};
 	out.source = "example.com"; // TODO
 	out.command = "005";
-	out.params[0] = c->nick; // client ident
+	out.params[0] = (char *)nick; // client ident
 
 	// TODO: Ensure 512 bytes is not exceeded
 
 	size_t ctr = 1;
-	for (size_t i = 0; i < server_isupport.len; ++i) {
-		out.params[ctr++] = server_isupport.data[i];
+	for (size_t i = 0; i < net->isupport.len; ++i) {
+		out.params[ctr++] = net->isupport.data[i];
 
 		if (ctr == IRC_PARAM_MAX-2) {
 			out.params[ctr] = "are supported by this server";
@@ -204,6 +299,91 @@ cli_login(struct client *c, struct irc_message *msg)
 		client_sendmsg(c, &out);
 	}
 
+	split_register(c);
+}
+
+/*
+ * The rest of the file handles commands.
+ */
+
+int
+cli_cap(struct client *c, struct irc_message *msg)
+{
+	const char *nick = c->nick ? intern_str(net->names, c->nick) : "*";
+	char *sub = msg->params[0];
+	char buf[512];
+
+	if (!sub)
+		return 1;
+
+	if (strcasecmp(sub, "LS") == 0) {
+		// Registration waits until CAP END.
+		if (!c->registered)
+			c->capping = 1;
+
+		cap_list(CAP_ALL | (split_window ? CAP_SPLIT_SUMMARY : 0), buf, sizeof(buf));
+		client_sendf(c, ":%s CAP %s LS :%s", "example.com", nick, buf);
+	} else if (strcasecmp(sub, "LIST") == 0) {
+		cap_list(c->caps, buf, sizeof(buf));
+		client_sendf(c, ":%s CAP %s LIST :%s", "example.com", nick, buf);
+	} else if (strcasecmp(sub, "REQ") == 0 && msg->params[1]) {
+		int add = 0, del = 0, cap, old;
+		char *tok, *save;
+
+		if (!c->registered)
+			c->capping = 1;
+
+		// Requests are all or nothing.
+		snprintf(buf, sizeof(buf), "%s", msg->params[1]);
+		for (tok = strtok_r(buf, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+			if (!(cap = cap_find(tok + (*tok == '-')))) {
+				client_sendf(c, ":%s CAP %s NAK :%s", "example.com", nick, msg->params[1]);
+				return 1;
+			}
+
+			if (*tok == '-')
+				del |= cap;
+			else
+				add |= cap;
+		}
+
+		old = c->caps;
+		split_caps(c, old, (old | add) & ~del, 0);
+		c->caps = (old | add) & ~del;
+		client_sendf(c, ":%s CAP %s ACK :%s", "example.com", nick, msg->params[1]);
+		split_caps(c, old, c->caps, 1);
+	} else if (strcasecmp(sub, "END") == 0) {
+		c->capping = 0;
+		client_register(c);
+	} else {
+		client_sendf(c, ":%s 410 %s %s :Invalid CAP command", "example.com", nick, sub);
+	}
+
+	return 1;
+}
+
+int
+cli_login(struct client *c, struct irc_message *msg)
+{
+	if (!msg->params[0])
+		return 1;
+
+	if (strcmp(msg->command, "USER") == 0) {
+		c->user = 1;
+	} else {
+		intern_put(net->names, c->nick);
+		c->nick = intern_get(net->names, msg->params[0]);
+	}
+
+	client_register(c);
+	return 1;
+}
+
+/* cli_pass swallows PASS, which only ever picks the network; see the lobby
+ * in network.c. */
+int
+cli_pass(struct client *c, struct irc_message *msg)
+{
 	return 1;
 }
 
@@ -1,18 +1,39 @@
+#ifndef CLIENT_H_INC
+#define CLIENT_H_INC
+#include <stdint.h>
+
 #include "irc.h"
 #include "bufio.h"
+#include "stats.h"
+
+struct iobuf;
+struct ioconn;
 
 struct client {
 	int fd;
 	struct bufio b;
 	
-	char *nick;
-};
+	uint32_t nick; // In its network's names
+	int user;
+	int caps;
+	int capping; // In the middle of CAP negotiation
+	int registered;
 
-extern int clientsz;
-extern int clientptr;
-extern struct client *clients;
+	struct stats_conn st;
+	struct stats_lat lat;
 
+	// If set, an I/O worker does the writing, and b only receives.
+	struct ioconn *io;
+};
+
+int client_dispatch_find(const char *command);
 int client_readable(int fd);
 void client_writable(int fd);
 
+int client_write(struct client *c, char *buf, int n);
+int client_put(struct client *c, struct iobuf *b);
 int client_sendf(struct client *c, const char *fmt, ...);
+int client_sendmsg(struct client *c, struct irc_message *msg);
+
+void client_view(struct client *c, struct stats_conn *st, struct bufio **b, struct stats_lat **lat);
+#endif
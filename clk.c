@@ -0,0 +1,87 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+
+#include "clk.h"
+
+/* The coarse clocks are read without a syscall and without touching the
+ * hardware clock, which is all we need when the answer is shared by every
+ * line handled in one loop iteration. */
+#ifdef CLOCK_MONOTONIC_COARSE
+#define CLK_MONO CLOCK_MONOTONIC_COARSE
+#define CLK_REAL CLOCK_REALTIME_COARSE
+#else
+#define CLK_MONO CLOCK_MONOTONIC
+#define CLK_REAL CLOCK_REALTIME
+#endif
+
+__thread struct timespec clk_mono, clk_real;
+
+// Formatted strings, redone when the second changes.
+static __thread time_t fmtsec = -1;
+static __thread char iso[32] = "1970-01-01T00:00:00.000Z";
+static __thread char local[32];
+
+/* clk_refresh reads the clocks. */
+void
+clk_refresh(void)
+{
+	struct tm tm;
+	int ms;
+
+	clock_gettime(CLK_MONO, &clk_mono);
+	clock_gettime(CLK_REAL, &clk_real);
+
+	if (clk_real.tv_sec != fmtsec) {
+		fmtsec = clk_real.tv_sec;
+
+		gmtime_r(&fmtsec, &tm);
+		strftime(iso, sizeof(iso), "%Y-%m-%dT%H:%M:%S.000Z", &tm);
+
+		if (localtime_r(&fmtsec, &tm))
+			strftime(local, sizeof(local), "%F %H:%M:%S", &tm);
+	}
+
+	// Only the milliseconds change within a second.
+	ms = clk_real.tv_nsec / 1000000;
+	iso[20] = '0' + ms / 100;
+	iso[21] = '0' + ms / 10 % 10;
+	iso[22] = '0' + ms % 10;
+}
+
+/* clk_mono_ms returns the monotonic time in milliseconds. */
+long long
+clk_mono_ms(void)
+{
+	if (fmtsec == -1)
+		clk_refresh();
+	return (long long)clk_mono.tv_sec * 1000 + clk_mono.tv_nsec / 1000000;
+}
+
+/* clk_real_ms returns the unix time in milliseconds. */
+long long
+clk_real_ms(void)
+{
+	if (fmtsec == -1)
+		clk_refresh();
+	return (long long)clk_real.tv_sec * 1000 + clk_real.tv_nsec / 1000000;
+}
+
+/* clk_iso returns the time in the format used by the server-time capability,
+ * e.g. "2023-01-02T03:04:05.678Z". */
+const char *
+clk_iso(void)
+{
+	if (fmtsec == -1)
+		clk_refresh();
+	return iso;
+}
+
+/* clk_local returns the local time as it appears in logs. */
+const char *
+clk_local(void)
+{
+	if (fmtsec == -1)
+		clk_refresh();
+	return local;
+}
@@ -0,0 +1,14 @@
+#ifndef CLK_H_INC
+#define CLK_H_INC
+#include <time.h>
+
+/* The time as of the last call to clk_refresh, which every event loop makes
+ * each time poll(2) returns. Each thread has its own. */
+extern __thread struct timespec clk_mono, clk_real;
+
+void clk_refresh(void);
+long long clk_mono_ms(void);
+long long clk_real_ms(void);
+const char *clk_iso(void);
+const char *clk_local(void);
+#endif
@@ -0,0 +1,406 @@
+#define _GNU_SOURCE // For struct ucred
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cap.h"
+#include "client.h"
+#include "cmd.h"
+#include "clk.h"
+#include "history.h"
+#include "intern.h"
+#include "log.h"
+#include "mem.h"
+#include "network.h"
+#include "server.h"
+#include "stats.h"
+#include "trace.h"
+#include "worker.h"
+
+#define SEARCH_LIMIT 50
+#define SEARCH_LIMIT_MAX 500
+
+static int cmd_history(struct client *c, struct irc_message *msg);
+static int cmd_search(struct client *c, struct irc_message *msg);
+static int cmd_stats(struct client *c, struct irc_message *msg);
+static int cmd_trace(struct client *c, struct irc_message *msg);
+
+/* Bouncer-local commands, sent by clients as "ICBM <command> ...". */
+static struct {
+	char *command;
+	int (*f)(struct client *c, struct irc_message *msg);
+} cmd_dispatch[] = {
+	{ "HISTORY",	cmd_history },
+	{ "SEARCH",	cmd_search },
+	{ "STATS",	cmd_stats },
+	{ "TRACE",	cmd_trace },
+};
+
+static __thread int batchid = 0;
+
+/* cmd_icbm handles the ICBM command by passing it onto one of the above.
+ * The subcommand is left in params[0]. */
+int
+cmd_icbm(struct client *c, struct irc_message *msg)
+{
+	if (!msg->params[0]) {
+		client_sendf(c, "FAIL ICBM NEED_MORE_PARAMS :Missing subcommand");
+		return 1;
+	}
+
+	for (size_t i = 0; i < sizeof(cmd_dispatch)/sizeof(*cmd_dispatch); ++i)
+		if (strcasecmp(cmd_dispatch[i].command, msg->params[0]) == 0)
+			return cmd_dispatch[i].f(c, msg);
+
+	client_sendf(c, "FAIL ICBM UNKNOWN_COMMAND %s :Unknown subcommand", msg->params[0]);
+	return 1;
+}
+
+struct batch {
+	struct client *c;
+	int batch;
+};
+
+/* batch_start opens a batch, if the client knows what one is. */
+static void
+batch_start(struct batch *st, const char *type, const char *target)
+{
+	if (st->c->caps & CAP_BATCH)
+		client_sendf(st->c, ":%s BATCH +%d %s %s", "example.com", st->batch, type, target);
+}
+
+static void
+batch_end(struct batch *st)
+{
+	if (st->c->caps & CAP_BATCH)
+		client_sendf(st->c, ":%s BATCH -%d", "example.com", st->batch);
+}
+
+/* batch_line sends a line from the message log as part of a batch. */
+static int
+batch_line(long long ms, char *line, void *arg)
+{
+	struct batch *st = arg;
+	time_t t = ms / 1000;
+	char ts[32], tags[128], out[128];
+
+	strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", gmtime(&t));
+	snprintf(tags, sizeof(tags), "batch=%d;time=%s.%03dZ", st->batch, ts, (int)(ms % 1000));
+
+	if (!cap_tags(st->c->caps, tags, out, sizeof(out)))
+		return client_sendf(st->c, "%s", line) == -1;
+
+	return client_sendf(st->c, "@%s %s", out, line) == -1;
+}
+
+/* cmd_search searches the message log.
+ *
+ *	ICBM SEARCH <target> [limit] :<text>
+ *
+ * Results are sent back as an icbm/search batch, oldest first. A target of
+ * "*" searches every conversation.
+ */
+int
+cmd_search(struct client *c, struct irc_message *msg)
+{
+	struct batch st = { c, ++batchid };
+	char *target = msg->params[1], *q = msg->params[2];
+	long limit = SEARCH_LIMIT;
+	int n;
+
+	if (msg->params[3]) {
+		limit = strtol(msg->params[2], NULL, 10);
+		q = msg->params[3];
+	}
+
+	if (!target || !q) {
+		client_sendf(c, "FAIL ICBM NEED_MORE_PARAMS SEARCH :Usage: ICBM SEARCH <target> [limit] :<text>");
+		return 1;
+	}
+
+	if (strlen(q) < 3) {
+		client_sendf(c, "FAIL ICBM INVALID_PARAMS SEARCH :Search text must be at least 3 characters");
+		return 1;
+	}
+
+	if (!net->history.dir) {
+		client_sendf(c, "FAIL ICBM UNAVAILABLE SEARCH :No message log is being kept");
+		return 1;
+	}
+
+	if (limit <= 0 || limit > SEARCH_LIMIT_MAX)
+		limit = SEARCH_LIMIT_MAX;
+
+	batch_start(&st, "icbm/search", target);
+
+	if ((n = history_search(&net->history, target, q, limit, batch_line, &st)) == -1)
+		warnf("Search by client fd %d failed", c->fd);
+
+	batch_end(&st);
+
+	debugf("%d searched %s for \"%s\": %d results", c->fd, target, q, n);
+	return 1;
+}
+
+/* parse_time parses a unix time in milliseconds, or "*" for def. */
+static int
+parse_time(const char *s, long long def, long long *out)
+{
+	char *end;
+
+	if (strcmp(s, "*") == 0) {
+		*out = def;
+		return 0;
+	}
+
+	*out = strtoll(s, &end, 10);
+	return *end || end == s ? -1 : 0;
+}
+
+/* cmd_history reads the message log between two points in time.
+ *
+ *	ICBM HISTORY <target> <from> <to> [limit]
+ *
+ * Times are unix times in milliseconds, or "*" to leave that end open.
+ * Results are sent back as an icbm/history batch, oldest first.
+ */
+int
+cmd_history(struct client *c, struct irc_message *msg)
+{
+	struct batch st = { c, ++batchid };
+	char *target = msg->params[1];
+	long limit = SEARCH_LIMIT;
+	long long from, to;
+	int n;
+
+	if (!target || !msg->params[2] || !msg->params[3]) {
+		client_sendf(c, "FAIL ICBM NEED_MORE_PARAMS HISTORY :Usage: ICBM HISTORY <target> <from> <to> [limit]");
+		return 1;
+	}
+
+	if (parse_time(msg->params[2], 0, &from) == -1 || parse_time(msg->params[3], LLONG_MAX, &to) == -1) {
+		client_sendf(c, "FAIL ICBM INVALID_PARAMS HISTORY :Times must be in milliseconds or *");
+		return 1;
+	}
+
+	if (!net->history.dir) {
+		client_sendf(c, "FAIL ICBM UNAVAILABLE HISTORY :No message log is being kept");
+		return 1;
+	}
+
+	if (msg->params[4])
+		limit = strtol(msg->params[4], NULL, 10);
+	if (limit <= 0 || limit > SEARCH_LIMIT_MAX)
+		limit = SEARCH_LIMIT_MAX;
+
+	batch_start(&st, "icbm/history", target);
+	n = history_range(&net->history, target, from, to, limit, batch_line, &st);
+	batch_end(&st);
+
+	debugf("%d read %s from %lld to %lld: %d results", c->fd, target, from, to, n);
+	return 1;
+}
+
+/* stats_conn sends the counters of one connection as RPL_STATSDEBUG. */
+static void
+stats_conn(struct client *c, const char *nick, const char *name, struct stats_conn *st,
+	struct bufio *b)
+{
+	client_sendf(c, ":%s 249 %s :%s: in %llu lines %llu bytes, out %llu lines %llu bytes, "
+		"dropped %llu, sendq %d/%zu (cap %d)", "example.com", nick, name,
+		(unsigned long long)st->lines_in, (unsigned long long)st->bytes_in,
+		(unsigned long long)st->lines_out, (unsigned long long)st->bytes_out,
+		(unsigned long long)st->dropped, b->sendptr, st->sendq_max, b->sendcap);
+}
+
+/* stats_lat sends the latency of lines from the server to one client as
+ * RPL_STATSDEBUG, if any have been sent. */
+static void
+stats_lat(struct client *c, const char *nick, const char *name, struct stats_lat *l)
+{
+	if (!l->write.count)
+		return;
+
+	client_sendf(c, ":%s 249 %s :%s: latency p50 %lluus p99 %lluus max %lluus, "
+		"of which queued p50 %lluus p99 %lluus max %lluus", "example.com", nick, name,
+		(unsigned long long)histo_small_quantile(&l->write, 0.5) / 1000,
+		(unsigned long long)histo_small_quantile(&l->write, 0.99) / 1000,
+		(unsigned long long)l->write.max / 1000,
+		(unsigned long long)histo_small_quantile(&l->queue, 0.5) / 1000,
+		(unsigned long long)histo_small_quantile(&l->queue, 0.99) / 1000,
+		(unsigned long long)l->queue.max / 1000);
+}
+
+/* stats_latency sends the latency of lines from the server to clients, over
+ * every client counted in s, as RPL_STATSDEBUG. */
+static void
+stats_latency(struct client *c, const char *nick, const char *name, struct stats *s)
+{
+	const struct histo *write = stats_histo(s->write), *queue = stats_histo(s->queue);
+
+	client_sendf(c, ":%s 249 %s :%s: %llu samples, server to client p50 %lluus p99 %lluus "
+		"max %lluus, of which queued p50 %lluus p99 %lluus max %lluus", "example.com", nick, name,
+		(unsigned long long)write->count,
+		(unsigned long long)histo_quantile(write, 0.5) / 1000,
+		(unsigned long long)histo_quantile(write, 0.99) / 1000,
+		(unsigned long long)write->max / 1000,
+		(unsigned long long)histo_quantile(queue, 0.5) / 1000,
+		(unsigned long long)histo_quantile(queue, 0.99) / 1000,
+		(unsigned long long)queue->max / 1000);
+}
+
+/* operator reports whether c may see and change what is the whole
+ * process's rather than its user's: anyone may when there are no users, and
+ * otherwise only a peer on a unix socket that is icbm's owner, or root. */
+static int
+operator(struct client *c)
+{
+	struct sockaddr_storage sa;
+	socklen_t salen = sizeof(sa);
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+
+	if (!users)
+		return 1;
+
+	if (getsockname(c->fd, (struct sockaddr *)&sa, &salen) == -1 || sa.ss_family != AF_UNIX ||
+	    getsockopt(c->fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1)
+		return 0;
+
+	return cred.uid == geteuid() || cred.uid == 0;
+}
+
+/* cmd_stats reports what the bouncer has been up to.
+ *
+ *	ICBM STATS
+ *
+ * Each counter is sent as RPL_STATSDEBUG (249), then RPL_ENDOFSTATS (219).
+ * Only the client's own network and loop are reported on; the log, memory
+ * and worker counters are for the whole process, and only sent to the
+ * operator.
+ */
+int
+cmd_stats(struct client *c, struct irc_message *msg)
+{
+	const char *nick = c->nick ? intern_str(net->names, c->nick) : "*";
+	long long up = (clk_mono_ms() - net->stats.started) / 1000;
+	int op = operator(c);
+	char name[32];
+
+	client_sendf(c, ":%s 249 %s :network %s: up %llds, forwarding %llu lines/s, %llu forwarded in total",
+		"example.com", nick, net->name, up, (unsigned long long)net->stats.persec,
+		(unsigned long long)net->stats.forwarded);
+
+	if (net->user) {
+		char limit[16] = "no limit";
+
+		if (net->user->maxclients)
+			snprintf(limit, sizeof(limit), "at most %d", net->user->maxclients);
+
+		client_sendf(c, ":%s 249 %s :user %s: %d clients, %s, send buffers up to %d bytes",
+			"example.com", nick, net->user->name, __atomic_load_n(&net->user->clients, __ATOMIC_RELAXED),
+			limit, net->user->sendq ? net->user->sendq : BUFIO_SENDBUF_MAX);
+	}
+
+	client_sendf(c, ":%s 249 %s :%s: %llu wakeups, busy p50 %lluus p99 %lluus max %lluus",
+		"example.com", nick, loop->name, (unsigned long long)loop->stats.loop.count,
+		(unsigned long long)histo_quantile(&loop->stats.loop, 0.5) / 1000,
+		(unsigned long long)histo_quantile(&loop->stats.loop, 0.99) / 1000,
+		(unsigned long long)loop->stats.loop.max / 1000);
+
+	stats_latency(c, nick, "latency", &net->stats);
+
+	if (op)
+		client_sendf(c, ":%s 249 %s :log: %llu messages dropped", "example.com", nick, log_dropped());
+
+	for (int i = 0; op && i < MEM_LAST; ++i) {
+		struct mem_tag t = mem_get(i);
+
+		client_sendf(c, ":%s 249 %s :mem: %s %zu bytes live, %zu peak, %llu allocations, %llu frees",
+			"example.com", nick, mem_names[i], t.live, t.peak, (unsigned long long)t.allocs,
+			(unsigned long long)t.frees);
+	}
+	client_sendf(c, ":%s 249 %s :mem: history of %s %zu bytes", "example.com", nick,
+		net->name, history_bytes(&net->history));
+
+	stats_conn(c, nick, "server", &net->stats.server, &net->bufio);
+
+	worker_lock_all();
+
+	for (int i = 0; op && i < nworkers; ++i) {
+		struct worker *w = &workers[i];
+
+		client_sendf(c, ":%s 249 %s :%s: %d clients, %llu wakeups, busy p50 %lluus p99 %lluus max %lluus",
+			"example.com", nick, w->l.name, w->nconns, (unsigned long long)w->l.stats.loop.count,
+			(unsigned long long)histo_quantile(&w->l.stats.loop, 0.5) / 1000,
+			(unsigned long long)histo_quantile(&w->l.stats.loop, 0.99) / 1000,
+			(unsigned long long)w->l.stats.loop.max / 1000);
+
+		snprintf(name, sizeof(name), "%s latency", w->l.name);
+		stats_latency(c, nick, name, &w->stats);
+	}
+
+	for (int i = 0; i < net->clientptr; ++i) {
+		const char *cn = net->clients[i].nick ? intern_str(net->names, net->clients[i].nick) : "*";
+		struct stats_conn st;
+		struct stats_lat *lat;
+		struct bufio *b;
+
+		client_view(&net->clients[i], &st, &b, &lat);
+		snprintf(name, sizeof(name), "fd %d %s", net->clients[i].fd, cn);
+		stats_conn(c, nick, name, &st, b);
+		stats_lat(c, nick, name, lat);
+	}
+
+	worker_unlock_all();
+
+	client_sendf(c, ":%s 219 %s ICBM :End of /STATS report", "example.com", nick);
+	return 1;
+}
+
+/* cmd_trace turns tracing on or off, or writes the trace out.
+ *
+ *	ICBM TRACE <ON|OFF|DUMP>
+ *
+ * The trace always goes to the file given with -T, so that clients cannot
+ * write anywhere else. It covers every network, so with users only the
+ * operator may trace.
+ */
+int
+cmd_trace(struct client *c, struct irc_message *msg)
+{
+	const char *op = msg->params[1];
+
+	if (!op) {
+		client_sendf(c, "FAIL ICBM NEED_MORE_PARAMS TRACE :Usage: ICBM TRACE <ON|OFF|DUMP>");
+		return 1;
+	}
+
+	if (!operator(c)) {
+		client_sendf(c, "FAIL ICBM NO_PRIVILEGES TRACE :Only icbm's owner may trace, over a unix socket");
+		return 1;
+	}
+
+	if (strcasecmp(op, "ON") == 0) {
+		trace_on = 1;
+		client_sendf(c, "NOTE ICBM TRACE ON :Tracing");
+	} else if (strcasecmp(op, "OFF") == 0) {
+		trace_on = 0;
+		client_sendf(c, "NOTE ICBM TRACE OFF :Not tracing");
+	} else if (strcasecmp(op, "DUMP") == 0) {
+		if (trace_dump(trace_path) == -1)
+			client_sendf(c, "FAIL ICBM UNAVAILABLE TRACE :Failed to write %s: %s", trace_path, strerror(errno));
+		else
+			client_sendf(c, "NOTE ICBM TRACE DUMP :Trace written to %s", trace_path);
+	} else
+		client_sendf(c, "FAIL ICBM INVALID_PARAMS TRACE :Usage: ICBM TRACE <ON|OFF|DUMP>");
+
+	return 1;
+}
@@ -0,0 +1,4 @@
+struct client;
+struct irc_message;
+
+int cmd_icbm(struct client *c, struct irc_message *msg);
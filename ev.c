@@ -28,6 +28,7 @@
 #include <string.h>
 
 #include "ev.h"
+#include "mem.h"
 
 static int
 ensure(struct mca_ev *ev, size_t n)
@@ -37,7 +38,7 @@ ensure(struct mca_ev *ev, size_t n)
 	if (new_size > ev->cap) {
 		struct pollfd *pfds;
 
-		if (!(pfds = realloc(ev->pfds, sizeof(*pfds) * new_size)))
+		if (!(pfds = mem_realloc(MEM_EV, ev->pfds, sizeof(*pfds) * new_size)))
 			return -1;
 
 		ev->pfds = pfds;
@@ -50,7 +51,7 @@ ensure(struct mca_ev *ev, size_t n)
 static size_t
 find(struct mca_ev *ev, int fd, struct pollfd **out)
 {
-	struct pollfd *pfd;
+	struct pollfd *pfd = NULL;
 	size_t i;
 
 	for (i = 0; i < ev->len; ++i) {
@@ -84,27 +85,103 @@ pending_writes(struct mca_ev *ev)
 	return 0;
 }
 
+static int
+is_ready(struct mca_ev *ev, int fd)
+{
+	for (size_t i = 0; i < ev->nready; ++i)
+		if (ev->ready[i] == fd)
+			return 1;
+	return 0;
+}
+
+static void
+unready(struct mca_ev *ev, int fd)
+{
+	for (size_t i = 0; i < ev->nready; ++i) {
+		if (ev->ready[i] == fd) {
+			ev->ready[i] = ev->ready[--ev->nready];
+			return;
+		}
+	}
+}
+
+/* drain calls on_readable for fd until it returns 0, or fd has had its
+ * budget, in which case fd is put on the ready list. */
+static void
+drain(struct mca_ev *ev, int fd)
+{
+	int n = ev->on_budget ? ev->on_budget(ev, fd, ev->userdata) : ev->budget;
+
+	while (ev->on_readable(ev, fd, ev->userdata)) {
+		if (n <= 0 || --n > 0)
+			continue;
+
+		// Gone already, if the handler removed it.
+		if (find(ev, fd, NULL) == -1)
+			return;
+
+		if (ev->nready == ev->readycap) {
+			size_t cap = ev->readycap ? ev->readycap * 2 : 8;
+			int *r;
+
+			// Without room to remember it, it is read to the end.
+			if (!(r = mem_realloc(MEM_EV, ev->ready, sizeof(*r) * cap))) {
+				while (ev->on_readable(ev, fd, ev->userdata));
+				return;
+			}
+
+			ev->ready = r;
+			ev->readycap = cap;
+		}
+
+		ev->ready[ev->nready++] = fd;
+		return;
+	}
+}
+
 static int
 do_poll(struct mca_ev *ev, int timeout, int ignore_read)
 {
+	struct pollfd *pfd;
+	size_t nready;
 	int i;
 
+	// Left over work means there is no waiting around.
+	if (ev->nready && !ignore_read)
+		timeout = 0;
+
 	i = poll(ev->pfds, ev->len, timeout);
 	if (i == -1)
 		return i;
 
+	if (ev->on_wake)
+		ev->on_wake(ev, ev->userdata);
+
+	// What was left over last time is read again, as if poll(2) had said
+	// it was readable; it waits its turn like everyone else.
+	if (!ignore_read) {
+		nready = ev->nready;
+		ev->nready = 0;
+		for (size_t j = 0; j < nready; ++j)
+			if (find(ev, ev->ready[j], &pfd) != -1)
+				pfd->revents |= POLLIN;
+	}
+
 	for (i = 0; i < ev->len; ++i) {
 		if (!ignore_read && ev->pfds[i].revents & POLLIN)
-			while (ev->on_readable(ev, ev->pfds[i].fd, ev->userdata));
+			drain(ev, ev->pfds[i].fd);
 
 		if (ev->pfds[i].revents & POLLOUT && ev->on_writable)
 			ev->on_writable(ev, ev->pfds[i].fd, ev->userdata);
 	}
 
-	// Remove dead clients
+	// Remove dead clients, once they have been read to the end
 	for (i = 0; i < ev->len; ++i) {
 		if (!(ev->pfds[i].revents & (POLLHUP | POLLERR | POLLNVAL)))
 			continue;
+
+		if (!ignore_read && ev->pfds[i].revents & POLLHUP && is_ready(ev, ev->pfds[i].fd))
+			continue;
 		
 		// TODO: don't use this; this searches through the list again
 		mca_ev_remove(ev, ev->pfds[i].fd);
@@ -114,6 +191,10 @@ do_poll(struct mca_ev *ev, int timeout, int ignore_read)
 }
 
 /* Creates a new instance of ev and stores it in its argument.
+ *
+ * on_wake, if set, is called every time poll(2) returns, before any other
+ * handler. It is a good place to do per-iteration work such as reading the
+ * clock.
  *
  * If allocation fails, -1 is returned and its argument is left unmodified.
  */
@@ -122,13 +203,13 @@ mca_ev_new(struct mca_ev **ev)
 {
 	struct mca_ev *nev;
 
-	if (!(nev = malloc(sizeof(*nev))))
+	if (!(nev = mem_malloc(MEM_EV, sizeof(*nev))))
 		return -1;
 	memset(nev, 0, sizeof(*nev));
 
 	// Allocate the pfd array.
 	if (ensure(nev, MCA_EV_INIT_SIZE) == -1) {
-		free(nev);
+		mem_free(MEM_EV, nev);
 		return -1;
 	}
 
@@ -142,8 +223,10 @@ void
 mca_ev_free(struct mca_ev *ev)
 {
 	if (ev->pfds)
-		free(ev->pfds);
-	free(ev);
+		mem_free(MEM_EV, ev->pfds);
+	if (ev->ready)
+		mem_free(MEM_EV, ev->ready);
+	mem_free(MEM_EV, ev);
 }
 
 /* Appends a file descriptor to the event loop using flags.
@@ -203,6 +286,7 @@ mca_ev_remove(struct mca_ev *ev, int fd)
 	if (ev->on_remove)
 		ev->on_remove(ev, fd, ev->userdata);
 
+	unready(ev, fd);
 	ev->len--;
 	memmove(ev->pfds + i, ev->pfds + i + 1, (ev->len - i)*sizeof(*pfd));
 }
@@ -41,6 +41,19 @@ struct mca_ev {
 
 	void *userdata;
 
+	// How many times on_readable may be called for a file descriptor each
+	// iteration, or 0 for as long as it returns non-zero. on_budget, if
+	// set, says instead.
+	int budget;
+	int (*on_budget)(struct mca_ev *ev, int fd, void *userdata);
+
+	// File descriptors that used up their budget, to be read again next
+	// iteration whether poll(2) says so or not.
+	int *ready;
+	size_t nready;
+	size_t readycap;
+
+	void (*on_wake)(struct mca_ev *ev, void *userdata);
 	int (*on_readable)(struct mca_ev *ev, int fd, void *userdata);
 	int (*on_writable)(struct mca_ev *ev, int fd, void *userdata);
 	int (*on_remove)(struct mca_ev *ev, int fd, void *userdata);
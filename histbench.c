@@ -0,0 +1,319 @@
+#define _POSIX_C_SOURCE 200809L
+
+/* histbench measures how well message log segments compress, and how fast
+ * they can be read back compared to leaving them uncompressed.
+ *
+ * Usage: histbench [segment.log]
+ *
+ * Without a segment, an 8 MiB one is made up from random chatter.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "log.h"
+#include "lz.h"
+
+#define ROUNDS 20
+#define LOOKUPS 100000
+
+struct block {
+	size_t rawoff, rawlen, off, len;
+};
+
+static const char *words[] = {
+	"the", "a", "is", "it", "to", "of", "and", "in", "that", "have", "i",
+	"for", "not", "on", "with", "he", "as", "you", "do", "at", "this",
+	"but", "his", "by", "from", "they", "we", "say", "her", "she", "or",
+	"bouncer", "kernel", "patch", "build", "broken", "works", "lol", "ok",
+	"anyone", "know", "why", "segfault", "compile", "merged", "release",
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* synth makes up n bytes worth of records that look like a busy network. */
+static char *
+synth(size_t n, size_t *len)
+{
+	char *buf = malloc(n + 4096);
+	long long ms = 1700000000000LL;
+	size_t off = 0;
+
+	while (off < n) {
+		int nick = rand() % 300, chan = rand() % 25, nw = 3 + rand() % 15;
+
+		off += sprintf(buf + off, "%lld :user%d!~user%d@host-%d.example.net %s #channel%d :",
+			ms += rand() % 2000, nick, nick, nick * 7919 % 1000,
+			rand() % 10 ? "PRIVMSG" : "NOTICE", chan);
+
+		for (int i = 0; i < nw; ++i)
+			off += sprintf(buf + off, "%s%s", i ? " " : "",
+				words[rand() % (sizeof(words)/sizeof(*words))]);
+
+		buf[off++] = '\n';
+	}
+
+	*len = off;
+	return buf;
+}
+
+static char *
+slurp(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	char *buf;
+	long n;
+
+	if (!f)
+		return NULL;
+
+	fseek(f, 0, SEEK_END);
+	n = ftell(f);
+	rewind(f);
+
+	if (!(buf = malloc(n ? n : 1)) || fread(buf, 1, n, f) != n) {
+		free(buf);
+		fclose(f);
+		return NULL;
+	}
+
+	fclose(f);
+	*len = n;
+	return buf;
+}
+
+/* put writes the n bytes at p to dir/name. */
+static int
+put(const char *dir, const char *name, const char *p, size_t n)
+{
+	char path[4096];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if (!(f = fopen(path, "wb"))) {
+		perror(path);
+		return -1;
+	}
+
+	fwrite(p, 1, n, f);
+	if (ferror(f) | fclose(f)) {
+		perror(path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* clean removes what a message log in dir may have made of the segment. */
+static void
+clean(const char *dir)
+{
+	static const char *names[] = {
+		"00000000.log", "00000000.idx", "00000000.lz", "00000000.lz.tmp", "00000001.log",
+	};
+	char path[4096];
+
+	for (size_t i = 0; i < sizeof(names)/sizeof(*names); ++i) {
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		unlink(path);
+	}
+	rmdir(dir);
+}
+
+/* count adds up the lengths of the records it is passed, at arg. */
+static int
+count(long long ms, char *line, void *arg)
+{
+	*(size_t *)arg += strlen(line);
+	return 0;
+}
+
+/* open_log makes a message log of the len bytes of records at raw in dir,
+ * as a sealed segment followed by an empty one, and opens it. */
+static int
+open_log(struct history *h, const char *dir, int compress, const char *raw, size_t len)
+{
+	if (mkdir(dir, 0700) == -1 || put(dir, "00000000.log", raw, len) == -1 ||
+	    put(dir, "00000001.log", "", 0) == -1)
+		return -1;
+
+	// Opening it seals the segment, and compresses it in the background.
+	// The log switches over the next time it is read from.
+	if (history_open(h, dir, compress) == -1)
+		return -1;
+
+	for (int i = 0; compress && !h->segs[0].blocks && i < 1000; ++i) {
+		nanosleep(&(struct timespec){ 0, 10000000 }, NULL);
+		history_range(h, "*", 0, 0, 0, count, NULL);
+	}
+
+	return 0;
+}
+
+/* range times reading the records between from and to back from h, the way
+ * ICBM HISTORY does. */
+static double
+range(struct history *h, long long from, long long to, size_t *n)
+{
+	double t = now();
+
+	*n = 0;
+	for (int r = 0; r < ROUNDS; ++r)
+		history_range(h, "*", from, to, SIZE_MAX, count, n);
+
+	return now() - t;
+}
+
+/* readback reads the middle half of the records at raw, by time, back from a
+ * segment file left as it is and from a compressed one, both through the
+ * message log's own read path and from the page cache. */
+static int
+readback(const char *raw, size_t len)
+{
+	char dir[] = "/tmp/histbenchXXXXXX", logdir[64], lzdir[64];
+	struct history h = {0}, z = {0};
+	long long first, last, from, to;
+	const char *p;
+	size_t n, zn;
+	double t, zt;
+	int ret = -1;
+
+	first = strtoll(raw, NULL, 10);
+	for (p = raw + len - 1; p > raw && p[-1] != '\n'; --p);
+	last = strtoll(p, NULL, 10);
+	from = first + (last - first) / 4;
+	to = last - (last - first) / 4;
+
+	if (!mkdtemp(dir)) {
+		perror(dir);
+		return -1;
+	}
+	snprintf(logdir, sizeof(logdir), "%s/log", dir);
+	snprintf(lzdir, sizeof(lzdir), "%s/lz", dir);
+
+	if (open_log(&h, logdir, 0, raw, len) == -1 || open_log(&z, lzdir, 1, raw, len) == -1) {
+		fprintf(stderr, "failed to make message logs in %s\n", dir);
+		goto done;
+	}
+
+	if (!z.segs[0].blocks) {
+		fprintf(stderr, "segment in %s was not compressed\n", lzdir);
+		goto done;
+	}
+
+	t = range(&h, from, to, &n);
+	zt = range(&z, from, to, &zn);
+	if (n != zn) {
+		fprintf(stderr, "ranges differ: %zu and %zu bytes\n", n, zn);
+		goto done;
+	}
+
+	printf("range:      %.1f MB/s uncompressed, %.1f MB/s compressed (%.2fx), %zu bytes\n",
+		n / t / 1e6, n / zt / 1e6, t / zt, n / ROUNDS);
+	ret = 0;
+
+done:
+	history_close(&h);
+	history_close(&z);
+	clean(logdir);
+	clean(lzdir);
+	rmdir(dir);
+	return ret;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *raw, *comp, *dec;
+	struct block *blocks;
+	size_t len, nblocks = 0, clen = 0, sink = 0;
+	double t;
+
+	// The message log says when it opens, seals and compresses.
+	log_level = LOG_WARN;
+
+	if (argc > 1) {
+		if (!(raw = slurp(argv[1], &len))) {
+			perror(argv[1]);
+			return 1;
+		}
+	} else
+		raw = synth(HISTORY_SEGMENT_MAX, &len);
+
+	blocks = malloc(sizeof(*blocks) * (len / (HISTORY_BLOCK_SIZE / 2) + 2));
+	comp = malloc(LZ_BOUND(len) + len / 255 + 16 * (len / HISTORY_BLOCK_SIZE + 2));
+	dec = malloc(HISTORY_BLOCK_SIZE);
+
+	// Split into blocks of whole records, the same way the log does.
+	t = now();
+	for (size_t off = 0; off < len; ) {
+		size_t end = off, next;
+		char *nl;
+
+		while (end < len && (nl = memchr(raw + end, '\n', len - end)) &&
+		    (next = nl - raw + 1) - off <= HISTORY_BLOCK_SIZE)
+			end = next;
+		if (end == off)
+			end = len - off > HISTORY_BLOCK_SIZE ? off + HISTORY_BLOCK_SIZE : len;
+
+		blocks[nblocks].rawoff = off;
+		blocks[nblocks].rawlen = end - off;
+		blocks[nblocks].off = clen;
+		blocks[nblocks].len = lz_compress(raw + off, end - off, comp + clen, LZ_BOUND(end - off));
+		clen += blocks[nblocks++].len;
+		off = end;
+	}
+	t = now() - t;
+
+	printf("raw:        %zu bytes in %zu blocks of %d bytes\n", len, nblocks, HISTORY_BLOCK_SIZE);
+	printf("compressed: %zu bytes + %zu bytes of index (%.2fx)\n", clen,
+		nblocks * sizeof(struct history_block),
+		(double)len / (clen + nblocks * sizeof(struct history_block)));
+	printf("compress:   %.1f MB/s\n", len / t / 1e6);
+
+	// Check that everything survives the round trip.
+	for (size_t i = 0; i < nblocks; ++i) {
+		if (lz_decompress(comp + blocks[i].off, blocks[i].len, dec, HISTORY_BLOCK_SIZE) != blocks[i].rawlen ||
+		    memcmp(dec, raw + blocks[i].rawoff, blocks[i].rawlen) != 0) {
+			fprintf(stderr, "block %zu does not round trip\n", i);
+			return 1;
+		}
+	}
+
+	t = now();
+	for (int r = 0; r < ROUNDS; ++r)
+		for (size_t i = 0; i < nblocks; ++i)
+			sink += lz_decompress(comp + blocks[i].off, blocks[i].len, dec, HISTORY_BLOCK_SIZE);
+	t = now() - t;
+	printf("decompress: %.1f MB/s\n", (double)len * ROUNDS / t / 1e6);
+
+	if (readback(raw, len) == -1)
+		return 1;
+
+	// Random access to single records, the worst case for blocks.
+	t = now();
+	for (int i = 0; i < LOOKUPS; ++i) {
+		size_t b = rand() % nblocks;
+		sink += lz_decompress(comp + blocks[b].off, blocks[b].len, dec, HISTORY_BLOCK_SIZE);
+	}
+	t = now() - t;
+	printf("random:     %.2f us per record (one block decompressed each)\n", t / LOOKUPS * 1e6);
+
+	free(raw);
+	free(comp);
+	free(dec);
+	free(blocks);
+	return sink == 42;
+}
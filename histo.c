@@ -0,0 +1,122 @@
+#include "histo.h"
+
+static int
+bucket(uint64_t v, int bits)
+{
+	int e, sub = 1 << bits;
+
+	if (v < sub)
+		return v;
+
+	// The power of two, then the bits bits below its top bit.
+	e = 63 - __builtin_clzll(v);
+	return (e - bits + 1) * sub + ((v >> (e - bits)) & (sub - 1));
+}
+
+static uint64_t
+bucket_max(int i, int bits)
+{
+	int e, m, sub = 1 << bits;
+
+	if (i < sub)
+		return i;
+
+	e = i / sub + bits - 1;
+	m = i % sub;
+
+	if (e == 63 && m == sub - 1)
+		return UINT64_MAX;
+	return ((uint64_t)(sub + m + 1) << (e - bits)) - 1;
+}
+
+/* histo_bucket_max returns the largest value that lands in bucket i. */
+uint64_t
+histo_bucket_max(int i)
+{
+	return bucket_max(i, HISTO_SUB_BITS);
+}
+
+/* histo_add counts v. */
+void
+histo_add(struct histo *h, uint64_t v)
+{
+	h->b[bucket(v, HISTO_SUB_BITS)]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* histo_merge adds everything counted in src to dst. */
+void
+histo_merge(struct histo *dst, const struct histo *src)
+{
+	for (int i = 0; i < HISTO_BUCKETS; ++i)
+		dst->b[i] += src->b[i];
+
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+/* histo_quantile returns the value at quantile q, between 0 and 1. It is
+ * rounded up to the top of its bucket, but never past the largest value
+ * counted. */
+uint64_t
+histo_quantile(const struct histo *h, double q)
+{
+	uint64_t want, seen = 0, v;
+
+	if (!h->count)
+		return 0;
+
+	want = q * h->count;
+	if (want >= h->count)
+		want = h->count - 1;
+
+	for (int i = 0; i < HISTO_BUCKETS; ++i) {
+		if ((seen += h->b[i]) > want) {
+			v = histo_bucket_max(i);
+			return v < h->max ? v : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+/* histo_small_add counts v. */
+void
+histo_small_add(struct histo_small *h, uint64_t v)
+{
+	int i = bucket(v, HISTO_SMALL_SUB_BITS);
+
+	h->b[i < HISTO_SMALL_BUCKETS ? i : HISTO_SMALL_BUCKETS - 1]++;
+	h->count++;
+	h->sum += v;
+	if (v > h->max)
+		h->max = v;
+}
+
+/* histo_small_quantile is histo_quantile for a histo_small. */
+uint64_t
+histo_small_quantile(const struct histo_small *h, double q)
+{
+	uint64_t want, seen = 0, v;
+
+	if (!h->count)
+		return 0;
+
+	want = q * h->count;
+	if (want >= h->count)
+		want = h->count - 1;
+
+	for (int i = 0; i < HISTO_SMALL_BUCKETS - 1; ++i) {
+		if ((seen += h->b[i]) > want) {
+			v = bucket_max(i, HISTO_SMALL_SUB_BITS);
+			return v < h->max ? v : h->max;
+		}
+	}
+
+	return h->max;
+}
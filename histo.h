@@ -0,0 +1,39 @@
+#ifndef HISTO_H_INC
+#define HISTO_H_INC
+#include <stdint.h>
+
+/* Values under HISTO_SUB are counted exactly. Above that, every power of two
+ * is split into HISTO_SUB buckets, so a bucket is never off by more than
+ * 1/HISTO_SUB of its value. */
+#define HISTO_SUB_BITS 4
+#define HISTO_SUB (1 << HISTO_SUB_BITS)
+#define HISTO_BUCKETS ((64 - HISTO_SUB_BITS + 1) * HISTO_SUB)
+
+/* histo is a log-linear histogram of unsigned 64-bit values, e.g.
+ * nanoseconds or bytes. A zeroed histo is empty and ready to use. */
+struct histo {
+	uint64_t count, sum, max;
+	uint64_t b[HISTO_BUCKETS];
+};
+
+/* histo_small is a coarser histo for when there are many of them, e.g. one
+ * per client. A bucket is off by at most 1/HISTO_SMALL_SUB of its value, and
+ * values of 2^HISTO_SMALL_MAX_BITS and up all land in the last one. */
+#define HISTO_SMALL_SUB_BITS 2
+#define HISTO_SMALL_SUB (1 << HISTO_SMALL_SUB_BITS)
+#define HISTO_SMALL_MAX_BITS 40 // About 18 minutes, in nanoseconds
+#define HISTO_SMALL_BUCKETS ((HISTO_SMALL_MAX_BITS - HISTO_SMALL_SUB_BITS + 1) * HISTO_SMALL_SUB)
+
+struct histo_small {
+	uint64_t count, sum, max;
+	uint32_t b[HISTO_SMALL_BUCKETS];
+};
+
+void histo_add(struct histo *h, uint64_t v);
+void histo_merge(struct histo *dst, const struct histo *src);
+uint64_t histo_quantile(const struct histo *h, double q);
+uint64_t histo_bucket_max(int i);
+
+void histo_small_add(struct histo_small *h, uint64_t v);
+uint64_t histo_small_quantile(const struct histo_small *h, double q);
+#endif
@@ -0,0 +1,1016 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clk.h"
+#include "history.h"
+#include "intern.h"
+#include "log.h"
+#include "lz.h"
+#include "mem.h"
+
+#define HISTORY_LZ_MAGIC "ICBMLZ01"
+
+struct history_hit {
+	size_t seg;
+	uint32_t off;
+};
+
+/* A compressed segment starts with this header, followed by the compressed
+ * blocks, followed by nblocks history_blocks at index. */
+struct history_lzhdr {
+	char magic[8];
+	uint32_t nblocks, blocksize;
+	uint64_t size, index;
+};
+
+static void
+seg_path(struct history *h, unsigned int id, const char *ext, char *buf, size_t n)
+{
+	snprintf(buf, n, "%s/%08u.%s", h->dir, id, ext);
+}
+
+/* load_block decompresses block i of s into the block cache. */
+static int
+load_block(struct history *h, struct history_segment *s, size_t i)
+{
+	struct history_block *b = &s->blocks[i];
+	char *src;
+
+	if (h->cacheid == s->id && h->cacheblk == i)
+		return 0;
+
+	// The compressed data is read in right behind the decompressed data.
+	if (!h->cache && !(h->cache = mem_malloc(MEM_HISTORY, HISTORY_BLOCK_SIZE + LZ_BOUND(HISTORY_BLOCK_SIZE))))
+		return -1;
+	src = h->cache + HISTORY_BLOCK_SIZE;
+
+	h->cacheid = -1;
+	if (b->len > LZ_BOUND(HISTORY_BLOCK_SIZE) || pread(s->fd, src, b->len, b->off) != b->len)
+		return -1;
+
+	if (lz_decompress(src, b->len, h->cache, HISTORY_BLOCK_SIZE) != b->rawlen) {
+		warnf("history: block %zu of segment %u is corrupt", i, s->id);
+		return -1;
+	}
+
+	h->cacheid = s->id;
+	h->cacheblk = i;
+	return 0;
+}
+
+/* seg_read reads up to n bytes of the segment starting at off, as if it were
+ * not compressed. Compressed segments never read past the end of a block. */
+static ssize_t
+seg_read(struct history *h, struct history_segment *s, size_t off, char *buf, size_t n)
+{
+	size_t lo = 0, hi = s->nblocks;
+	struct history_block *b;
+
+	if (!s->blocks)
+		return pread(s->fd, buf, n, off);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (s->blocks[mid].rawoff + s->blocks[mid].rawlen <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == s->nblocks || load_block(h, s, lo) == -1)
+		return lo == s->nblocks ? 0 : -1;
+
+	b = &s->blocks[lo];
+	if (n > b->rawoff + b->rawlen - off)
+		n = b->rawoff + b->rawlen - off;
+
+	memcpy(buf, h->cache + (off - b->rawoff), n);
+	return n;
+}
+
+/* read_record reads the record at off into buf, and returns a pointer to the
+ * IRC line inside of it. The timestamp is stored in ms, and the length of the
+ * whole record in len.
+ *
+ * NULL is returned if there is no complete record at off.
+ */
+static char *
+read_record(struct history *h, struct history_segment *s, size_t off,
+	char *buf, size_t n, long long *ms, size_t *len)
+{
+	ssize_t r;
+	char *nl, *sp;
+
+	if ((r = seg_read(h, s, off, buf, n - 1)) <= 0)
+		return NULL;
+	buf[r] = 0;
+
+	if (!(nl = memchr(buf, '\n', r)) || !(sp = memchr(buf, ' ', nl - buf)))
+		return NULL;
+	*nl = 0;
+
+	*ms = strtoll(buf, NULL, 10);
+	if (len)
+		*len = nl - buf + 1;
+	return sp + 1;
+}
+
+/* seg_times finds the timestamps of the first and last records of s. */
+static void
+seg_times(struct history *h, struct history_segment *s)
+{
+	char buf[4096], *p;
+	size_t tail;
+	ssize_t r;
+
+	s->first = s->last = 0;
+
+	if (s->blocks) {
+		if (s->nblocks) {
+			s->first = s->blocks[0].first;
+			s->last = s->blocks[s->nblocks - 1].last;
+		}
+		return;
+	}
+
+	if (!s->size || !read_record(h, s, 0, buf, sizeof(buf), &s->first, NULL))
+		return;
+
+	// Records are shorter than buf, so the last one is in the tail.
+	tail = s->size > sizeof(buf) - 1 ? s->size - (sizeof(buf) - 1) : 0;
+	if ((r = seg_read(h, s, tail, buf, s->size - tail)) <= 0 || buf[r - 1] != '\n')
+		return;
+
+	for (p = buf + r - 1; p > buf && p[-1] != '\n'; --p);
+	s->last = strtoll(p, NULL, 10);
+}
+
+/* seg_rebuild reads every record in the segment back into its live index. */
+static int
+seg_rebuild(struct history *h, struct history_segment *s)
+{
+	char path[4096];
+	char *line = NULL, *sp;
+	size_t cap = 0, off = 0;
+	ssize_t n;
+	FILE *f;
+
+	seg_path(h, s->id, "log", path, sizeof(path));
+	if (!(f = fopen(path, "r")))
+		return -1;
+
+	while ((n = getline(&line, &cap, f)) > 0) {
+		// Skip over the timestamp and the trailing newline.
+		if (line[n - 1] == '\n' && (sp = memchr(line, ' ', n))) {
+			if (!off)
+				s->first = strtoll(line, NULL, 10);
+			s->last = strtoll(line, NULL, 10);
+
+			sp++;
+			if (search_add(&s->idx, off, sp, line + n - 1 - sp) == -1)
+				break;
+		}
+
+		off += n;
+	}
+
+	free(line);
+	fclose(f);
+	return 0;
+}
+
+/* lz_open opens the compressed segment at path and reads its block index. */
+static int
+lz_open(struct history_segment *s, const char *path)
+{
+	struct history_lzhdr hdr;
+	size_t sz;
+
+	if ((s->fd = open(path, O_RDONLY)) == -1)
+		return -1;
+
+	if (pread(s->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr.magic, HISTORY_LZ_MAGIC, 8) != 0 ||
+	    hdr.blocksize > HISTORY_BLOCK_SIZE) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	sz = sizeof(*s->blocks) * hdr.nblocks;
+	if (!(s->blocks = mem_malloc(MEM_HISTORY, sz ? sz : 1)))
+		goto fail;
+
+	if (pread(s->fd, s->blocks, sz, hdr.index) != sz) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	s->nblocks = hdr.nblocks;
+	s->size = hdr.size;
+	return 0;
+
+fail:
+	mem_free(MEM_HISTORY, s->blocks);
+	s->blocks = NULL;
+	close(s->fd);
+	return -1;
+}
+
+/* seg_open opens segment id. If it has a sealed index, it is loaded and the
+ * segment is opened read-only; otherwise the index is rebuilt from the log. */
+static int
+seg_open(struct history *h, unsigned int id, struct history_segment *s)
+{
+	char path[4096];
+	struct stat st;
+	int sealed;
+
+	memset(s, 0, sizeof(*s));
+	s->id = id;
+
+	seg_path(h, id, "idx", path, sizeof(path));
+	sealed = access(path, F_OK) == 0;
+	if (sealed && search_load(&s->idx, path) == -1) {
+		warnf("history: failed to load %s: %s", path, strerror(errno));
+		sealed = 0;
+	}
+
+	seg_path(h, id, "lz", path, sizeof(path));
+	if (sealed && access(path, F_OK) == 0) {
+		if (lz_open(s, path) == -1) {
+			search_free(&s->idx);
+			return -1;
+		}
+
+		// The log may outlive its compressed copy if we were stopped
+		// at the wrong time.
+		seg_path(h, id, "log", path, sizeof(path));
+		unlink(path);
+
+		seg_times(h, s);
+		return 1;
+	}
+
+	seg_path(h, id, "log", path, sizeof(path));
+	if ((s->fd = open(path, sealed ? O_RDONLY : O_RDWR | O_CREAT | O_APPEND, 0600)) == -1) {
+		search_free(&s->idx);
+		return -1;
+	}
+
+	if (fstat(s->fd, &st) == -1) {
+		close(s->fd);
+		search_free(&s->idx);
+		return -1;
+	}
+	s->size = st.st_size;
+
+	if (!sealed && s->size)
+		seg_rebuild(h, s);
+	else if (sealed)
+		seg_times(h, s);
+
+	return sealed;
+}
+
+/* A sealed segment to compress, and then how it went. */
+struct history_job {
+	struct history *h;
+	unsigned int id;
+	int fd; // Of the log, which the job reads through
+	size_t size;
+	int ok;
+	struct history_job *next;
+};
+
+// Compression happens on a thread of its own, one segment at a time, so
+// that sealing never holds up the loop writing the log.
+static pthread_mutex_t jobmu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobcond = PTHREAD_COND_INITIALIZER;
+static struct history_job *queue, **queuetail = &queue;
+static pthread_t compressor;
+static int compressing;
+
+/* compress converts the log of a sealed segment into blocks of compressed
+ * records, and renames them into place over it. The log is only unlinked;
+ * whoever has it open may read on until they switch to the blocks. */
+static int
+compress(struct history_job *j)
+{
+	char src[4096], dst[4096], tmp[4096];
+	struct history_lzhdr hdr = { HISTORY_LZ_MAGIC, 0, HISTORY_BLOCK_SIZE };
+	struct history_block *blocks = NULL, cur = {0};
+	struct flock lk = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+	size_t cap = 0, lcap = 0, rawlen = 0;
+	char *raw, *out, *line = NULL;
+	uint64_t off = sizeof(hdr);
+	ssize_t n;
+	FILE *in = NULL;
+	int fd = -1;
+
+	raw = mem_malloc(MEM_HISTORY, HISTORY_BLOCK_SIZE);
+	out = mem_malloc(MEM_HISTORY, LZ_BOUND(HISTORY_BLOCK_SIZE));
+	if (!raw || !out)
+		goto fail;
+
+	seg_path(j->h, j->id, "log", src, sizeof(src));
+	seg_path(j->h, j->id, "lz", dst, sizeof(dst));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", dst);
+
+	if (!(in = fdopen(j->fd, "r")))
+		goto fail;
+	j->fd = -1;
+	if (fseek(in, 0, SEEK_SET) == -1)
+		goto fail;
+
+	// The process before or after us may be at the same segment, during
+	// an upgrade. It is left to finish.
+	if ((fd = open(tmp, O_WRONLY | O_CREAT, 0600)) == -1)
+		goto fail;
+	if (fcntl(fd, F_SETLK, &lk) == -1) {
+		debugf("history: segment %u is being compressed elsewhere", j->id);
+		close(fd);
+		fd = -1;
+		goto done;
+	}
+
+	// The header is filled in last.
+	if (ftruncate(fd, 0) == -1 || lseek(fd, sizeof(hdr), SEEK_SET) == -1)
+		goto fail;
+
+	for (;;) {
+		n = getline(&line, &lcap, in);
+
+		// Records never straddle two blocks.
+		if (rawlen && (n <= 0 || rawlen + n > HISTORY_BLOCK_SIZE)) {
+			if (hdr.nblocks == cap) {
+				struct history_block *nb;
+				cap = cap ? cap * 2 : 64;
+				if (!(nb = mem_realloc(MEM_HISTORY, blocks, sizeof(*blocks) * cap)))
+					goto fail;
+				blocks = nb;
+			}
+
+			cur.off = off;
+			cur.rawlen = rawlen;
+			cur.len = lz_compress(raw, rawlen, out, LZ_BOUND(HISTORY_BLOCK_SIZE));
+			if (write(fd, out, cur.len) != cur.len)
+				goto fail;
+
+			blocks[hdr.nblocks++] = cur;
+			off += cur.len;
+			cur.rawoff += rawlen;
+			rawlen = 0;
+		}
+
+		if (n <= 0)
+			break;
+
+		if (n > HISTORY_BLOCK_SIZE)
+			goto fail;
+
+		if (!rawlen)
+			cur.first = strtoll(line, NULL, 10);
+		cur.last = strtoll(line, NULL, 10);
+
+		memcpy(raw + rawlen, line, n);
+		rawlen += n;
+	}
+
+	hdr.size = cur.rawoff;
+	hdr.index = off;
+	if (write(fd, blocks, sizeof(*blocks) * hdr.nblocks) != sizeof(*blocks) * hdr.nblocks ||
+	    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		goto fail;
+
+	// The lock goes with the fd, so the file is renamed first.
+	if (hdr.size != j->size || rename(tmp, dst) == -1)
+		goto fail;
+	unlink(src);
+	close(fd);
+	fd = -1;
+
+	debugf("history: compressed segment %u from %zu to %llu bytes", j->id,
+		j->size, (unsigned long long)off + sizeof(*blocks) * hdr.nblocks);
+	j->ok = 1;
+
+done:
+	mem_free(MEM_HISTORY, raw);
+	mem_free(MEM_HISTORY, out);
+	free(line);
+	mem_free(MEM_HISTORY, blocks);
+	if (in)
+		fclose(in);
+	return 0;
+
+fail:
+	warnf("history: failed to compress segment %u: %s", j->id, strerror(errno));
+	if (fd != -1) {
+		unlink(tmp);
+		close(fd);
+	}
+	if (j->fd != -1)
+		close(j->fd);
+	j->fd = -1;
+	mem_free(MEM_HISTORY, raw);
+	mem_free(MEM_HISTORY, out);
+	free(line);
+	mem_free(MEM_HISTORY, blocks);
+	if (in)
+		fclose(in);
+	return -1;
+}
+
+/* compress_main compresses the segments queued by seg_compress, and hands
+ * them back to their logs. */
+static void *
+compress_main(void *arg)
+{
+	struct history_job *j;
+
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&jobmu);
+		while (!queue)
+			pthread_cond_wait(&jobcond, &jobmu);
+
+		j = queue;
+		if (!(queue = j->next))
+			queuetail = &queue;
+		pthread_mutex_unlock(&jobmu);
+
+		compress(j);
+
+		pthread_mutex_lock(&jobmu);
+		j->next = j->h->done;
+		__atomic_store_n(&j->h->done, j, __ATOMIC_RELEASE);
+		j->h->pending--;
+		pthread_cond_broadcast(&jobcond);
+		pthread_mutex_unlock(&jobmu);
+	}
+
+	return NULL;
+}
+
+/* seg_compress has a sealed segment compressed in the background. Until
+ * adopt sees it done, it is read from its log as before. */
+static int
+seg_compress(struct history *h, struct history_segment *s)
+{
+	struct history_job *j;
+	sigset_t all, old;
+	int err = 0;
+
+	if (!(j = mem_calloc(MEM_HISTORY, 1, sizeof(*j))))
+		return -1;
+
+	j->h = h;
+	j->id = s->id;
+	j->size = s->size;
+	if ((j->fd = dup(s->fd)) == -1) {
+		mem_free(MEM_HISTORY, j);
+		return -1;
+	}
+
+	pthread_mutex_lock(&jobmu);
+	if (!compressing) {
+		// Signals are left to loop 0.
+		sigfillset(&all);
+		pthread_sigmask(SIG_BLOCK, &all, &old);
+		err = pthread_create(&compressor, NULL, compress_main, NULL);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		compressing = !err;
+	}
+
+	if (!err) {
+		*queuetail = j;
+		queuetail = &j->next;
+		h->pending++;
+		pthread_cond_broadcast(&jobcond);
+	}
+	pthread_mutex_unlock(&jobmu);
+
+	if (err) {
+		warnf("history: failed to start compressing: %s", strerror(err));
+		close(j->fd);
+		mem_free(MEM_HISTORY, j);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* adopt switches the segments of h that have been compressed since it was
+ * last called over to their blocks. */
+static void
+adopt(struct history *h)
+{
+	struct history_job *j, *next;
+	char path[4096];
+
+	if (!__atomic_load_n(&h->done, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&jobmu);
+	j = h->done;
+	h->done = NULL;
+	pthread_mutex_unlock(&jobmu);
+
+	for (; j; j = next) {
+		struct history_segment *s = NULL, lz = {0};
+
+		next = j->next;
+		for (size_t i = h->len; i-- > 0 && !s; )
+			if (h->segs[i].id == j->id)
+				s = &h->segs[i];
+
+		seg_path(h, j->id, "lz", path, sizeof(path));
+		if (j->ok && s && !s->blocks) {
+			if (lz_open(&lz, path) == -1) {
+				warnf("history: failed to open %s: %s", path, strerror(errno));
+			} else {
+				close(s->fd);
+				s->fd = lz.fd;
+				s->blocks = lz.blocks;
+				s->nblocks = lz.nblocks;
+				if (h->cacheid == s->id)
+					h->cacheid = -1;
+			}
+		}
+
+		mem_free(MEM_HISTORY, j);
+	}
+}
+
+/* seal writes out the index of the segment and maps it back in, so that it
+ * no longer takes up any heap. */
+static int
+seal(struct history *h, struct history_segment *s)
+{
+	char path[4096];
+
+	seg_path(h, s->id, "idx", path, sizeof(path));
+	if (search_write(&s->idx, path) == -1) {
+		warnf("history: failed to write %s: %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (search_load(&s->idx, path) == -1)
+		return -1;
+
+	return h->compress ? seg_compress(h, s) : 0;
+}
+
+static struct history_segment *
+push(struct history *h)
+{
+	if (h->len == h->cap) {
+		size_t cap = h->cap ? h->cap * 2 : 8;
+		struct history_segment *segs;
+
+		if (!(segs = mem_realloc(MEM_HISTORY, h->segs, sizeof(*segs) * cap)))
+			return NULL;
+
+		h->segs = segs;
+		h->cap = cap;
+	}
+
+	return &h->segs[h->len++];
+}
+
+/* next_segment starts a new segment after the current one. */
+static int
+next_segment(struct history *h)
+{
+	unsigned int id = h->len ? h->segs[h->len - 1].id + 1 : 0;
+	struct history_segment *s;
+
+	if (!(s = push(h)))
+		return -1;
+
+	if (seg_open(h, id, s) == -1) {
+		warnf("history: failed to open segment %u: %s", id, strerror(errno));
+		h->len--;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int
+id_cmp(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	return (x > y) - (x < y);
+}
+
+/* history_open opens the message log stored in dir, creating it if it does
+ * not exist yet.
+ *
+ * Any segment that was not sealed, other than the last one, is sealed now.
+ * If compress is set, sealed segments are compressed, including any that
+ * were sealed before.
+ *
+ * On error, -1 is returned.
+ */
+int
+history_open(struct history *h, const char *dir, int compress)
+{
+	unsigned int *ids = NULL, id;
+	size_t nids = 0, cap = 0;
+	struct dirent *de;
+	DIR *d;
+	int ret = -1;
+
+	memset(h, 0, sizeof(*h));
+	h->compress = compress;
+	h->cacheid = -1;
+
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+		return -1;
+
+	if (!(d = opendir(dir)))
+		return -1;
+
+	if (!(h->dir = mem_strdup(MEM_HISTORY, dir)))
+		goto done;
+
+	while ((de = readdir(d))) {
+		if (strspn(de->d_name, "0123456789") != 8 || sscanf(de->d_name, "%8u", &id) != 1 ||
+		    (strcmp(de->d_name + 8, ".log") != 0 && strcmp(de->d_name + 8, ".lz") != 0))
+			continue;
+
+		if (nids == cap) {
+			unsigned int *n;
+			cap = cap ? cap * 2 : 16;
+			if (!(n = mem_realloc(MEM_HISTORY, ids, sizeof(*ids) * cap)))
+				goto done;
+			ids = n;
+		}
+
+		ids[nids++] = id;
+	}
+
+	qsort(ids, nids, sizeof(*ids), id_cmp);
+
+	for (size_t i = 0; i < nids; ++i) {
+		struct history_segment *s;
+		int sealed, last = ids[i] == ids[nids - 1];
+
+		// Both the log and its compressed copy may be around.
+		if (i && ids[i] == ids[i - 1])
+			continue;
+
+		if (!(s = push(h)))
+			goto done;
+
+		if ((sealed = seg_open(h, ids[i], s)) == -1) {
+			warnf("history: failed to open segment %u: %s", ids[i], strerror(errno));
+			h->len--;
+			continue;
+		}
+
+		// Crashed or stopped before this one was sealed.
+		if (!sealed && !last)
+			seal(h, s);
+		else if (sealed && compress && !s->blocks)
+			seg_compress(h, s);
+
+		if (sealed && last && next_segment(h) == -1)
+			goto done;
+	}
+
+	if (!h->len && next_segment(h) == -1)
+		goto done;
+
+	infof("history: %zu segments in %s", h->len, dir);
+	ret = 0;
+
+done:
+	mem_free(MEM_HISTORY, ids);
+	closedir(d);
+	if (ret == -1)
+		history_close(h);
+	return ret;
+}
+
+/* history_close closes every segment. The active segment is left unsealed,
+ * and will be reindexed the next time the log is opened. */
+void
+history_close(struct history *h)
+{
+	struct history_job *j, **p;
+
+	// Whatever is still queued is dropped, and will be picked up again
+	// the next time the log is opened.
+	pthread_mutex_lock(&jobmu);
+	for (p = &queue; (j = *p); ) {
+		if (j->h != h) {
+			p = &j->next;
+			continue;
+		}
+
+		if (!(*p = j->next))
+			queuetail = p;
+		close(j->fd);
+		mem_free(MEM_HISTORY, j);
+		h->pending--;
+	}
+
+	while (h->pending)
+		pthread_cond_wait(&jobcond, &jobmu);
+	j = h->done;
+	h->done = NULL;
+	pthread_mutex_unlock(&jobmu);
+
+	for (struct history_job *next; j; j = next) {
+		next = j->next;
+		mem_free(MEM_HISTORY, j);
+	}
+
+	for (size_t i = 0; i < h->len; ++i) {
+		close(h->segs[i].fd);
+		search_free(&h->segs[i].idx);
+		mem_free(MEM_HISTORY, h->segs[i].blocks);
+	}
+
+	mem_free(MEM_HISTORY, h->cache);
+	mem_free(MEM_HISTORY, h->segs);
+	mem_free(MEM_HISTORY, h->dir);
+	memset(h, 0, sizeof(*h));
+}
+
+/* history_append appends a line to the log and indexes it.
+ *
+ * If the log is not open, nothing happens. On error, -1 is returned.
+ */
+int
+history_append(struct history *h, long long ms, const char *line, size_t n)
+{
+	struct history_segment *s;
+	char buf[4096];
+	int len;
+
+	if (!h->dir || !h->len)
+		return 0;
+
+	adopt(h);
+	s = &h->segs[h->len - 1];
+	if (s->size >= HISTORY_SEGMENT_MAX) {
+		if (seal(h, s) == -1 || next_segment(h) == -1)
+			return -1;
+		s = &h->segs[h->len - 1];
+	}
+
+	len = snprintf(buf, sizeof(buf), "%lld %.*s\n", ms, (int)n, line);
+	if (len >= sizeof(buf))
+		return -1;
+
+	if (write(s->fd, buf, len) != len) {
+		warnf("history: write failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if (search_add(&s->idx, s->size, line, n) == -1)
+		warnf("history: failed to index record");
+
+	if (!s->size)
+		s->first = ms;
+	s->last = ms;
+	s->size += len;
+	return 0;
+}
+
+/* history_log appends msg to the log if it is something worth keeping.
+ *
+ * Messages sent by clients do not carry a source, so source is used in its
+ * place.
+ */
+int
+history_log(struct history *h, struct irc_message *msg, const char *source)
+{
+	struct irc_message out;
+	char buf[2048];
+	int n;
+
+	if (!h->dir)
+		return 0;
+
+	if (strcmp(msg->command, "PRIVMSG") != 0 && strcmp(msg->command, "NOTICE") != 0)
+		return 0;
+
+	out = *msg;
+	out.tags = NULL;
+	if (!out.source)
+		out.source = (char *)source;
+
+	if ((n = irc_string(&out, buf, sizeof(buf))) == -1)
+		return -1;
+
+	return history_append(h, clk_real_ms(), buf, n);
+}
+
+/* target_match reports whether the record line belongs to the conversation
+ * target, which is either a channel or the nick of the other party. */
+static int
+target_match(struct history *h, const char *line, const char *target)
+{
+	int casemap = h->names ? h->names->casemap : CASEMAP_RFC1459;
+	struct irc_message msg;
+	char buf[2048];
+
+	if (strcmp(target, "*") == 0)
+		return 1;
+
+	snprintf(buf, sizeof(buf), "%s", line);
+	if (irc_parse(buf, &msg) || !msg.params[0])
+		return 0;
+
+	if (casemap_cmp(casemap, msg.params[0], target) == 0)
+		return 1;
+
+	if (!msg.source)
+		return 0;
+
+	// Just the nick.
+	msg.source[strcspn(msg.source, "!@")] = 0;
+	return casemap_cmp(casemap, msg.source, target) == 0;
+}
+
+/* history_search finds the most recent records to target that contain q,
+ * ignoring case. A target of "*" matches everything.
+ *
+ * At most limit records are passed to f, oldest first. If f returns anything
+ * other than zero, the search is stopped.
+ *
+ * The number of matches is returned, or -1 if q is too short to search for.
+ */
+int
+history_search(struct history *h, const char *target, const char *q,
+	size_t limit, int (*f)(long long ms, char *line, void *arg), void *arg)
+{
+	struct history_hit *hits;
+	size_t nhits = 0;
+	char buf[4096];
+	long long ms;
+
+	if (!h->dir || !limit)
+		return 0;
+
+	adopt(h);
+	if (!(hits = mem_malloc(MEM_HISTORY, sizeof(*hits) * limit)))
+		return -1;
+
+	// Walk backwards so that we find the newest matches first.
+	for (size_t s = h->len; s-- > 0 && nhits < limit; ) {
+		uint32_t *cands;
+		int n;
+
+		if ((n = search_query(&h->segs[s].idx, q, &cands)) == -1) {
+			mem_free(MEM_HISTORY, hits);
+			return -1;
+		}
+
+		for (int i = n; i-- > 0 && nhits < limit; ) {
+			char *line = read_record(h, &h->segs[s], cands[i], buf, sizeof(buf), &ms, NULL);
+
+			if (!line || !search_match(line, strlen(line), q) || !target_match(h, line, target))
+				continue;
+
+			hits[nhits].seg = s;
+			hits[nhits].off = cands[i];
+			nhits++;
+		}
+
+		mem_free(MEM_HISTORY, cands);
+	}
+
+	for (size_t i = nhits; i-- > 0; ) {
+		char *line = read_record(h, &h->segs[hits[i].seg], hits[i].off, buf, sizeof(buf), &ms, NULL);
+
+		if (line && f(ms, line, arg))
+			break;
+	}
+
+	mem_free(MEM_HISTORY, hits);
+	return nhits;
+}
+
+/* seg_seek finds an offset in s from which every record at or after ms may be
+ * found by reading forwards. Records before ms may still come first. */
+static size_t
+seg_seek(struct history *h, struct history_segment *s, long long ms)
+{
+	size_t lo = 0, hi = s->blocks ? s->nblocks : s->size, len;
+	char buf[4096], *nl;
+	long long t;
+	ssize_t r;
+
+	// The block index tells us straight away where to look.
+	if (s->blocks) {
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (s->blocks[mid].last < ms)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		return lo < s->nblocks ? s->blocks[lo].rawoff : s->size;
+	}
+
+	// Otherwise, bisect on the first record after the midpoint until the
+	// remaining range is small enough to just read through.
+	while (hi - lo > sizeof(buf)) {
+		size_t mid = lo + (hi - lo) / 2, start;
+
+		if ((r = seg_read(h, s, mid, buf, sizeof(buf))) <= 0 || !(nl = memchr(buf, '\n', r))) {
+			hi = mid;
+			continue;
+		}
+
+		start = mid + (nl - buf) + 1;
+		if (start >= hi || !read_record(h, s, start, buf, sizeof(buf), &t, &len)) {
+			hi = mid;
+			continue;
+		}
+
+		if (t < ms)
+			lo = start;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* history_range finds records to target between from and to inclusive, both
+ * in unix time in milliseconds. A target of "*" matches everything.
+ *
+ * At most limit records are passed to f, oldest first. If f returns anything
+ * other than zero, the search is stopped.
+ *
+ * The number of records found is returned.
+ */
+int
+history_range(struct history *h, const char *target, long long from,
+	long long to, size_t limit, int (*f)(long long ms, char *line, void *arg),
+	void *arg)
+{
+	char buf[4096];
+	size_t n = 0, len;
+	long long ms;
+
+	adopt(h);
+	for (size_t i = 0; i < h->len && n < limit; ++i) {
+		struct history_segment *s = &h->segs[i];
+		size_t off;
+
+		if (!s->size || s->last < from || s->first > to)
+			continue;
+
+		for (off = seg_seek(h, s, from); off < s->size && n < limit; off += len) {
+			char *line = read_record(h, s, off, buf, sizeof(buf), &ms, &len);
+
+			if (!line || ms > to)
+				return n;
+
+			if (ms < from || !target_match(h, line, target))
+				continue;
+
+			n++;
+			if (f(ms, line, arg))
+				return n;
+		}
+	}
+
+	return n;
+}
+
+/* history_bytes returns how much memory the log takes up, counting the
+ * indexes and the block cache. */
+size_t
+history_bytes(struct history *h)
+{
+	size_t n = h->cache ? HISTORY_BLOCK_SIZE + LZ_BOUND(HISTORY_BLOCK_SIZE) : 0;
+
+	for (size_t i = 0; i < h->len; ++i)
+		n += search_bytes(&h->segs[i].idx) + sizeof(*h->segs[i].blocks) * h->segs[i].nblocks;
+
+	return n;
+}
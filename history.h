@@ -0,0 +1,81 @@
+#ifndef HISTORY_H_INC
+#define HISTORY_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+#include "intern.h"
+#include "irc.h"
+#include "search.h"
+
+#ifndef HISTORY_SEGMENT_MAX
+#define HISTORY_SEGMENT_MAX (8 << 20)
+#endif
+
+#ifndef HISTORY_BLOCK_SIZE
+#define HISTORY_BLOCK_SIZE (64 << 10)
+#endif
+
+/* A segment is one file of the message log, and a record is one line in it.
+ * Records are addressed by their byte offset into the segment.
+ *
+ * Each record looks like "<unix time in ms> <IRC line without tags>\n".
+ *
+ * Sealed segments may be compressed, in which case they are stored as blocks
+ * of whole records that can each be decompressed on their own. Records keep
+ * the offsets they had before compression.
+ */
+struct history_job;
+
+struct history_block {
+	uint64_t rawoff, off;
+	uint32_t rawlen, len;
+	int64_t first, last;
+};
+
+struct history_segment {
+	unsigned int id;
+	int fd;
+	size_t size;
+	long long first, last;
+	struct search_index idx;
+
+	// Compressed segments only.
+	struct history_block *blocks;
+	size_t nblocks;
+};
+
+struct history {
+	char *dir;
+	int compress;
+
+	// Decides which records belong to a target. Set after history_open.
+	const struct intern *names;
+
+	// The most recently decompressed block.
+	char *cache;
+	long cacheid, cacheblk;
+
+	// The last segment is the one being written to; all others are
+	// sealed.
+	struct history_segment *segs;
+	size_t len, cap;
+
+	// Sealed segments being compressed in the background, and those done
+	// that are still read from their logs; see seg_compress.
+	int pending;
+	struct history_job *done;
+};
+
+int history_open(struct history *h, const char *dir, int compress);
+void history_close(struct history *h);
+
+int history_append(struct history *h, long long ms, const char *line, size_t n);
+int history_log(struct history *h, struct irc_message *msg, const char *source);
+
+int history_search(struct history *h, const char *target, const char *q,
+	size_t limit, int (*f)(long long ms, char *line, void *arg), void *arg);
+int history_range(struct history *h, const char *target, long long from,
+	long long to, size_t limit, int (*f)(long long ms, char *line, void *arg),
+	void *arg);
+size_t history_bytes(struct history *h);
+#endif
@@ -0,0 +1,240 @@
+#define _GNU_SOURCE // For SCM_RIGHTS
+
+/* icbmring is a small library for reading the rings icbm publishes forwarded
+ * lines to; see icbmring.h. It depends on nothing from the rest of icbm, so
+ * it may be copied into a consumer's tree as it is. */
+
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "icbmring.h"
+
+/* icbm_ring_connect asks icbm, listening on the unix socket at path (or
+ * "@name" in the abstract namespace), for the ring of network, and returns
+ * it as an fd to pass to icbm_ring_map.
+ *
+ * On error, -1 is returned and errno is set; EACCES if icbm would not give
+ * this process the ring.
+ */
+int
+icbm_ring_connect(const char *path, const char *network)
+{
+	struct sockaddr_un sun = {0};
+	socklen_t len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+	char req[256], resp[64] = "", ctl[CMSG_SPACE(sizeof(int))] = {0};
+	struct iovec iov = { resp, sizeof(resp) - 1 };
+	struct msghdr msg = {0};
+	struct cmsghdr *cm;
+	ssize_t n;
+	int fd, ring = -1;
+
+	if (strlen(path) >= sizeof(sun.sun_path) ||
+	    snprintf(req, sizeof(req), "%s\n", network) >= sizeof(req)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if (*path == '@')
+		sun.sun_path[0] = 0;
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *)&sun, *path == '@' ? len : sizeof(sun)) == -1 ||
+	    write(fd, req, strlen(req)) != (ssize_t)strlen(req))
+		goto fail;
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+	if (n <= 0)
+		goto fail;
+
+	cm = CMSG_FIRSTHDR(&msg);
+	if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+		memcpy(&ring, CMSG_DATA(cm), sizeof(ring));
+
+	// "OK <size>" comes with the fd, and anything else without.
+	if (strncmp(resp, "OK ", 3) != 0 || ring == -1) {
+		if (ring != -1)
+			close(ring);
+		errno = strncmp(resp, "ERR access", 10) == 0 ? EACCES : ENOENT;
+		goto fail;
+	}
+
+	close(fd);
+	return ring;
+
+fail:
+	n = errno;
+	close(fd);
+	errno = n;
+	return -1;
+}
+
+/* icbm_ring_map maps the ring fd, which may be closed afterwards. Reading
+ * starts from the newest record.
+ *
+ * On error, -1 is returned and errno is set.
+ */
+int
+icbm_ring_map(struct icbm_ring *r, int fd)
+{
+	struct icbm_ring_hdr *hdr;
+	struct stat st;
+	void *map;
+
+	memset(r, 0, sizeof(*r));
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+
+	if (st.st_size < ICBM_RING_HDRSZ) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	// Writable, for waiters to be counted.
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	hdr = map;
+	if (hdr->magic != ICBM_RING_MAGIC || hdr->version != ICBM_RING_VERSION ||
+	    hdr->size != (uint64_t)st.st_size - ICBM_RING_HDRSZ || (hdr->size & (hdr->size - 1))) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	r->hdr = hdr;
+	r->data = (const char *)map + ICBM_RING_HDRSZ;
+	r->mapsz = st.st_size;
+	r->tail = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	return 0;
+}
+
+/* icbm_ring_read copies the next record into buf, which holds sz bytes and
+ * should be 8-aligned. ICBM_RING_RECMAX bytes are enough for any record.
+ *
+ * 1 is returned if there was a record, and 0 if there is none yet. Records
+ * that were overwritten before they could be read are skipped, and counted
+ * in lost, as are those too big for buf.
+ */
+int
+icbm_ring_read(struct icbm_ring *r, void *buf, size_t sz)
+{
+	const struct icbm_ring_hdr *hdr = r->hdr;
+	uint64_t mask = hdr->size - 1;
+
+	for (;;) {
+		uint64_t head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE), pos, next;
+		uint32_t size;
+		int copied = 0;
+
+		if (r->tail == head)
+			return 0;
+
+		if (head - r->tail > hdr->size)
+			goto lapped;
+
+		pos = r->tail & mask;
+		memcpy(&size, r->data + pos, sizeof(size));
+
+		if (size == 0) {
+			next = r->tail + (hdr->size - pos);
+		} else if (size < sizeof(struct icbm_ring_rec) || size > hdr->size - pos ||
+		    size > head - r->tail) {
+			goto lapped;
+		} else {
+			next = r->tail + size;
+			if (size <= sz) {
+				memcpy(buf, r->data + pos, size);
+				copied = 1;
+			}
+		}
+
+		// Whatever was copied is only good if it was not being written
+		// over at the time.
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&hdr->reserve, __ATOMIC_RELAXED) - r->tail > hdr->size)
+			goto lapped;
+
+		if (size && !copied)
+			r->lost += size;
+		r->tail = next;
+
+		if (copied) {
+			const struct icbm_ring_rec *rec = buf;
+
+			// Only a broken icbm gets this wrong, but a reader should
+			// not walk off the end of buf for it.
+			if (sizeof(*rec) + rec->ntok * sizeof(rec->tok[0]) + rec->len > size)
+				continue;
+			return 1;
+		}
+		continue;
+
+lapped:
+		head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		r->lost += head - r->tail;
+		r->tail = head;
+	}
+}
+
+/* icbm_ring_wait sleeps until there may be a record to read, for up to
+ * timeout ms, or forever if it is -1.
+ *
+ * 0 is returned if there may be a record, or on timeout. -1 is returned with
+ * errno set to EPIPE if icbm has stopped publishing to the ring.
+ */
+int
+icbm_ring_wait(struct icbm_ring *r, int timeout)
+{
+	struct icbm_ring_hdr *hdr = r->hdr;
+	struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+	uint32_t wake;
+
+	__atomic_add_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+	wake = __atomic_load_n(&hdr->wake, __ATOMIC_SEQ_CST);
+
+	// icbm bumps wake after head, and only wakes when it sees a waiter, so
+	// either head has moved here or the futex will not sleep.
+	if (__atomic_load_n(&hdr->head, __ATOMIC_SEQ_CST) == r->tail &&
+	    !__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE))
+		syscall(SYS_futex, &hdr->wake, FUTEX_WAIT, wake, timeout == -1 ? NULL : &ts, NULL, 0);
+
+	__atomic_sub_fetch(&hdr->waiters, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE) &&
+	    __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE) == r->tail) {
+		errno = EPIPE;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* icbm_ring_unmap lets go of the ring. */
+void
+icbm_ring_unmap(struct icbm_ring *r)
+{
+	if (r->hdr)
+		munmap(r->hdr, r->mapsz);
+	memset(r, 0, sizeof(*r));
+}
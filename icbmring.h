@@ -0,0 +1,80 @@
+#ifndef ICBMRING_H_INC
+#define ICBMRING_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+/* icbm can publish every line it forwards from a network to a ring in shared
+ * memory, for consumers on the same host to read without a syscall, or a
+ * parse, per line. A consumer asks icbm's ring socket (-R) for a network's
+ * ring, gets a memfd back, maps it, and reads records as icbm writes them.
+ *
+ * The ring is a header, then ICBM_RING_HDRSZ bytes in, size bytes of records
+ * which wrap around. icbm never waits for consumers: one that falls more than
+ * size bytes behind loses what was overwritten, and starts again from the
+ * newest record. Consumers that run dry may sleep on the wake futex.
+ *
+ * Everything is in host byte order; the ring never leaves the host.
+ */
+
+#define ICBM_RING_MAGIC 0x49434252 // "ICBR"
+#define ICBM_RING_VERSION 1
+#define ICBM_RING_HDRSZ 4096
+#define ICBM_RING_TOKENS 18 // Tags, source, command and 15 parameters
+#define ICBM_RING_NONE 0xffff // Offset of a token the line does not have
+#define ICBM_RING_RECMAX (16 + 4 * ICBM_RING_TOKENS + 4096) // Bytes a record may take
+
+struct icbm_ring_hdr {
+	uint32_t magic, version;
+	uint64_t size; // Of the records, a power of two
+
+	// Bytes ever published; records are complete up to here.
+	uint64_t head __attribute__((aligned(64)));
+
+	// Bytes ever claimed. Records up to size bytes before it may be being
+	// overwritten.
+	uint64_t reserve;
+
+	uint32_t wake __attribute__((aligned(64))); // Bumped, and woken, when there are waiters
+	uint32_t waiters; // Consumers asleep on wake
+	uint32_t closed; // icbm has stopped publishing; ask for the ring again
+};
+
+/* A record: this header, ntok tokens, then the line, without "\r\n", padded
+ * to 8 bytes. A record that would not fit before the end of the ring starts
+ * over at the beginning instead, and a size of 0 marks where. */
+struct icbm_ring_rec {
+	uint32_t size; // Of the whole record
+	uint16_t len; // Of the line
+	uint16_t ntok;
+	int64_t time; // ms since the epoch, when icbm read the line
+
+	// Where irc_parse found the tags, source, command and then each
+	// parameter, as byte offsets into the line, without their leading '@'
+	// or ':'. Tags and source are at ICBM_RING_NONE if there are none.
+	struct {
+		uint16_t off, len;
+	} tok[];
+};
+
+/* icbm_ring_line returns the line of rec. */
+static inline const char *
+icbm_ring_line(const struct icbm_ring_rec *rec)
+{
+	return (const char *)&rec->tok[rec->ntok];
+}
+
+/* A consumer's view of a ring. */
+struct icbm_ring {
+	struct icbm_ring_hdr *hdr;
+	const char *data;
+	size_t mapsz;
+	uint64_t tail; // Where the next record is read from
+	uint64_t lost; // Bytes overwritten before they were read
+};
+
+int icbm_ring_connect(const char *path, const char *network);
+int icbm_ring_map(struct icbm_ring *r, int fd);
+int icbm_ring_read(struct icbm_ring *r, void *buf, size_t sz);
+int icbm_ring_wait(struct icbm_ring *r, int timeout);
+void icbm_ring_unmap(struct icbm_ring *r);
+#endif
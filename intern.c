@@ -0,0 +1,316 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "mem.h"
+
+#define INTERN_INIT_SIZE 64
+
+static const char *casemaps[] = {
+	[CASEMAP_ASCII] = "ascii",
+	[CASEMAP_RFC1459] = "rfc1459",
+	[CASEMAP_STRICT_RFC1459] = "strict-rfc1459",
+};
+
+/* casemap_lower lowercases c under casemap. */
+int
+casemap_lower(int casemap, int c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c + ('a' - 'A');
+
+	if (casemap == CASEMAP_ASCII)
+		return c;
+
+	// {|} are the lowercase versions of [\], and rfc1459 adds ^ for ~.
+	if (c >= '[' && c <= ']')
+		return c + ('{' - '[');
+	if (c == '~' && casemap == CASEMAP_RFC1459)
+		return '^';
+
+	return c;
+}
+
+/* casemap_cmp compares two strings as strcmp does, under casemap. */
+int
+casemap_cmp(int casemap, const char *a, const char *b)
+{
+	int x, y;
+
+	do {
+		x = casemap_lower(casemap, (unsigned char)*a++);
+		y = casemap_lower(casemap, (unsigned char)*b++);
+	} while (x && x == y);
+
+	return x - y;
+}
+
+/* casemap_find returns the casemapping called name, or -1 if it is not one
+ * we know of. */
+int
+casemap_find(const char *name)
+{
+	for (size_t i = 0; i < sizeof(casemaps)/sizeof(*casemaps); ++i)
+		if (strcmp(casemaps[i], name) == 0)
+			return i;
+	return -1;
+}
+
+static uint32_t
+hash(int casemap, const char *s)
+{
+	// FNV-1a over the lowercased string.
+	uint32_t h = 2166136261u;
+
+	for (; *s; ++s)
+		h = (h ^ casemap_lower(casemap, (unsigned char)*s)) * 16777619u;
+
+	return h;
+}
+
+static int
+grow(struct intern *p)
+{
+	size_t cap = p->tcap ? p->tcap * 2 : INTERN_INIT_SIZE;
+	uint32_t *table;
+
+	if (!(table = mem_calloc(MEM_NAMES, cap, sizeof(*table))))
+		return -1;
+
+	for (size_t i = 0; i < p->tcap; ++i) {
+		size_t j;
+
+		if (!p->table[i])
+			continue;
+
+		for (j = p->ents[p->table[i]].hash & (cap - 1); table[j]; j = (j + 1) & (cap - 1));
+		table[j] = p->table[i];
+	}
+
+	mem_free(MEM_NAMES, p->table);
+	p->table = table;
+	p->tcap = cap;
+	return 0;
+}
+
+/* lookup returns the table slot holding s, or the empty slot where it would
+ * go. */
+static size_t
+lookup(struct intern *p, const char *s, uint32_t h)
+{
+	size_t i;
+
+	for (i = h & (p->tcap - 1); p->table[i]; i = (i + 1) & (p->tcap - 1)) {
+		struct intern_entry *e = &p->ents[p->table[i]];
+
+		if (e->hash == h && casemap_cmp(p->casemap, e->str, s) == 0)
+			break;
+	}
+
+	return i;
+}
+
+/* intern_find returns the id of s without taking a reference to it, or 0 if
+ * s is not in the pool. */
+uint32_t
+intern_find(struct intern *p, const char *s)
+{
+	if (!p->tcap)
+		return 0;
+
+	return p->table[lookup(p, s, hash(p->casemap, s))];
+}
+
+/* intern_get returns the id of s, adding it to the pool if needed, and takes
+ * a reference to it. The spelling of the first caller is the one kept.
+ *
+ * On error, 0 is returned.
+ */
+uint32_t
+intern_get(struct intern *p, const char *s)
+{
+	uint32_t h = hash(p->casemap, s), id;
+	struct intern_entry *e;
+	size_t i;
+
+	// Keep the load factor under 3/4.
+	if ((p->tlen + 1) * 4 > p->tcap * 3 && grow(p) == -1)
+		return 0;
+
+	i = lookup(p, s, h);
+	if (p->table[i]) {
+		p->ents[p->table[i]].refs++;
+		return p->table[i];
+	}
+
+	if (p->nunused) {
+		id = p->unused[--p->nunused];
+	} else {
+		if (p->len + 1 >= p->cap) {
+			size_t cap = p->cap ? p->cap * 2 : INTERN_INIT_SIZE;
+			struct intern_entry *ents;
+
+			if (!(ents = mem_realloc(MEM_NAMES, p->ents, sizeof(*ents) * cap)))
+				return 0;
+
+			p->ents = ents;
+			p->cap = cap;
+		}
+
+		// Id 0 is never used.
+		id = ++p->len;
+	}
+
+	e = &p->ents[id];
+	if (!(e->str = mem_strdup(MEM_NAMES, s))) {
+		if (id == p->len)
+			p->len--;
+		else
+			p->unused[p->nunused++] = id;
+		return 0;
+	}
+	e->hash = h;
+	e->refs = 1;
+
+	p->table[i] = id;
+	p->tlen++;
+	return id;
+}
+
+/* intern_ref takes another reference to id and returns it. */
+uint32_t
+intern_ref(struct intern *p, uint32_t id)
+{
+	if (id)
+		p->ents[id].refs++;
+	return id;
+}
+
+/* intern_put puts back a reference to id. Putting back id 0 does nothing. */
+void
+intern_put(struct intern *p, uint32_t id)
+{
+	struct intern_entry *e;
+	size_t i, j;
+
+	if (!id)
+		return;
+
+	e = &p->ents[id];
+	assert(e->refs > 0);
+	if (--e->refs)
+		return;
+
+	// Remember the id for later. If we can't, it is simply never reused.
+	if (p->nunused == p->unusedcap) {
+		size_t cap = p->unusedcap ? p->unusedcap * 2 : INTERN_INIT_SIZE;
+		uint32_t *unused = mem_realloc(MEM_NAMES, p->unused, sizeof(*unused) * cap);
+
+		if (unused) {
+			p->unused = unused;
+			p->unusedcap = cap;
+		}
+	}
+	if (p->nunused < p->unusedcap)
+		p->unused[p->nunused++] = id;
+
+	for (i = e->hash & (p->tcap - 1); p->table[i] != id; i = (i + 1) & (p->tcap - 1));
+
+	mem_free(MEM_NAMES, e->str);
+	e->str = NULL;
+
+	// Shift back any entries that probed past the one we are removing,
+	// so that lookups never stop early at the hole.
+	for (j = (i + 1) & (p->tcap - 1); p->table[j]; j = (j + 1) & (p->tcap - 1)) {
+		size_t home = p->ents[p->table[j]].hash & (p->tcap - 1);
+
+		if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+			p->table[i] = p->table[j];
+			i = j;
+		}
+	}
+
+	p->table[i] = 0;
+	p->tlen--;
+}
+
+/* intern_str returns the string behind id, which stays valid for as long as
+ * a reference to it is held. */
+const char *
+intern_str(struct intern *p, uint32_t id)
+{
+	return id ? p->ents[id].str : NULL;
+}
+
+/* intern_set_casemap changes the casemapping of the pool and rehashes every
+ * string in it.
+ *
+ * Strings that were distinct but now compare equal keep their own ids; only
+ * the first is found by later lookups.
+ *
+ * On error, -1 is returned and the pool is left as it was.
+ */
+int
+intern_set_casemap(struct intern *p, int casemap)
+{
+	uint32_t *table;
+
+	if (casemap == p->casemap)
+		return 0;
+
+	if (!p->tcap) {
+		p->casemap = casemap;
+		return 0;
+	}
+
+	if (!(table = mem_calloc(MEM_NAMES, p->tcap, sizeof(*table))))
+		return -1;
+
+	p->casemap = casemap;
+
+	for (uint32_t id = 1; id <= p->len; ++id) {
+		size_t i;
+
+		if (!p->ents[id].str)
+			continue;
+
+		p->ents[id].hash = hash(casemap, p->ents[id].str);
+		for (i = p->ents[id].hash & (p->tcap - 1); table[i]; i = (i + 1) & (p->tcap - 1));
+		table[i] = id;
+	}
+
+	mem_free(MEM_NAMES, p->table);
+	p->table = table;
+	return 0;
+}
+
+/* intern_bytes returns the amount of memory the pool is using. */
+size_t
+intern_bytes(struct intern *p)
+{
+	size_t n = p->cap * sizeof(*p->ents) + p->unusedcap * sizeof(*p->unused) +
+		p->tcap * sizeof(*p->table);
+
+	for (size_t id = 1; id <= p->len; ++id)
+		if (p->ents[id].str)
+			n += strlen(p->ents[id].str) + 1;
+
+	return n;
+}
+
+/* intern_free frees every string in the pool, whether or not references to
+ * them are still held. */
+void
+intern_free(struct intern *p)
+{
+	for (size_t id = 1; id <= p->len; ++id)
+		mem_free(MEM_NAMES, p->ents[id].str);
+
+	mem_free(MEM_NAMES, p->ents);
+	mem_free(MEM_NAMES, p->unused);
+	mem_free(MEM_NAMES, p->table);
+	memset(p, 0, sizeof(*p));
+}
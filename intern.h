@@ -0,0 +1,53 @@
+#ifndef INTERN_H_INC
+#define INTERN_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+/* Casemappings, as given by the CASEMAPPING ISUPPORT token. */
+enum {
+	CASEMAP_RFC1459,
+	CASEMAP_ASCII,
+	CASEMAP_STRICT_RFC1459,
+};
+
+struct intern_entry {
+	char *str;
+	uint32_t hash;
+	uint32_t refs;
+};
+
+/* intern hands out small, stable ids for strings that compare equal under
+ * the pool's casemapping. Id 0 is never handed out and means "no string".
+ *
+ * Each id is reference counted; the string is freed and its id reused once
+ * the last reference is put back.
+ */
+struct intern {
+	int casemap;
+
+	// Indexed by id.
+	struct intern_entry *ents;
+	size_t len, cap;
+
+	// Ids free for reuse.
+	uint32_t *unused;
+	size_t nunused, unusedcap;
+
+	// Open addressed, holds ids.
+	uint32_t *table;
+	size_t tcap, tlen;
+};
+
+int casemap_lower(int casemap, int c);
+int casemap_cmp(int casemap, const char *a, const char *b);
+int casemap_find(const char *name);
+
+uint32_t intern_get(struct intern *p, const char *s);
+uint32_t intern_find(struct intern *p, const char *s);
+uint32_t intern_ref(struct intern *p, uint32_t id);
+void intern_put(struct intern *p, uint32_t id);
+const char *intern_str(struct intern *p, uint32_t id);
+int intern_set_casemap(struct intern *p, int casemap);
+size_t intern_bytes(struct intern *p);
+void intern_free(struct intern *p);
+#endif
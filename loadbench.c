@@ -0,0 +1,514 @@
+#define _POSIX_C_SOURCE 200809L
+
+/* loadbench measures icbm end to end. It runs icbm against a made up server
+ * and a swarm of clients, and times every message from the moment the server
+ * sends it to the moment each client reads it.
+ *
+ * Usage: loadbench [-c clients] [-n messages] [-m mix] [-r rate] [-i icbm]
+ *                  [-p port] [-P port]
+ *
+ * mix is one of privmsg, joinquit, names, tagged or all. rate is in messages
+ * per second; without it, the server sends as fast as icbm reads.
+ *
+ * Every message carries the time it was sent in a client-only tag, which the
+ * clients ask for with message-tags.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "histo.h"
+
+#define SENDMAX (64 << 10)
+#define RECVSZ 4096
+#define PENDING 128 // Clients registering at once, well within icbm's backlog (-b)
+#define TIMEOUT 10 // Seconds without progress before giving up
+#define DONE "bench-done"
+
+enum {
+	MIX_PRIVMSG,
+	MIX_JOINQUIT,
+	MIX_NAMES,
+	MIX_TAGGED,
+	MIX_ALL,
+};
+
+static const char *mixes[] = {
+	[MIX_PRIVMSG] = "privmsg",
+	[MIX_JOINQUIT] = "joinquit",
+	[MIX_NAMES] = "names",
+	[MIX_TAGGED] = "tagged",
+	[MIX_ALL] = "all",
+};
+
+struct bclient {
+	int fd;
+	int welcomed, done;
+
+	char buf[RECVSZ];
+	size_t len;
+
+	struct histo lat;
+};
+
+static struct bclient *clients;
+static int nclients;
+
+// The server side of icbm's upstream connection.
+static int upfd = -1;
+static char *upout;
+static size_t uplen;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static int
+sock(const char *port, int server)
+{
+	struct addrinfo hints = {0}, *res, *p;
+	int fd = -1, yes = 1, rv;
+
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if ((rv = getaddrinfo("127.0.0.1", port, &hints, &res)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		exit(1);
+	}
+
+	for (p = res; p; p = p->ai_next) {
+		if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+			continue;
+
+		if (server) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+			if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, 1) == 0)
+				break;
+		} else if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+static void
+upsend(const char *line, size_t n)
+{
+	memcpy(upout + uplen, line, n);
+	uplen += n;
+}
+
+/* gen writes message seq of mix to buf, stamped with ns. */
+static size_t
+gen(char *buf, int mix, uint64_t seq, uint64_t ns)
+{
+	static const char *lorem = "Lorem ipsum dolor sit amet, consectetur "
+		"adipiscing elit, sed do eiusmod tempor incididunt ut labore";
+	unsigned nick = seq % 5000;
+	size_t n;
+
+	if (mix == MIX_ALL)
+		mix = seq % MIX_ALL;
+
+	n = sprintf(buf, "@+bench/t=%llu", (unsigned long long)ns);
+
+	switch (mix) {
+	case MIX_PRIVMSG:
+		n += sprintf(buf + n, " :nick%u!~user%u@host%u.example.net PRIVMSG #bench :%.*s\r\n",
+			nick, nick, nick, 20 + (int)(seq % 40), lorem);
+		break;
+	case MIX_JOINQUIT:
+		if (seq % 2)
+			n += sprintf(buf + n, " :nick%u!~user%u@host%u.example.net JOIN #bench\r\n", nick, nick, nick);
+		else
+			n += sprintf(buf + n, " :nick%u!~user%u@host%u.example.net QUIT :Ping timeout: 240 seconds\r\n",
+				nick, nick, nick);
+		break;
+	case MIX_NAMES:
+		// A 353 full of nicks, closed by a 366 every so often.
+		if (seq % 8 == 7) {
+			n += sprintf(buf + n, " :irc.example.net 366 bench #bench :End of /NAMES list.\r\n");
+			break;
+		}
+
+		n += sprintf(buf + n, " :irc.example.net 353 bench = #bench :");
+		for (int i = 0; i < 30; ++i)
+			n += sprintf(buf + n, "%snick%u", i ? " " : "", (nick + i * 7919) % 100000);
+		n += sprintf(buf + n, "\r\n");
+		break;
+	case MIX_TAGGED:
+		n += sprintf(buf + n, ";account=user%u;msgid=%016llx%016llx;+draft/reply=%016llx;"
+			"+draft/react=%s;+example.com/x=%.*s :nick%u!~user%u@host%u.example.net "
+			"PRIVMSG #bench :%s %s %s %s\r\n", nick,
+			(unsigned long long)seq * 0x9e3779b97f4a7c15ULL, (unsigned long long)ns,
+			(unsigned long long)seq - 1, "lol", 100 + (int)(seq % 300), lorem, nick,
+			nick, nick, lorem, lorem, lorem, lorem);
+		break;
+	}
+
+	return n;
+}
+
+/* lines handles every whole line a client has read. */
+static void
+lines(struct bclient *c, uint64_t t)
+{
+	char *p = c->buf, *nl, *tag;
+
+	while ((nl = memchr(p, '\n', c->len - (p - c->buf)))) {
+		*nl = 0;
+
+		if (*p == '@' && (tag = strstr(p, "+bench/t="))) {
+			uint64_t sent = strtoull(tag + 9, NULL, 10);
+
+			histo_add(&c->lat, t > sent ? t - sent : 0);
+			if (strstr(p, DONE))
+				c->done = 1;
+		} else if (!c->welcomed && strstr(p, " 001 "))
+			c->welcomed = 1;
+
+		p = nl + 1;
+	}
+
+	c->len -= p - c->buf;
+	memmove(c->buf, p, c->len);
+
+	// Nothing we send is this long.
+	if (c->len == sizeof(c->buf))
+		c->len = 0;
+}
+
+/* drain reads whatever there is for c. -1 is returned if icbm dropped it. */
+static int
+drain(struct bclient *c)
+{
+	ssize_t r;
+
+	while ((r = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len)) > 0) {
+		c->len += r;
+		lines(c, now());
+	}
+
+	return r == 0 || errno != EAGAIN ? -1 : 0;
+}
+
+/* upstream handles icbm talking to the server, which only matters while it
+ * registers. It returns 1 once registration is done. */
+static int
+upstream(void)
+{
+	static char buf[4096];
+	static size_t len;
+	char *p = buf, *nl;
+	ssize_t r;
+	int reg = 0;
+
+	while ((r = read(upfd, buf + len, sizeof(buf) - len)) > 0) {
+		len += r;
+
+		for (p = buf; (nl = memchr(p, '\n', len - (p - buf))); p = nl + 1) {
+			if (strncmp(p, "CAP LS", 6) == 0)
+				upsend(":bench CAP * LS :\r\n", 19);
+			else if (strncmp(p, "USER", 4) == 0)
+				reg = 1;
+		}
+
+		len -= p - buf;
+		memmove(buf, p, len);
+		if (len == sizeof(buf))
+			len = 0;
+	}
+
+	if (r == 0 || (r == -1 && errno != EAGAIN)) {
+		fprintf(stderr, "icbm went away\n");
+		exit(1);
+	}
+
+	if (reg) {
+		const char *welcome = ":bench 001 bench :Welcome\r\n"
+			":bench 005 bench CASEMAPPING=ascii :are supported by this server\r\n";
+		upsend(welcome, strlen(welcome));
+	}
+
+	return reg;
+}
+
+/* flush writes out what the server has for icbm. It returns the number of
+ * bytes icbm took. */
+static ssize_t
+flush(void)
+{
+	ssize_t r;
+
+	if (!uplen)
+		return 0;
+
+	if ((r = write(upfd, upout, uplen)) > 0) {
+		memmove(upout, upout + r, uplen - r);
+		uplen -= r;
+	} else if (r == -1 && errno != EAGAIN)
+		die("write");
+
+	return r > 0 ? r : 0;
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [-c clients] [-n messages] [-m privmsg|joinquit|names|tagged|all]\n"
+		"       [-r rate] [-i icbm] [-p port] [-P port]\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *icbm = "./icbm", *port = "17667", *lport = "17668";
+	int opt, mix = MIX_PRIVMSG, lfd, registered = 0, connected = 0, ndone = 0, lost = 0;
+	long long msgs = 100000, sent = 0;
+	double rate = 0;
+	uint64_t start, end, last, progress;
+	struct pollfd *pfds;
+	struct histo all = {0}, p99s = {0};
+	struct rusage ru;
+	struct rlimit rl;
+	pid_t pid;
+
+	while ((opt = getopt(argc, argv, "c:n:m:r:i:p:P:")) != -1) {
+		switch (opt) {
+		case 'c': nclients = atoi(optarg); break;
+		case 'n': msgs = atoll(optarg); break;
+		case 'm':
+			for (mix = 0; mix < sizeof(mixes)/sizeof(*mixes); ++mix)
+				if (strcmp(mixes[mix], optarg) == 0)
+					break;
+			if (mix == sizeof(mixes)/sizeof(*mixes))
+				usage(argv[0]);
+			break;
+		case 'r': rate = atof(optarg); break;
+		case 'i': icbm = optarg; break;
+		case 'p': port = optarg; break;
+		case 'P': lport = optarg; break;
+		default: usage(argv[0]);
+		}
+	}
+
+	if (nclients <= 0)
+		nclients = 1;
+
+	// Both us and icbm need a descriptor per client.
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < nclients + 64) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		if (rl.rlim_cur < nclients + 64) {
+			fprintf(stderr, "need %d descriptors, only have %llu\n", nclients + 64,
+				(unsigned long long)rl.rlim_cur);
+			return 1;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (!(clients = calloc(nclients, sizeof(*clients))) ||
+	    !(pfds = calloc(nclients + 1, sizeof(*pfds))) ||
+	    !(upout = malloc(SENDMAX + 8192)))
+		die("calloc");
+
+	if ((lfd = sock(port, 1)) == -1)
+		die("listen");
+
+	// icbm logs every line at the debug level, which is not what is being
+	// measured.
+	if ((pid = fork()) == -1)
+		die("fork");
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+
+		close(lfd);
+
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		execl(icbm, icbm, "-a", "127.0.0.1", "-p", port, "-P", lport, "-u", "bench", (char *)NULL);
+		_exit(127);
+	}
+
+	if ((upfd = accept(lfd, NULL, NULL)) == -1)
+		die("accept");
+	close(lfd);
+	fcntl(upfd, F_SETFL, O_NONBLOCK);
+
+	// Register icbm, then every client.
+	while (!registered || connected < nclients || ndone < nclients) {
+		int pending = 0, n = 0;
+
+		for (int i = 0; i < connected; ++i)
+			pending += !clients[i].welcomed;
+
+		while (registered && connected < nclients && pending < PENDING) {
+			struct bclient *c = &clients[connected++];
+			char buf[256];
+			int len;
+
+			if ((c->fd = sock(lport, 0)) == -1)
+				die("connect");
+			fcntl(c->fd, F_SETFL, O_NONBLOCK);
+
+			len = sprintf(buf, "CAP REQ :message-tags\r\nNICK c%d\r\nUSER c%d 0 * :c%d\r\nCAP END\r\n",
+				connected, connected, connected);
+			if (write(c->fd, buf, len) != len)
+				die("write");
+			pending++;
+		}
+
+		pfds[n].fd = upfd;
+		pfds[n++].events = POLLIN | (uplen ? POLLOUT : 0);
+		for (int i = 0; i < connected; ++i) {
+			pfds[n].fd = clients[i].fd;
+			pfds[n++].events = POLLIN;
+		}
+
+		if (poll(pfds, n, 1000) == -1 && errno != EINTR)
+			die("poll");
+
+		if (pfds[0].revents & POLLIN)
+			registered |= upstream();
+		flush();
+
+		ndone = 0;
+		for (int i = 0; i < connected; ++i) {
+			if (pfds[i+1].revents & POLLIN && drain(&clients[i]) == -1) {
+				fprintf(stderr, "icbm dropped client %d while registering\n", i);
+				return 1;
+			}
+			ndone += clients[i].welcomed;
+		}
+	}
+
+	// The real thing. Clients count from zero again once here.
+	for (int i = 0; i < nclients; ++i)
+		memset(&clients[i].lat, 0, sizeof(clients[i].lat));
+
+	start = last = progress = now();
+	ndone = 0;
+
+	while (ndone + lost < nclients) {
+		uint64_t t = now();
+		int n = 0;
+
+		// Top the server up.
+		while (sent <= msgs && uplen < SENDMAX) {
+			if (rate > 0 && sent >= (t - start) / 1e9 * rate)
+				break;
+
+			if (sent < msgs)
+				uplen += gen(upout + uplen, mix, sent, t);
+			else
+				uplen += sprintf(upout + uplen, "@+bench/t=%llu :bench!b@h PRIVMSG #bench :" DONE "\r\n",
+					(unsigned long long)t);
+			sent++;
+		}
+		if (flush())
+			progress = now();
+
+		pfds[n].fd = upfd;
+		pfds[n++].events = POLLIN | (uplen ? POLLOUT : 0);
+		for (int i = 0; i < nclients; ++i) {
+			pfds[n].fd = clients[i].done || clients[i].fd == -1 ? -1 : clients[i].fd;
+			pfds[n++].events = POLLIN;
+		}
+
+		if (poll(pfds, n, rate > 0 ? 1 : 100) == -1 && errno != EINTR)
+			die("poll");
+
+		if (pfds[0].revents & POLLIN)
+			upstream();
+
+		for (int i = 0; i < nclients; ++i) {
+			struct bclient *c = &clients[i];
+
+			if (!(pfds[i+1].revents & (POLLIN | POLLHUP)))
+				continue;
+
+			last = progress = now();
+			if (drain(c) == -1) {
+				close(c->fd);
+				c->fd = -1;
+				lost++;
+			} else if (c->done)
+				ndone++; // Not polled for again
+		}
+
+		// icbm drops lines for clients that fall too far behind, the
+		// last one included.
+		if (now() - progress > TIMEOUT * 1000000000ULL)
+			break;
+	}
+	end = last;
+
+	// icbm tries to flush every client before it exits, so they all have
+	// to go first.
+	for (int i = 0; i < nclients; ++i) {
+		if (clients[i].fd != -1)
+			close(clients[i].fd);
+	}
+	close(upfd);
+
+	// icbm writes its usage out when it exits.
+	kill(pid, SIGTERM);
+	if (waitpid(pid, NULL, 0) == -1)
+		die("waitpid");
+	getrusage(RUSAGE_CHILDREN, &ru);
+
+	for (int i = 0; i < nclients; ++i) {
+		histo_merge(&all, &clients[i].lat);
+		if (clients[i].lat.count)
+			histo_add(&p99s, histo_quantile(&clients[i].lat, 0.99));
+	}
+
+	printf("%s, %d clients, %lld messages\n", mixes[mix], nclients, msgs);
+	printf("  forwarded:  %.0f msgs/s (%llu of %llu delivered, %d clients dropped)\n",
+		end > start ? all.count / ((end - start) / 1e9) : 0, (unsigned long long)all.count,
+		(unsigned long long)(msgs + 1) * nclients, lost);
+	printf("  latency:    p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us\n",
+		histo_quantile(&all, 0.5) / 1e3, histo_quantile(&all, 0.99) / 1e3,
+		histo_quantile(&all, 0.999) / 1e3, all.max / 1e3);
+	printf("  per client: p99 of median client %.1f us, of worst client %.1f us\n",
+		histo_quantile(&p99s, 0.5) / 1e3, p99s.max / 1e3);
+	printf("  icbm:       %.2f s user, %.2f s system, %ld KiB max RSS\n",
+		ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+		ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6, ru.ru_maxrss);
+
+	free(clients);
+	free(pfds);
+	free(upout);
+	return 0;
+}
@@ -1,16 +1,26 @@
-#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // For syscall
 
 #include <assert.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "clk.h"
 #include "log.h"
+#include "mem.h"
+#include "trace.h"
 
 // Done out of laziness...
 #define LOGFN(NAME, LEVEL) void \
-NAME(const char *fmt, ...) \
+(NAME)(const char *fmt, ...) \
 { \
 	va_list ap; \
 	va_start(ap, fmt); \
@@ -18,10 +28,68 @@ NAME(const char *fmt, ...) \
 	va_end(ap); \
 }
 
+#define LOG_RING_SIZE (256*1024) // Per thread, must be a power of two
+#define LOG_REC_MAX 2048
+#define LOG_LINE_MAX 512
+#define LOG_BATCH (64*1024)
+#define LOG_IDLE_NS 1000000
+#define LOG_IDLE_ROUNDS 10 // Of LOG_IDLE_NS, before sleeping until woken
+
+enum {
+	ARG_NONE,
+	ARG_INT,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_SIZE,
+	ARG_PTR,
+	ARG_DOUBLE,
+	ARG_STR,
+};
+
+/* spec is a single conversion in a format string. */
+struct spec {
+	const char *start, *end;
+	int type;
+	int wstar, pstar;
+	int prec; // -1 if none given
+};
+
+/* log_rec is the header of a message in a ring. The arguments follow it in
+ * the order the format uses them. */
+struct log_rec {
+	uint32_t len; // Including the header, a multiple of 8
+	int level; // -1 for padding up to the end of the ring
+	struct timespec ts;
+	const char *fmt;
+};
+
+/* log_ring is written to by exactly one thread and read by the writer. */
+struct log_ring {
+	uint64_t head;
+	uint64_t dropped;
+	char pad[48];
+
+	uint64_t tail;
+	uint64_t reported; // Writer only
+
+	char buf[LOG_RING_SIZE];
+};
+
 int log_fd = STDOUT_FILENO;
 int log_level = LOG_DEBUG;
 int log_color = 1;
 
+static struct log_ring **rings;
+static int nrings, maxrings; // One per thread, as many as log_init was told
+static __thread struct log_ring *ring;
+static __thread int noring; // Set once the calling thread did not get one
+
+static pthread_t writer_thread;
+static int async; // Set while the writer is running
+static int stopping;
+static int sleeping; // Set while the writer waits on wake
+static uint32_t wake; // Futex, bumped to wake the writer
+
 static const char *lognames[LOG_LAST] = {
 	[LOG_ERROR] = "ERROR",
 	[LOG_WARN] = "WARN",
@@ -36,26 +104,566 @@ static const char *logfmt[LOG_LAST] = {
 	[LOG_DEBUG] = "\x1b[1;95m",
 };
 
+/* next_spec finds the first conversion in fmt, including "%%".
+ *
+ * 0 is returned if there are none left.
+ */
+static int
+next_spec(const char *fmt, struct spec *s)
+{
+	const char *p;
+	int lng = 0;
+
+	if (!(p = strchr(fmt, '%')))
+		return 0;
+
+	memset(s, 0, sizeof(*s));
+	s->start = p++;
+	s->prec = -1;
+
+	p += strspn(p, "-+ #0");
+
+	if (*p == '*') {
+		s->wstar = 1;
+		p++;
+	} else
+		p += strspn(p, "0123456789");
+
+	if (*p == '.') {
+		if (*++p == '*') {
+			s->pstar = 1;
+			p++;
+		} else {
+			s->prec = atoi(p);
+			p += strspn(p, "0123456789");
+		}
+	}
+
+	if (*p == 'h') {
+		p += p[1] == 'h' ? 2 : 1;
+	} else if (*p == 'l') {
+		lng = p[1] == 'l' ? 2 : 1;
+		p += lng;
+	} else if (*p == 'j') {
+		lng = 2;
+		p++;
+	} else if (*p == 'z' || *p == 't') {
+		lng = 3;
+		p++;
+	}
+
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'o': case 'x': case 'X': case 'c':
+		s->type = (int []){ ARG_INT, ARG_LONG, ARG_LLONG, ARG_SIZE }[lng];
+		break;
+	case 's': s->type = ARG_STR; break;
+	case 'p': s->type = ARG_PTR; break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+		s->type = ARG_DOUBLE;
+		break;
+	case '%': s->type = ARG_NONE; break;
+	default:
+		// Not something we know how to copy; print it as is.
+		s->end = p;
+		s->type = -1;
+		return 1;
+	}
+
+	s->end = p + 1;
+	return 1;
+}
+
+static size_t
+arg_size(int type)
+{
+	switch (type) {
+	case ARG_INT: return sizeof(int);
+	case ARG_LONG: return sizeof(long);
+	case ARG_LLONG: return sizeof(long long);
+	case ARG_SIZE: return sizeof(size_t);
+	case ARG_PTR: return sizeof(void *);
+	case ARG_DOUBLE: return sizeof(double);
+	}
+	return 0;
+}
+
+/* serialize copies the arguments fmt uses out of ap and into rec, which is n
+ * bytes long. Strings are copied whole where they fit and truncated where
+ * they do not.
+ *
+ * The number of bytes used is returned.
+ */
+static size_t
+serialize(char *rec, size_t n, const char *fmt, va_list ap)
+{
+	struct spec s;
+	size_t ptr = 0;
+
+	for (; next_spec(fmt, &s); fmt = s.end) {
+		int star[2], nstar = 0;
+
+		if (s.type == -1)
+			continue;
+
+		if (s.wstar)
+			star[nstar++] = va_arg(ap, int);
+		if (s.pstar && (star[nstar++] = va_arg(ap, int)) >= 0)
+			s.prec = star[nstar-1];
+
+		if (ptr + nstar * sizeof(int) + arg_size(s.type) + (s.type == ARG_STR ? sizeof(uint16_t) : 0) > n)
+			break;
+
+		memcpy(rec + ptr, star, nstar * sizeof(int));
+		ptr += nstar * sizeof(int);
+
+		switch (s.type) {
+		case ARG_INT: { int v = va_arg(ap, int); memcpy(rec + ptr, &v, sizeof(v)); break; }
+		case ARG_LONG: { long v = va_arg(ap, long); memcpy(rec + ptr, &v, sizeof(v)); break; }
+		case ARG_LLONG: { long long v = va_arg(ap, long long); memcpy(rec + ptr, &v, sizeof(v)); break; }
+		case ARG_SIZE: { size_t v = va_arg(ap, size_t); memcpy(rec + ptr, &v, sizeof(v)); break; }
+		case ARG_PTR: { void *v = va_arg(ap, void *); memcpy(rec + ptr, &v, sizeof(v)); break; }
+		case ARG_DOUBLE: { double v = va_arg(ap, double); memcpy(rec + ptr, &v, sizeof(v)); break; }
+		case ARG_STR: {
+			const char *v = va_arg(ap, const char *);
+			size_t max = n - ptr - sizeof(uint16_t);
+			uint16_t len;
+
+			if (!v)
+				v = "(null)";
+
+			// Never read past the precision; the string may not
+			// be terminated.
+			if (s.prec >= 0 && s.prec < max)
+				max = s.prec;
+			len = strnlen(v, max);
+
+			memcpy(rec + ptr, &len, sizeof(len));
+			memcpy(rec + ptr + sizeof(len), v, len);
+			ptr += sizeof(len) + len;
+			break;
+		}
+		}
+
+		ptr += arg_size(s.type);
+	}
+
+	return ptr;
+}
+
+/* render formats a message out of its copied arguments into buf, which is n
+ * bytes long. The number of bytes written is returned. */
+static size_t
+render(const char *fmt, const char *args, size_t nargs, char *buf, size_t n)
+{
+	struct spec s;
+	size_t ptr = 0, aptr = 0;
+	char sb[32], str[LOG_REC_MAX];
+	int r = 0;
+
+	assert(n > 0);
+
+	for (; ptr < n - 1 && next_spec(fmt, &s); fmt = s.end) {
+		size_t lit = s.start - fmt, need;
+		int star[2] = {0}, nstar = s.wstar + s.pstar;
+
+		if (lit > n - 1 - ptr)
+			lit = n - 1 - ptr;
+		memcpy(buf + ptr, fmt, lit);
+		ptr += lit;
+
+		if (s.type == -1 || s.end - s.start >= sizeof(sb)) {
+			lit = s.end - s.start;
+			if (lit > n - 1 - ptr)
+				lit = n - 1 - ptr;
+			memcpy(buf + ptr, s.start, lit);
+			ptr += lit;
+			continue;
+		}
+
+		need = nstar * sizeof(int) + arg_size(s.type) + (s.type == ARG_STR ? sizeof(uint16_t) : 0);
+		if (aptr + need > nargs)
+			break;
+
+		memcpy(star, args + aptr, nstar * sizeof(int));
+		aptr += nstar * sizeof(int);
+
+		memcpy(sb, s.start, s.end - s.start);
+		sb[s.end - s.start] = 0;
+
+#define EMIT(v) \
+	(nstar == 2 ? snprintf(buf + ptr, n - ptr, sb, star[0], star[1], v) : \
+	 nstar == 1 ? snprintf(buf + ptr, n - ptr, sb, star[0], v) : \
+	 snprintf(buf + ptr, n - ptr, sb, v))
+
+		switch (s.type) {
+		case ARG_NONE: r = snprintf(buf + ptr, n - ptr, "%%"); break;
+		case ARG_INT: { int v; memcpy(&v, args + aptr, sizeof(v)); r = EMIT(v); break; }
+		case ARG_LONG: { long v; memcpy(&v, args + aptr, sizeof(v)); r = EMIT(v); break; }
+		case ARG_LLONG: { long long v; memcpy(&v, args + aptr, sizeof(v)); r = EMIT(v); break; }
+		case ARG_SIZE: { size_t v; memcpy(&v, args + aptr, sizeof(v)); r = EMIT(v); break; }
+		case ARG_PTR: { void *v; memcpy(&v, args + aptr, sizeof(v)); r = EMIT(v); break; }
+		case ARG_DOUBLE: { double v; memcpy(&v, args + aptr, sizeof(v)); r = EMIT(v); break; }
+		case ARG_STR: {
+			uint16_t len;
+
+			memcpy(&len, args + aptr, sizeof(len));
+			if (aptr + sizeof(len) + len > nargs)
+				len = nargs - aptr - sizeof(len);
+			memcpy(str, args + aptr + sizeof(len), len);
+			str[len] = 0;
+			aptr += sizeof(len) + len;
+
+			r = EMIT(str);
+			break;
+		}
+		}
+#undef EMIT
+
+		aptr += arg_size(s.type);
+		if (r > 0)
+			ptr += r;
+		if (ptr > n - 1)
+			ptr = n - 1;
+	}
+
+	// Whatever is left of the format.
+	if (ptr < n - 1) {
+		size_t lit = strlen(fmt);
+
+		if (lit > n - 1 - ptr)
+			lit = n - 1 - ptr;
+		memcpy(buf + ptr, fmt, lit);
+		ptr += lit;
+	}
+
+	buf[ptr] = 0;
+	return ptr;
+}
+
+/* line writes a whole log line into buf, which should be at least
+ * LOG_LINE_MAX+64 bytes long. */
+static size_t
+line(char *buf, int level, const char *time, const char *msg, size_t len)
+{
+	return sprintf(buf, "[%s] %s%s%s %.*s\n", time, log_color ? logfmt[level] : "",
+		lognames[level], log_color ? "\x1b[0m" : "", (int)len, msg);
+}
+
+/* writer_time returns the local time at ts for the writer thread, which does
+ * not share the event loop's cached string and so keeps its own. */
+static const char *
+writer_time(const struct timespec *ts)
+{
+	static time_t lastsec = -1;
+	static char buf[32];
+	struct tm tm;
+
+	if (ts->tv_sec != lastsec && localtime_r(&ts->tv_sec, &tm)) {
+		strftime(buf, sizeof(buf), "%F %H:%M:%S", &tm);
+		lastsec = ts->tv_sec;
+	}
+
+	return buf;
+}
+
+static void
+flush(char *buf, size_t *n)
+{
+	size_t off = 0;
+	ssize_t r;
+	uint64_t t = TRACE_BEGIN();
+
+	while (off < *n && (r = write(log_fd, buf + off, *n - off)) > 0)
+		off += r;
+
+	TRACE_END("log write", *n, t);
+	*n = 0;
+}
+
+/* drain writes out everything queued up in r, batching writes into buf.
+ * It returns the number of messages taken out of the ring. */
+static int
+drain(struct log_ring *r, char *buf, size_t *n)
+{
+	uint64_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	uint64_t dropped;
+	char msg[LOG_LINE_MAX];
+	int count = 0;
+
+	for (; tail != head; ++count) {
+		struct log_rec rec;
+		size_t len;
+
+		// Too little room for a header at the end means padding.
+		if ((tail & (LOG_RING_SIZE - 1)) + sizeof(rec) > LOG_RING_SIZE) {
+			tail += LOG_RING_SIZE - (tail & (LOG_RING_SIZE - 1));
+			continue;
+		}
+
+		memcpy(&rec, r->buf + (tail & (LOG_RING_SIZE - 1)), sizeof(rec));
+
+		if (rec.level != -1) {
+			len = render(rec.fmt, r->buf + (tail & (LOG_RING_SIZE - 1)) + sizeof(rec),
+				rec.len - sizeof(rec), msg, sizeof(msg));
+
+			if (*n + len + 64 > LOG_BATCH)
+				flush(buf, n);
+			*n += line(buf + *n, rec.level, writer_time(&rec.ts), msg, len);
+		}
+
+		tail += rec.len;
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	if (dropped != r->reported) {
+		struct timespec ts;
+		size_t len;
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		len = snprintf(msg, sizeof(msg), "log: dropped %llu messages, the writer could not keep up",
+			(unsigned long long)(dropped - r->reported));
+		if (*n + len + 64 > LOG_BATCH)
+			flush(buf, n);
+		*n += line(buf + *n, LOG_WARN, writer_time(&ts), msg, len);
+		r->reported = dropped;
+	}
+
+	return count;
+}
+
+/* pending reports whether any ring has something in it. */
+static int
+pending(void)
+{
+	int len = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+
+	for (int i = 0; i < len; ++i)
+		if (__atomic_load_n(&rings[i]->head, __ATOMIC_SEQ_CST) != rings[i]->tail)
+			return 1;
+	return 0;
+}
+
+/* wake_writer wakes the writer, if it is asleep. */
 static void
-write_current_time(char *buf, size_t n)
-{
-	// XXX: I would like microsecond precision to three or so decimal
-	// places.
-	time_t t;
-	struct tm *tmp;
-
-	t = time(NULL);
-	tmp = localtime(&t);
-	if (!tmp) {
-		// Shouldn't happen, will ignore.
-		*buf = 0;
+wake_writer(void)
+{
+	if (!__atomic_load_n(&sleeping, __ATOMIC_SEQ_CST))
 		return;
+
+	__atomic_add_fetch(&wake, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &wake, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* writer drains the rings. While messages keep coming it polls them, and
+ * once they stop it sleeps until a thread logs again. */
+static void *
+writer(void *)
+{
+	static char buf[LOG_BATCH];
+	struct timespec idle = { 0, LOG_IDLE_NS };
+	size_t n = 0;
+	int rounds = 0;
+
+	trace_thread("log writer");
+
+	for (;;) {
+		int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE), count = 0;
+		int len = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+		uint32_t seq;
+
+		for (int i = 0; i < len; ++i)
+			count += drain(rings[i], buf, &n);
+
+		if (n)
+			flush(buf, &n);
+
+		if (count) {
+			rounds = 0;
+			continue;
+		}
+		if (stop)
+			break;
+
+		if (++rounds < LOG_IDLE_ROUNDS) {
+			nanosleep(&idle, NULL);
+			continue;
+		}
+
+		// Whoever logs after this sees sleeping set, or we see what
+		// they logged.
+		seq = __atomic_load_n(&wake, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!pending() && !__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+			syscall(SYS_futex, &wake, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+		__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+		rounds = 0;
+	}
+
+	return NULL;
+}
+
+/* ring_get returns the ring of the calling thread, making it if need be. */
+static struct log_ring *
+ring_get(void)
+{
+	static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+	struct log_ring *r;
+	int i;
+
+	if (ring)
+		return ring;
+	if (noring)
+		return NULL;
+
+	if (!(r = mem_calloc(MEM_LOG, 1, sizeof(*r)))) {
+		noring = 1;
+		return NULL;
+	}
+
+	// Only the writer reads the list, so a slot is only ever taken here.
+	pthread_mutex_lock(&mu);
+	if ((i = nrings) < maxrings) {
+		rings[i] = r;
+		__atomic_store_n(&nrings, i + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&mu);
+
+	if (i >= maxrings) {
+		mem_free(MEM_LOG, r);
+
+		// Said synchronously, as is everything the thread logs from now.
+		noring = 1;
+		warnf("Log: all %d rings are taken, logging synchronously", maxrings);
+		return NULL;
 	}
 
-	strftime(buf, n, "%F %H:%M:%S", tmp);
+	return ring = r;
+}
+
+/* enqueue copies a message into the ring of the calling thread. If the ring
+ * is full, the message is dropped, unless it is a warning or an error.
+ *
+ * -1 is returned if it could not be queued, in which case the caller must
+ * write it out itself.
+ */
+static int
+enqueue(int level, const char *fmt, va_list ap)
+{
+	struct log_ring *r;
+	struct log_rec rec;
+	char tmp[LOG_REC_MAX];
+	uint64_t head, tail;
+	size_t len, off, pad = 0;
+
+	if (!(r = ring_get()))
+		return -1;
+
+	if (!clk_real.tv_sec)
+		clk_refresh();
+
+	rec.level = level;
+	rec.fmt = fmt;
+	rec.ts = clk_real;
+
+	len = sizeof(rec) + serialize(tmp + sizeof(rec), sizeof(tmp) - sizeof(rec), fmt, ap);
+	len = (len + 7) & ~(size_t)7;
+	rec.len = len;
+	memcpy(tmp, &rec, sizeof(rec));
+
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	// Records never wrap around; the rest of the ring is padded out
+	// instead.
+	off = head & (LOG_RING_SIZE - 1);
+	if (off + len > LOG_RING_SIZE)
+		pad = LOG_RING_SIZE - off;
+
+	if (head + pad + len - tail > LOG_RING_SIZE) {
+		if (level <= LOG_WARN)
+			return -1;
+
+		__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	if (pad) {
+		struct log_rec p = { .len = pad, .level = -1 };
+
+		if (pad >= sizeof(p))
+			memcpy(r->buf + off, &p, sizeof(p));
+		head += pad;
+		off = 0;
+	}
+
+	memcpy(r->buf + off, tmp, len);
+	__atomic_store_n(&r->head, head + len, __ATOMIC_SEQ_CST);
+
+	// Only a load while the writer is awake. Whether the ring looked
+	// empty is not enough to go by: the writer may have emptied it and
+	// gone to sleep since.
+	wake_writer();
+	return 0;
+}
+
+/* log_init starts the writer thread, for up to threads threads logging
+ * through it; any more log synchronously. Until it is called, and after
+ * log_flush, messages are written out as they are logged.
+ *
+ * On error, -1 is returned.
+ */
+int
+log_init(int threads)
+{
+	if (async)
+		return 0;
+
+	if (!(rings = mem_calloc(MEM_LOG, threads, sizeof(*rings))))
+		return -1;
+	maxrings = threads;
+
+	if (pthread_create(&writer_thread, NULL, writer, NULL) != 0)
+		return -1;
+
+	__atomic_store_n(&async, 1, __ATOMIC_RELEASE);
+	atexit(log_flush);
+	return 0;
+}
+
+/* log_flush writes out every queued message and stops the writer thread. */
+void
+log_flush(void)
+{
+	if (!__atomic_load_n(&async, __ATOMIC_ACQUIRE))
+		return;
+
+	__atomic_store_n(&async, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+	wake_writer();
+	pthread_join(writer_thread, NULL);
+	stopping = 0;
+}
+
+/* log_dropped returns the number of messages dropped so far because the
+ * writer could not keep up. */
+unsigned long long
+log_dropped(void)
+{
+	unsigned long long n = 0;
+	int len = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE);
+
+	for (int i = 0; i < len; ++i)
+		n += __atomic_load_n(&rings[i]->dropped, __ATOMIC_RELAXED);
+
+	return n;
 }
 
 /* vlogf logs a message with a specified level.
+ *
+ * Once log_init has been called, only the format and a copy of its
+ * arguments are queued here; the writer thread formats and writes them out.
+ * fmt must therefore outlive the program, which any string literal does.
  *
  * You likely do not want to use this.
  * See the helper functions infof, warnf, errorf, and debugf.
@@ -63,28 +671,32 @@ write_current_time(char *buf, size_t n)
 void
 vlogf(const int level, const char *fmt, va_list ap)
 {
-	const char *lname;
-	const char *lfmt;
-	const char *lfmtr;
-	char time_buf[32] = {0};
-	char buf[512] = {0};
-	char prefix_buf[64] = {0};
+	char buf[LOG_LINE_MAX], out[LOG_LINE_MAX+64];
+	size_t n;
 
 	if (level > log_level)
 		return;
 
 	assert(level < LOG_LAST);
 
-	lname = lognames[level];
-	lfmt = log_color ? logfmt[level] : "";
-	lfmtr = log_color ? "\x1b[0m" : "";
+	if (__atomic_load_n(&async, __ATOMIC_ACQUIRE)) {
+		va_list cp;
+		int r;
 
-	write_current_time(time_buf, sizeof(time_buf));
+		va_copy(cp, ap);
+		r = enqueue(level, fmt, cp);
+		va_end(cp);
+
+		if (r == 0)
+			return;
+	}
 
-	snprintf(prefix_buf, sizeof(prefix_buf), "[%s] %s%s%s", time_buf, lfmt, lname, lfmtr);
-	vsnprintf(buf, sizeof(buf), fmt, ap);	
+	n = vsnprintf(buf, sizeof(buf), fmt, ap);
+	if (n >= sizeof(buf))
+		n = sizeof(buf) - 1;
 
-	dprintf(log_fd, "%s %s\n", prefix_buf, buf);
+	n = line(out, level, clk_local(), buf, n);
+	flush(out, &n);
 }
 
 /* infof logs a message to the logger at the info level. */
@@ -9,11 +9,29 @@ enum {
 	LOG_LAST
 };
 
+/* Messages above LOG_LEVEL are compiled out entirely, arguments and all.
+ * The Makefile builds with LOG_INFO; "make LOGLEVEL=LOG_DEBUG" keeps every
+ * line in and out. */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_ENABLED(level) ((level) <= LOG_LEVEL && (level) <= log_level)
+
 extern int log_fd;
 extern int log_level;
 
+int log_init(int threads);
+void log_flush(void);
+unsigned long long log_dropped(void);
+
 void vlogf(const int level, const char *fmt, va_list ap);
 void infof(const char *fmt, ...);
 void warnf(const char *fmt, ...);
 void errorf(const char *fmt, ...);
 void debugf(const char *fmt, ...);
+
+#define infof(...) (LOG_ENABLED(LOG_INFO) ? infof(__VA_ARGS__) : (void)0)
+#define warnf(...) (LOG_ENABLED(LOG_WARN) ? warnf(__VA_ARGS__) : (void)0)
+#define errorf(...) (LOG_ENABLED(LOG_ERROR) ? errorf(__VA_ARGS__) : (void)0)
+#define debugf(...) (LOG_ENABLED(LOG_DEBUG) ? debugf(__VA_ARGS__) : (void)0)
@@ -0,0 +1,181 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* lz is a byte-oriented LZ77 compressor in the spirit of LZ4. It trades
+ * ratio for speed, which is the right trade for IRC logs: the redundancy is
+ * almost entirely repeated sources, commands and targets, and short matches
+ * catch all of that.
+ *
+ * Compressed data is a list of sequences:
+ *
+ *	token    high nibble: literal count, low nibble: match length - 4
+ *	[255...] literal count continued, if the nibble was 15
+ *	literals
+ *	offset   2 bytes, little endian, distance back to the match
+ *	[255...] match length continued, if the nibble was 15
+ *
+ * The last sequence holds only literals and ends at the end of the input.
+ */
+
+#define MINMATCH 4
+#define HASH_BITS 13
+#define MAX_OFFSET 65535
+
+static uint32_t
+read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t
+hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* put_len writes the continuation bytes of a length whose nibble was 15. */
+static unsigned char *
+put_len(unsigned char *op, size_t len)
+{
+	for (len -= 15; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+/* lz_compress compresses n bytes from src into dst.
+ *
+ * The size of the compressed data is returned, or 0 if it would not fit in
+ * cap bytes. A cap of LZ_BOUND(n) is always enough.
+ */
+size_t
+lz_compress(const void *src, size_t n, void *dst, size_t cap)
+{
+	const unsigned char *in = src;
+	unsigned char *op = dst, *end = op + cap;
+	uint32_t table[1 << HASH_BITS] = {0};
+	size_t ip = 0, anchor = 0;
+
+	// Stored positions are off by one so that zero means "nothing".
+	while (n >= MINMATCH && ip <= n - MINMATCH) {
+		uint32_t h = hash(read32(in + ip));
+		size_t ref = table[h], lit, mlen;
+
+		table[h] = ip + 1;
+
+		if (!ref-- || ip - ref > MAX_OFFSET || read32(in + ref) != read32(in + ip)) {
+			ip++;
+			continue;
+		}
+
+		for (mlen = MINMATCH; ip + mlen < n && in[ref + mlen] == in[ip + mlen]; ++mlen);
+
+		lit = ip - anchor;
+		if (op + 1 + lit + lit/255 + 2 + mlen/255 + 2 > end)
+			return 0;
+
+		*op++ = (lit >= 15 ? 15 : lit) << 4 | (mlen - MINMATCH >= 15 ? 15 : mlen - MINMATCH);
+		if (lit >= 15)
+			op = put_len(op, lit);
+
+		memcpy(op, in + anchor, lit);
+		op += lit;
+
+		*op++ = (ip - ref) & 0xff;
+		*op++ = (ip - ref) >> 8;
+
+		if (mlen - MINMATCH >= 15)
+			op = put_len(op, mlen - MINMATCH);
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	// Whatever is left over goes out as literals.
+	size_t lit = n - anchor;
+	if (op + 1 + lit + lit/255 + 1 > end)
+		return 0;
+
+	*op++ = (lit >= 15 ? 15 : lit) << 4;
+	if (lit >= 15)
+		op = put_len(op, lit);
+
+	memcpy(op, in + anchor, lit);
+	op += lit;
+
+	return op - (unsigned char *)dst;
+}
+
+/* get_len reads the continuation bytes of a length. */
+static int
+get_len(const unsigned char **ip, const unsigned char *end, size_t *len)
+{
+	unsigned char b;
+
+	do {
+		if (*ip >= end)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return 0;
+}
+
+/* lz_decompress decompresses n bytes from src into dst.
+ *
+ * The size of the decompressed data is returned, or -1 if src is corrupt or
+ * would not fit in cap bytes.
+ */
+long
+lz_decompress(const void *src, size_t n, void *dst, size_t cap)
+{
+	const unsigned char *ip = src, *end = ip + n;
+	unsigned char *op = dst, *oend = op + cap;
+
+	while (ip < end) {
+		unsigned char token = *ip++;
+		size_t lit = token >> 4, mlen = token & 15, off;
+
+		if (lit == 15 && get_len(&ip, end, &lit) == -1)
+			return -1;
+
+		if (lit > (size_t)(end - ip) || lit > (size_t)(oend - op))
+			return -1;
+
+		memcpy(op, ip, lit);
+		ip += lit;
+		op += lit;
+
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+
+		if (mlen == 15 && get_len(&ip, end, &mlen) == -1)
+			return -1;
+		mlen += MINMATCH;
+
+		if (!off || off > (size_t)(op - (unsigned char *)dst) || mlen > (size_t)(oend - op))
+			return -1;
+
+		// Matches may overlap what they produce, so memcpy is only safe
+		// when they don't.
+		if (off >= mlen) {
+			memcpy(op, op - off, mlen);
+			op += mlen;
+		} else {
+			for (; mlen; --mlen, ++op)
+				*op = *(op - off);
+		}
+	}
+
+	return op - (unsigned char *)dst;
+}
@@ -0,0 +1,10 @@
+#ifndef LZ_H_INC
+#define LZ_H_INC
+#include <stddef.h>
+
+/* The worst case size of n bytes after compression. */
+#define LZ_BOUND(n) ((n) + (n)/255 + 16)
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap);
+long lz_decompress(const void *src, size_t n, void *dst, size_t cap);
+#endif
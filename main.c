@@ -1,38 +1,126 @@
 #define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE // For struct ucred
 
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <time.h>
 
+#include "capture.h"
 #include "client.h"
+#include "clk.h"
 #include "ev.h"
+#include "history.h"
+#include "intern.h"
 #include "irc.h"
 #include "log.h"
-#include "main.h"
+#include "mem.h"
+#include "metrics.h"
+#include "network.h"
+#include "probe.h"
+#include "ring.h"
 #include "server.h"
-
-int ircfd = -1;
-int acceptfd = -1;
-
-struct mca_ev *ev;
+#include "snapshot.h"
+#include "split.h"
+#include "state.h"
+#include "stats.h"
+#include "trace.h"
+#include "upgrade.h"
+#include "worker.h"
+
+// How many -A there may be.
+#define LISTEN_MAX 8
+
+// How many loops a TCP address may be listened on from, with a socket each.
+#define LISTEN_SHARDS 16
+#define LISTEN_FDS (LISTEN_MAX * LISTEN_SHARDS)
+
+/* A socket clients are accepted on, by the loop it is in. Peers on a unix
+ * socket are known by their uid. */
+static struct listener {
+	int fd;
+	int local;
+	struct loop *loop;
+} listeners[LISTEN_FDS];
+static int nlisteners;
+static int backlog = SOMAXCONN;
 
 static char *username = NULL;
 static char *nickname = NULL;
 
-static int running = 1;
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t dumptrace = 0;
+static volatile sig_atomic_t dumpmem = 0;
+static volatile sig_atomic_t upgrade = 0;
+
+static char **args; // To start the next process with, on SIGHUP
+static char *snapfile;
+static long long nextsnap; // When a snapshot may next be written, in s
+static int capturing;
+
+static int up; // Networks still connected
+
+// Lines a client, and the server, may have handled each time round the loop
+// before everyone else gets a turn.
+static int clientbudget = 16, serverbudget = 64;
+
+static __thread uint64_t tpoll, tloop; // Trace spans of the current iteration
+
+/* listenunix listens on the unix socket at path, or in the abstract
+ * namespace if it starts with '@', and exits if it cannot. */
+static int
+listenunix(const char *path)
+{
+	struct sockaddr_un sun = {0};
+	socklen_t len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+	int sockfd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errorf("%s: name too long", path);
+		exit(EXIT_FAILURE);
+	}
+
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+
+	// Abstract names go away with the last socket, and may not be
+	// terminated; paths are left behind by whoever had them before.
+	if (*path == '@')
+		sun.sun_path[0] = 0;
+	else
+		unlink(path);
+
+	if ((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+	    bind(sockfd, (struct sockaddr *)&sun, *path == '@' ? len : sizeof(sun)) == -1 ||
+	    listen(sockfd, backlog) == -1) {
+		errorf("Couldn't listen on %s: %s", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	fcntl(sockfd, F_SETFL, O_NONBLOCK); // Set non-blocking
+	return sockfd;
+}
 
-/* listenfd attempts to listen on addr:port and exits if it cannot. */
+/* listenfd attempts to listen on addr:port, or the unix socket addr if it
+ * is a path or starts with '@', and exits if it cannot. With shared, other
+ * sockets may listen on addr:port too, and the kernel spreads connections
+ * over them. */
 static int
-listenfd(char *addr, char *port)
+listenfd(char *addr, char *port, int shared)
 {
 	// Kindly pilfered from Beej's networking guide
 
@@ -41,6 +129,9 @@ listenfd(char *addr, char *port)
 	int yes = 1;
 	int rv;
 
+	if (*addr == '/' || *addr == '@')
+		return listenunix(addr);
+
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
@@ -56,7 +147,8 @@ listenfd(char *addr, char *port)
 			continue;
 		}
 
-		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1 ||
+		    (shared && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)) {
 			errorf("setsockopt: %s", strerror(errno));
 			exit(EXIT_FAILURE);
 		}
@@ -77,7 +169,7 @@ listenfd(char *addr, char *port)
 		exit(EXIT_FAILURE);
 	}
 
-	if (listen(sockfd, 10) == -1) {
+	if (listen(sockfd, backlog) == -1) {
 		errorf("listen: %s", strerror(errno));
 		exit(EXIT_FAILURE);
 	}
@@ -86,7 +178,31 @@ listenfd(char *addr, char *port)
 	return sockfd;
 }
 
-/* connectfd connects to addr:port over TCP. */
+/* listenaddr listens on addr:port from every loop, or from loop 0 alone if
+ * addr is a unix socket or there is only the one loop. */
+static void
+listenaddr(char *addr, char *port)
+{
+	int shards = nloops < LISTEN_SHARDS ? nloops : LISTEN_SHARDS;
+
+	if (*addr == '/' || *addr == '@')
+		shards = 1;
+
+	// Anyone running as us could share the port too, so make sure nobody
+	// already is.
+	if (shards > 1)
+		close(listenfd(addr, port, 0));
+
+	for (int i = 0; i < shards; ++i) {
+		listeners[nlisteners].fd = listenfd(addr, port, shards > 1);
+		listeners[nlisteners++].loop = &loops[i];
+	}
+}
+
+/* connectfd connects to addr:port over TCP.
+ *
+ * On error, -1 is returned.
+ */
 static int
 connectfd(char *addr, char *port)
 {
@@ -102,8 +218,8 @@ connectfd(char *addr, char *port)
 	hints.ai_socktype = SOCK_STREAM;
 
 	if ((rv = getaddrinfo(addr, port, &hints, &servinfo)) != 0) {
-		errorf("getaddrinfo: %s", gai_strerror(rv));
-		exit(EXIT_FAILURE);
+		errorf("getaddrinfo: %s: %s", addr, gai_strerror(rv));
+		return -1;
 	}
 
 	// loop through all the results and connect to the first we can
@@ -130,123 +246,626 @@ connectfd(char *addr, char *port)
 	return sockfd;
 }
 
-static void
-accept_conn(void)
+/* listener_find returns the listener on fd, or NULL if it is not one. */
+static struct listener *
+listener_find(int fd)
 {
-	int fd = accept(acceptfd, NULL, NULL);
-	if (fd == -1) return;
+	for (int i = 0; i < nlisteners; ++i)
+		if (listeners[i].fd == fd)
+			return &listeners[i];
+	return NULL;
+}
 
-	fcntl(fd, F_SETFL, O_NONBLOCK); // Set non-blocking
+/* admit lets the client on fd in, which was accepted on ls. */
+static void
+admit(struct listener *ls, int fd)
+{
+	static const char denied[] = "ERROR :Not your bouncer\r\n";
+	struct ucred cred = {0};
+	socklen_t credlen = sizeof(cred);
+	long uid = -1;
+
+	// Local peers are who the kernel says they are.
+	if (ls->local) {
+		if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1) {
+			warnf("fd %d: no peer credentials: %s", fd, strerror(errno));
+			close(fd);
+			return;
+		}
+		uid = cred.uid;
+	}
 
-	if (clientptr + 1 >= clientsz) {
-		clientsz *= 2;
-		clients = realloc(clients, sizeof(struct client)*clientsz);
+	// Without users, the bouncer is its owner's, and root's.
+	if (!users && uid != -1 && uid != geteuid() && uid != 0) {
+		infof("fd %d: turned away uid %ld", fd, uid);
+		write(fd, denied, sizeof(denied) - 1);
+		close(fd);
+		return;
 	}
 
-	memset(&clients[clientptr], 0, sizeof(struct client));
-	clients[clientptr].fd = fd;
+	// With only one network there is nothing to pick, unless there is a
+	// password to check.
+	if (nnetworks == 1 && !users)
+		network_accept(&networks[0], fd, NULL, 0);
+	else
+		lobby_add(fd, uid);
+}
+
+/* accept_conn takes every client waiting on ls, so that a crowd of them
+ * reconnecting at once costs one wakeup rather than one each.
+ *
+ * Out of fds, clients are turned away rather than left waiting, as they
+ * would otherwise keep ls readable and the loop spinning. Each loop keeps a
+ * spare fd to make room for that.
+ */
+static void
+accept_conn(struct listener *ls)
+{
+	static const char busy[] = "ERROR :Too many connections, try again later\r\n";
+	static __thread int spare = -1;
+	static __thread long long warned;
+	int fd, e;
+
+	if (spare == -1)
+		spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	for (;;) {
+		fd = accept4(ls->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd == -1 && errno == EINTR)
+			continue;
+
+		if (fd == -1 && (errno == EMFILE || errno == ENFILE) && spare != -1) {
+			e = errno;
+			close(spare);
+			fd = accept4(ls->fd, NULL, NULL, SOCK_CLOEXEC);
+			if (fd != -1) {
+				write(fd, busy, sizeof(busy) - 1);
+				close(fd);
+			}
+			spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+			if (fd != -1 && clk_mono_ms() - warned >= 1000) {
+				warned = clk_mono_ms();
+				warnf("accept: %s, turning clients away", strerror(e));
+			}
+			if (fd == -1)
+				return;
+			continue;
+		}
 
-	mca_ev_append(ev, fd, MCA_EV_READ);
+		if (fd == -1 && (errno == EMFILE || errno == ENFILE))
+			warnf("accept: %s", strerror(errno));
+		if (fd == -1)
+			return;
 
-	debugf("New connection on fd %d", fd);
+		admit(ls, fd);
+	}
+}
 
-	client_sendf(&clients[clientptr], "PING :%d", time(NULL));
+/* stop makes every event loop finish up, so that everything buffered gets
+ * written out. */
+static void
+stop(int)
+{
+	__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
 
-	++clientptr;
+	for (int i = 0; i < nloops; ++i)
+		loop_wake(&loops[i]);
 }
 
 static int
-evremove(struct mca_ev *, int fd, void *)
+evremove(struct mca_ev *, int fd, void *userdata)
 {
-	if (fd == ircfd || fd == acceptfd) {
-		if (fd == ircfd)
-			errorf("Server connection closed");
-		else
-			errorf("Listening socket closed");
-		running = 0;
+	struct loop *l = userdata;
+	struct owner o = loop_owner(l, fd);
 
+	if (listener_find(fd)) {
+		errorf("Listening socket closed");
+		stop(0);
 		return 0;
 	}
 
-	debugf("Connection on fd %d died", fd);
-			
-	// Find index in clients
-	int cli;
-	for (cli = 0; cli < clientptr; ++cli) {
-		if (clients[cli].fd == fd)
-			break;
+	if (fd == metricsfd) {
+		warnf("Metrics socket closed");
+		metricsfd = -1;
+		return 0;
+	} else if (l->id == 0 && metrics_owns(fd)) {
+		metrics_remove(fd);
+		close(fd);
+		return 0;
+	}
+
+	if (fd == ringfd) {
+		warnf("Ring socket closed");
+		ringfd = -1;
+		return 0;
+	} else if (l->id == 0 && ring_owns(fd)) {
+		ring_remove(fd);
+		close(fd);
+		return 0;
+	}
+
+	loop_own(l, fd, NULL, OWN_NONE);
+
+	switch (o.kind) {
+	case OWN_WAKE:
+		errorf("Wakeup eventfd of %s closed", l->name);
+		stop(0);
+		return 0;
+	case OWN_LOBBY:
+		lobby_remove(fd);
+		close(fd);
+		return 0;
+	case OWN_SERVER:
+		errorf("%s: server connection closed", o.net->name);
+		o.net->ircfd = -1;
+		close(fd);
+
+		// With nothing left to bounce, stop; the clients of the
+		// last network get what is queued for them on the way out.
+		if (__atomic_sub_fetch(&up, 1, __ATOMIC_ACQ_REL) == 0)
+			stop(0);
+		else
+			network_down(o.net);
+		return 0;
+	case OWN_CLIENT:
+		break;
+	default:
+		return 0;
 	}
 
-	// Free nick
-	if (clients[cli].nick)
-		free(clients[cli].nick);
+	debugf("Connection on fd %d died", fd);
+	capture_event(fd, CAPTURE_CLOSE);
+	PROBE1(remove, fd);
+
+	if (!network_remove_client(o.net, fd))
+		close(fd);
+	return 0;
+}
+
+static void
+evwake(struct mca_ev *, void *userdata)
+{
+	struct loop *l = userdata;
+
+	clk_refresh();
+	stats_wake(&l->stats);
 
-	// We must move all clients ahead of it back one space
-	memmove(&clients[cli], &clients[cli+1], sizeof(struct client)*(clientptr-cli));
-	clientptr--;
+	// Hold still while being read from other threads; see metrics.c.
+	loop_lock(l);
+
+	for (int i = 0; i < nnetworks; ++i)
+		if (networks[i].loop == l)
+			stats_tick(&networks[i].stats);
+
+	if (l->splits)
+		split_tick(l);
+
+	TRACE_END("poll", 0, tpoll);
+	tloop = TRACE_BEGIN();
 }
 
 static int
-evread(struct mca_ev *, int fd, void *)
+evread(struct mca_ev *, int fd, void *userdata)
 {
-	if (fd == acceptfd) {
-		accept_conn();
-		return 0;
-	} else if (fd == ircfd)
-		return server_readable();
+	struct owner o = loop_owner(userdata, fd);
+	struct listener *ls;
+	uint64_t t = TRACE_BEGIN();
+	int r = 0;
+
+	net = o.net;
+
+	if ((ls = listener_find(fd)))
+		accept_conn(ls);
+	else if (fd == metricsfd)
+		metrics_accept();
+	else if (loop->id == 0 && metrics_owns(fd))
+		r = metrics_readable(fd);
+	else if (fd == ringfd)
+		ring_accept();
+	else if (loop->id == 0 && ring_owns(fd))
+		r = ring_readable(fd);
+	else if (o.kind == OWN_WAKE)
+		loop_inbox(userdata);
+	else if (o.kind == OWN_LOBBY)
+		r = lobby_readable(fd);
+	else if (o.kind == OWN_SERVER)
+		r = server_readable();
+	else if (o.kind == OWN_CLIENT)
+		r = client_readable(fd);
+
+	TRACE_END("read", fd, t);
+	return r;
+}
 
-	return client_readable(fd);
+/* evbudget says how many lines fd may have handled before the loop moves on;
+ * the server gets more, as everyone is waiting on it. */
+static int
+evbudget(struct mca_ev *, int fd, void *userdata)
+{
+	return loop_owner(userdata, fd).kind == OWN_SERVER ? serverbudget : clientbudget;
 }
 
 static int
-evwrite(struct mca_ev *, int fd, void *)
+evwrite(struct mca_ev *, int fd, void *userdata)
 {
-	if (fd == ircfd) {
+	struct owner o = loop_owner(userdata, fd);
+	uint64_t t = TRACE_BEGIN();
+
+	net = o.net;
+
+	if (loop->id == 0 && metrics_owns(fd))
+		metrics_writable(fd);
+	else if (o.kind == OWN_SERVER)
 		server_writable();
-		return 0;
-	}
+	else if (o.kind == OWN_CLIENT)
+		client_writable(fd);
 
-	client_writable(fd);
+	TRACE_END("write", fd, t);
 	return 0;
 }
 
+/* dump asks the event loop to write the trace out, report memory use, or
+ * hand over to a new process. */
+static void
+dump(int sig)
+{
+	if (sig == SIGUSR1)
+		dumpmem = 1;
+	else if (sig == SIGHUP)
+		upgrade = 1;
+	else
+		dumptrace = 1;
+}
+
+/* handover starts the binary icbm was started from again, and exits once it
+ * has taken over every connection. If it cannot, icbm carries on. */
+static void
+handover(struct loop *l)
+{
+	int fds[LISTEN_FDS];
+
+	if (capturing) {
+		warnf("Upgrade: not while capturing");
+		return;
+	}
+
+	infof("Upgrade: starting %s", args[0]);
+
+	// Nothing may change while it is written down.
+	loop_lock(l);
+	for (int i = 0; i < nloops; ++i)
+		if (&loops[i] != l)
+			pthread_mutex_lock(&loops[i].mu);
+	worker_drain();
+	worker_lock_all();
+
+	for (int i = 0; i < nlisteners; ++i)
+		fds[i] = listeners[i].fd;
+
+	if (upgrade_start(args, fds, nlisteners, metricsfd, ringfd) == 0) {
+		// Consumers have to ask the new process for its rings.
+		for (int i = 0; i < nnetworks; ++i)
+			ring_close(networks[i].ring);
+
+		// Whatever is left in the log goes out first.
+		log_flush();
+		_exit(EXIT_SUCCESS);
+	}
+
+	worker_unlock_all();
+	for (int i = 0; i < nloops; ++i)
+		if (&loops[i] != l)
+			pthread_mutex_unlock(&loops[i].mu);
+}
+
+/* snapshot writes what the networks have learnt out to snapfile, if it has
+ * changed and it has been a while. */
+static void
+snapshot(struct loop *l)
+{
+	struct state s = {0};
+	int err;
+
+	if (!snapshot_dirty() || clk_mono.tv_sec < nextsnap)
+		return;
+
+	nextsnap = clk_mono.tv_sec + SNAPSHOT_INTERVAL;
+
+	loop_lock(l);
+	for (int i = 0; i < nloops; ++i)
+		if (&loops[i] != l)
+			pthread_mutex_lock(&loops[i].mu);
+
+	err = snapshot_take(&s);
+
+	for (int i = 0; i < nloops; ++i)
+		if (&loops[i] != l)
+			pthread_mutex_unlock(&loops[i].mu);
+
+	// Only the copy is written out, with the other loops let go.
+	if (err == -1 || snapshot_save(snapfile, &s) == -1)
+		warnf("Failed to write snapshot to %s: %s", snapfile, strerror(errno));
+}
+
+/* report logs what memory is in use, for SIGUSR1. */
+static void
+report(void)
+{
+	mem_report();
+}
+
 static void
-evloop(void)
+evloop(struct loop *l)
 {
-	int i;
+	int i, t;
+
+	while (__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		// Loop 0 wakes up now and then to write the snapshot, and any loop
+		// to close a netsplit's batch once it has gone quiet.
+		t = l->id == 0 && snapfile ? SNAPSHOT_INTERVAL * 1000 : -1;
+		if ((i = split_timeout(l)) != -1 && (t == -1 || i < t))
+			t = i;
+
+		// Anyone may look at our networks while we wait.
+		loop_unlock(l);
 
-	while (running) {
-		i = mca_ev_poll(ev, -1);
-		if (i == -1) {
+		tpoll = TRACE_BEGIN();
+		i = mca_ev_poll(ev, t);
+		if (i == -1 && errno != EINTR) {
 			errorf("poll: %s", strerror(errno));
 			break;
 		}
+
+		stats_loop_done(&l->stats);
+		worker_kick();
+		TRACE_END("loop", ev->len, tloop);
+		tloop = 0;
+
+		// Signals are only ever delivered to loop 0.
+		if (l->id != 0)
+			continue;
+
+		if (dumptrace) {
+			dumptrace = 0;
+			if (trace_dump(trace_path) == -1)
+				warnf("Failed to write trace to %s: %s", trace_path, strerror(errno));
+			else
+				infof("Trace written to %s", trace_path);
+		}
+
+		if (dumpmem) {
+			dumpmem = 0;
+			report();
+		}
+
+		if (snapfile)
+			snapshot(l);
+
+		if (upgrade) {
+			upgrade = 0;
+			handover(l);
+		}
 	}
 
+	worker_kick();
 	mca_ev_flush(ev, -1);
+	loop_unlock(l);
+}
+
+/* loop_main runs l, on the calling thread. */
+static void *
+loop_main(void *arg)
+{
+	struct loop *l = arg;
+
+	loop = l;
+	ev = l->ev;
+	trace_thread(l->name);
+
+	loop_lock(l);
+
+	for (int i = 0; i < nnetworks; ++i) {
+		if (networks[i].loop != l)
+			continue;
+
+		net = &networks[i];
+
+		// Registered by the process before, which had the counters.
+		if (net->resumed) {
+			net->stats.lastsec = clk_mono.tv_sec;
+			net->stats.lastforwarded = net->stats.forwarded;
+			continue;
+		}
+
+		stats_init(&net->stats);
+
+		server_sendf("CAP LS 302");
+		server_sendf("NICK :%s", net->nick);
+		server_sendf("USER %s 0 * :%s", net->nick, "icbm");
+	}
+
+	worker_kick();
+
+	evloop(l);
+	return NULL;
+}
+
+/* quota sets one of u's limits from a "key=value" field. */
+static int
+quota(struct user *u, const char *field)
+{
+	const char *eq = strchr(field, '=');
+	char *end;
+	long v;
+
+	if (!eq)
+		return -1;
+
+	v = strtol(eq + 1, &end, 10);
+	if (*end || v < 0)
+		return -1;
+
+	if (strncmp(field, "clients=", eq - field + 1) == 0 && v <= INT_MAX)
+		u->maxclients = v;
+	else if (strncmp(field, "sendq=", eq - field + 1) == 0 && v >= 4096 && v <= INT_MAX)
+		u->sendq = v;
+	else if (strncmp(field, "uid=", eq - field + 1) == 0 && v <= UINT32_MAX - 1)
+		u->uid = v;
+	else
+		return -1;
+	return 0;
+}
+
+/* readconf adds the networks listed in path, one per line:
+ *
+ *	name address [port] [nick]
+ *
+ * To host several users, each of them starts with a line of
+ *
+ *	user name password [clients=n] [sendq=bytes] [uid=n]
+ *
+ * and the networks after it are theirs, named "user/name". Blank lines and
+ * lines starting with '#' are skipped. nick defaults to the user's name, or
+ * nickname.
+ *
+ * On error, -1 is returned.
+ */
+static int
+readconf(const char *path, char *nickname)
+{
+	char line[1024], name[256], *f[6], *save;
+	int n, lineno = 0;
+	struct user *u = NULL;
+	struct stat st;
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r")))
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+
+		n = 0;
+		for (char *tok = strtok_r(line, " \t\r\n", &save); tok && n < 6; tok = strtok_r(NULL, " \t\r\n", &save))
+			f[n++] = tok;
+
+		if (!n || *f[0] == '#')
+			continue;
+
+		if (strcmp(f[0], "user") == 0) {
+			if (n < 3 || strchr(f[1], '/')) {
+				errorf("%s:%d: expected \"user name password [clients=n] [sendq=bytes]\"", path, lineno);
+				goto fail;
+			}
+
+			if (!(u = user_add(mem_strdup(MEM_NETWORKS, f[1]), mem_strdup(MEM_NETWORKS, f[2])))) {
+				errorf("%s:%d: can't add user %s: %s", path, lineno, f[1], strerror(errno));
+				goto fail;
+			}
+
+			for (int i = 3; i < n; ++i) {
+				if (quota(u, f[i]) == -1) {
+					errorf("%s:%d: bad quota %s", path, lineno, f[i]);
+					goto fail;
+				}
+			}
+			continue;
+		}
+
+		if (n < 2 || n > 4 || strchr(f[0], '/')) {
+			errorf("%s:%d: expected \"name address [port] [nick]\"", path, lineno);
+			goto fail;
+		}
+
+		if (u)
+			snprintf(name, sizeof(name), "%s/%s", u->name, f[0]);
+		else
+			snprintf(name, sizeof(name), "%s", f[0]);
+
+		if (network_add(u, mem_strdup(MEM_NETWORKS, name), mem_strdup(MEM_NETWORKS, f[1]),
+		    n > 2 ? mem_strdup(MEM_NETWORKS, f[2]) : "6667",
+		    n > 3 ? mem_strdup(MEM_NETWORKS, f[3]) : u ? u->name : nickname) == -1) {
+			errorf("%s:%d: can't add network %s: %s", path, lineno, name, strerror(errno));
+			goto fail;
+		}
+	}
+
+	// Networks listed before the first user would be open to anyone.
+	for (int i = 0; users && i < nnetworks; ++i) {
+		if (!networks[i].user) {
+			errorf("%s: network %s does not belong to a user", path, networks[i].name);
+			goto fail;
+		}
+	}
+
+	if (users && fstat(fileno(fp), &st) == 0 && (st.st_mode & 077))
+		warnf("%s holds passwords, but others may read it", path);
+
+	fclose(fp);
+	return 0;
+
+fail:
+	fclose(fp);
+	errno = EINVAL;
+	return -1;
 }
 
 int
 main(int argc, char *argv[])
 {
-	int opt;
+	int opt, upgradefd, oldmetrics = -1, oldring = -1;
+	int oldlisten[LISTEN_FDS], noldlisten = 0;
 
 	char *address = "127.0.0.1";
 	char *port = "6667";
-	char *laddress = "127.0.0.1";
+	char *laddrs[LISTEN_MAX] = { "127.0.0.1" };
+	int nladdrs = 0;
 	char *lport = "16667";
-
-	while ((opt = getopt(argc, argv, "u:n:a:p:A:P:")) != -1) {
+	char *histdir = NULL;
+	char *capfile = NULL;
+	char *metricsaddr = NULL;
+	char *ringaddr = NULL;
+	char *conf = NULL;
+	int histcompress = 0;
+	long jobs = 0, iojobs = 0;
+	int threads;
+
+	while ((opt = getopt(argc, argv, "u:n:a:p:A:P:b:H:zc:M:T:f:j:w:S:R:r:U:N:")) != -1) {
 		switch (opt) {
 		case 'u': username = optarg; break;
 		case 'n': nickname = optarg; break;
 		case 'a': address = optarg; break;
 		case 'p': port = optarg; break;
-		case 'A': laddress = optarg; break;
+		case 'A':
+			if (nladdrs == LISTEN_MAX) {
+				errorf("No more than %d listeners", LISTEN_MAX);
+				exit(EXIT_FAILURE);
+			}
+			laddrs[nladdrs++] = optarg;
+			break;
 		case 'P': lport = optarg; break;
+		case 'b': backlog = strtol(optarg, NULL, 10); break;
+		case 'H': histdir = optarg; break;
+		case 'z': histcompress = 1; break;
+		case 'c': capfile = optarg; break;
+		case 'M': metricsaddr = optarg; break;
+		case 'T': trace_path = optarg; trace_on = 1; break;
+		case 'f': conf = optarg; break;
+		case 'j': jobs = strtol(optarg, NULL, 10); break;
+		case 'w': iojobs = strtol(optarg, NULL, 10); break;
+		case 'S': snapfile = optarg; break;
+		case 'R': ringaddr = optarg; break;
+		case 'r': clientbudget = strtol(optarg, NULL, 10); break;
+		case 'U': serverbudget = strtol(optarg, NULL, 10); break;
+		case 'N': split_window = strtol(optarg, NULL, 10); break;
 		}
 	}
 
+	// Taking over from another icbm, which left us nothing else open.
+	args = argv;
+	upgradefd = upgrade_fd();
+
 	if (!username) {
 		if (!(username = getenv("LOGNAME"))) {
 			errorf("Unable to get username. LOGNAME was not set.");
@@ -257,65 +876,271 @@ main(int argc, char *argv[])
 	if (!nickname)
 		nickname = username;
 
-	// Setup event loop
-	if (mca_ev_new(&ev) == -1) {
-		errorf("Failed to setup event loop.");
+	// Without a list of networks, there is just the one.
+	if (conf && readconf(conf, nickname) == -1) {
+		errorf("Failed to read networks from %s: %s", conf, strerror(errno));
+		exit(EXIT_FAILURE);
+	} else if (!conf && network_add(NULL, "default", address, port, nickname) == -1) {
+		errorf("Failed to allocate networks");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!nnetworks) {
+		errorf("No networks in %s", conf);
+		exit(EXIT_FAILURE);
+	}
+
+	// A capture holds one server's side of things.
+	if (capfile && nnetworks > 1) {
+		errorf("Capturing only works with a single network");
+		exit(EXIT_FAILURE);
+	}
+
+	// One loop per core, but no more than there are networks to run.
+	if (jobs <= 0)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	nloops = jobs < 1 ? 1 : jobs > nnetworks ? nnetworks : jobs;
+
+	// Each loop and I/O worker logs and traces, and so do the writer and
+	// whatever compresses the message log.
+	threads = nloops + (iojobs > WORKERS_MAX ? WORKERS_MAX : iojobs > 0 ? iojobs : 0) + 1 +
+		(histdir && histcompress);
+	if (trace_init(threads) == -1)
+		warnf("Failed to set up tracing, it will not record anything.");
+
+	// Everything from here on is logged from the writer thread.
+	if (log_init(threads) == -1)
+		warnf("Failed to start the log writer, logging synchronously.");
+
+	// Exit cleanly when asked to
+	struct sigaction sa = {0};
+	sa.sa_handler = stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// Write the trace out, or report memory use, when asked to
+	sa.sa_handler = dump;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	sigaction(SIGHUP, &sa, NULL);
+
+	// Setup event loops
+	if (!(loops = mem_calloc(MEM_NETWORKS, nloops, sizeof(*loops)))) {
+		errorf("Failed to allocate event loops.");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; i < nloops; ++i) {
+		if (loop_init(&loops[i], i) == -1) {
+			errorf("Failed to setup event loop.");
+			exit(EXIT_FAILURE);
+		}
+
+		loops[i].ev->on_wake = evwake;
+		loops[i].ev->on_readable = evread;
+		loops[i].ev->on_writable = evwrite;
+		loops[i].ev->on_remove = evremove;
+		loops[i].ev->on_budget = evbudget;
+	}
+
+	// Metrics and rings are served from loop 0, which is this thread.
+	loop = &loops[0];
+	ev = loop->ev;
+
+	// Spread networks over the loops; from here on they stay put.
+	for (int i = 0; i < nnetworks; ++i)
+		networks[i].loop = &loops[i % nloops];
+	network_share();
+
+	// Open the message logs; each network has a directory of its own when
+	// there are several, under one for its user if it has one.
+	if (histdir && (nnetworks > 1 || users) && mkdir(histdir, 0700) == -1 && errno != EEXIST) {
+		errorf("Failed to make %s: %s", histdir, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (int i = 0; histdir && i < nnetworks; ++i) {
+		struct network *n = &networks[i];
+		char dir[PATH_MAX];
+
+		if (n->user) {
+			snprintf(dir, sizeof(dir), "%s/%s", histdir, n->user->name);
+			if (mkdir(dir, 0700) == -1 && errno != EEXIST) {
+				errorf("Failed to make %s: %s", dir, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		if (nnetworks > 1 || users)
+			snprintf(dir, sizeof(dir), "%s/%s", histdir, n->name);
+		else
+			snprintf(dir, sizeof(dir), "%s", histdir);
+
+		if (history_open(&n->history, dir, histcompress) == -1) {
+			errorf("Failed to open message log %s: %s", dir, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		n->history.names = n->names;
+	}
+
+	// Record traffic, if asked to
+	if (capfile && capture_open(capfile) == -1) {
+		errorf("Failed to open capture %s: %s", capfile, strerror(errno));
 		exit(EXIT_FAILURE);
 	}
-	ev->on_readable = evread;
-	ev->on_writable = evwrite;
-	ev->on_remove = evremove;
+	capturing = capfile != NULL;
+
+	// Clients are given to I/O workers from the first one accepted, or
+	// taken over. Their threads leave signals to loop 0.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
 
-	// Initialize client list
-	clients = realloc(NULL, sizeof(struct client)*clientsz);
-	if (!clients) {
-		errorf("Failed to allocate clients", sizeof(struct client)*clientsz);
+	if (iojobs > 0 && worker_start(iojobs) == -1) {
+		errorf("Failed to start I/O workers.");
 		exit(EXIT_FAILURE);
 	}
 
-	// Connect
-	if ((ircfd = connectfd(address, port)) == -1) {
-		errorf("Failed to connect to the IRC server.");
-		mca_ev_free(ev);
-		free(clients);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	// Pick up what the networks knew before the restart; an upgrade hands
+	// over all of it, and more.
+	if (snapfile && upgradefd == -1 && snapshot_load(snapfile) == -1)
+		warnf("Failed to load snapshot %s: %s", snapfile, strerror(errno));
+
+	// Carry on where the process before left off; if we cannot, it will.
+	if (upgradefd != -1 && upgrade_restore(upgradefd, oldlisten, &noldlisten, LISTEN_FDS, &oldmetrics, &oldring) == -1)
 		exit(EXIT_FAILURE);
+
+	// Connect to whatever was not taken over. A network that cannot be
+	// reached stays down, and its clients are turned away.
+	for (int i = 0; i < nnetworks; ++i) {
+		struct network *n = &networks[i];
+
+		if (n->resumed) {
+			up++;
+			continue;
+		}
+
+		if ((n->ircfd = connectfd((char *)n->address, (char *)n->port)) == -1) {
+			errorf("Failed to connect to %s.", n->name);
+			continue;
+		}
+		n->stats.connects++;
+		up++;
+		PROBE1(connect, n->ircfd);
+
+		loop_own(n->loop, n->ircfd, n, OWN_SERVER);
+		mca_ev_append(n->loop->ev, n->ircfd, MCA_EV_READ);
+
+		debugf("%s: irc fd %d on %s", n->name, n->ircfd, n->loop->name);
 	}
 
-	if ((acceptfd = listenfd(laddress, lport)) == -1) {
-		errorf("Failed to listen.");
-		mca_ev_free(ev);
-		close(ircfd);
-		free(clients);
+	if (!up) {
+		errorf("No network could be connected to.");
 		exit(EXIT_FAILURE);
 	}
 
-	debugf("listen fd %d, irc fd %d", acceptfd, ircfd);
+	// Keep listening where the process before was, or start to. Its
+	// sockets are dealt out over however many loops there are now.
+	for (int i = 0; i < noldlisten; ++i) {
+		listeners[nlisteners].fd = oldlisten[i];
+		listeners[nlisteners++].loop = &loops[i % nloops];
+	}
+
+	for (int i = 0; !noldlisten && i < (nladdrs ? nladdrs : 1); ++i)
+		listenaddr(laddrs[i], lport);
+
+	for (int i = 0; i < nlisteners; ++i) {
+		struct sockaddr_storage sa;
+		socklen_t salen = sizeof(sa);
+
+		if (getsockname(listeners[i].fd, (struct sockaddr *)&sa, &salen) == 0)
+			listeners[i].local = sa.ss_family == AF_UNIX;
+
+		debugf("listen fd %d on %s%s", listeners[i].fd, listeners[i].loop->name,
+			listeners[i].local ? ", local" : "");
+
+		// Further setup event loop.
+		mca_ev_append(listeners[i].loop->ev, listeners[i].fd, MCA_EV_READ);
+	}
+
+	// Serve metrics, if asked to
+	if (oldmetrics != -1 && !metricsaddr) {
+		close(oldmetrics);
+	} else if (oldmetrics != -1) {
+		metrics_adopt(oldmetrics);
+		mca_ev_append(ev, metricsfd, MCA_EV_READ);
+	} else if (metricsaddr) {
+		if (metrics_listen(metricsaddr) == -1)
+			warnf("Failed to listen for metrics on %s: %s", metricsaddr, strerror(errno));
+		else
+			mca_ev_append(ev, metricsfd, MCA_EV_READ);
+	}
+
+	// Hand out rings to local consumers, if asked to
+	if (oldring != -1 && !ringaddr) {
+		close(oldring);
+	} else if (oldring != -1) {
+		ring_adopt(oldring);
+		mca_ev_append(ev, ringfd, MCA_EV_READ);
+	} else if (ringaddr) {
+		if (ring_listen(ringaddr) == -1)
+			warnf("Failed to listen for ring consumers on %s: %s", ringaddr, strerror(errno));
+		else
+			mca_ev_append(ev, ringfd, MCA_EV_READ);
+	}
+
+	// Signals are for loop 0 alone, which is this thread.
+	pthread_sigmask(SIG_BLOCK, &all, &old);
 
-	// Further setup event loop.
-	mca_ev_append(ev, ircfd, MCA_EV_READ);
-	mca_ev_append(ev, acceptfd, MCA_EV_READ);
+	for (int i = 1; i < nloops; ++i) {
+		if (pthread_create(&loops[i].thread, NULL, loop_main, &loops[i]) != 0) {
+			errorf("Failed to start %s.", loops[i].name);
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	server_sendf("NICK :%s", nickname);
-	server_sendf("USER %s 0 * :%s", nickname, "icbm");
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
 
 	// Jump into the event loop.
-	evloop();
+	loop_main(&loops[0]);
 
-	// Cleanup.
-	close(acceptfd);
-	close(ircfd);
+	for (int i = 1; i < nloops; ++i)
+		pthread_join(loops[i].thread, NULL);
+
+	// Only once nothing more can be queued for them.
+	worker_stop();
 
-	mca_ev_free(ev);
+	if (snapfile && snapshot_write(snapfile) == -1)
+		warnf("Failed to write snapshot to %s: %s", snapfile, strerror(errno));
 
-	size_t cli;
-	for (cli = 0; cli < clientptr; ++cli) {
-		if (clients[cli].nick)
-			free(clients[cli].nick);
-		close(clients[cli].fd);
+	// Cleanup.
+	for (int i = 0; i < nlisteners; ++i)
+		close(listeners[i].fd);
+	if (metricsfd != -1)
+		close(metricsfd);
+	if (ringfd != -1)
+		close(ringfd);
+
+	for (int i = 0; i < nloops; ++i)
+		lobby_free(&loops[i]);
+
+	// Backwards, as later networks may share the names of earlier ones.
+	for (int i = nnetworks - 1; i >= 0; --i)
+		network_free(&networks[i]);
+	mem_free(MEM_NETWORKS, networks);
+
+	while (users) {
+		struct user *u = users;
+
+		users = u->next;
+		mem_free(MEM_NETWORKS, u);
 	}
-	free(clients);
 
-	for (size_t i = 0; i < server_isupport.len; ++i)
-		free(server_isupport.data[i]);
-	free(server_isupport.data);
+	for (int i = 0; i < nloops; ++i)
+		loop_free(&loops[i]);
+	mem_free(MEM_NETWORKS, loops);
+
+	capture_close();
 }
@@ -1,5 +0,0 @@
-#include "ev.h"
-
-extern struct mca_ev *ev;
-
-extern int acceptfd;
@@ -0,0 +1,143 @@
+#define _DEFAULT_SOURCE
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "mem.h"
+
+struct mem_tag mem_tags[MEM_LAST];
+
+const char *mem_names[MEM_LAST] = {
+	[MEM_NETWORKS] = "networks",
+	[MEM_CLIENTS] = "clients",
+	[MEM_BUFIO] = "bufio",
+	[MEM_EV] = "ev",
+	[MEM_VEC] = "vec",
+	[MEM_ISUPPORT] = "isupport",
+	[MEM_NAMES] = "names",
+	[MEM_CAPTURE] = "capture",
+	[MEM_LOG] = "log",
+	[MEM_TRACE] = "trace",
+	[MEM_IO] = "io",
+	[MEM_HISTORY] = "history",
+};
+
+// Every event loop allocates, and so does whichever thread first logs or
+// traces, so the counters are updated atomically.
+static void
+count(int tag, size_t add, size_t sub, int allocs, int frees)
+{
+	struct mem_tag *t = &mem_tags[tag];
+	size_t live;
+
+	live = __atomic_add_fetch(&t->live, add - sub, __ATOMIC_RELAXED);
+	if (allocs)
+		__atomic_add_fetch(&t->allocs, allocs, __ATOMIC_RELAXED);
+	if (frees)
+		__atomic_add_fetch(&t->frees, frees, __ATOMIC_RELAXED);
+
+	// Racy, but only ever off by a concurrent allocation.
+	if (live > __atomic_load_n(&t->peak, __ATOMIC_RELAXED))
+		__atomic_store_n(&t->peak, live, __ATOMIC_RELAXED);
+}
+
+/* mem_malloc is malloc(3), counted under tag. */
+void *
+mem_malloc(int tag, size_t n)
+{
+	void *p;
+
+	if ((p = malloc(n)))
+		count(tag, malloc_usable_size(p), 0, 1, 0);
+	return p;
+}
+
+/* mem_calloc is calloc(3), counted under tag. */
+void *
+mem_calloc(int tag, size_t n, size_t size)
+{
+	void *p;
+
+	if ((p = calloc(n, size)))
+		count(tag, malloc_usable_size(p), 0, 1, 0);
+	return p;
+}
+
+/* mem_realloc is realloc(3), counted under tag. Growing an allocation is
+ * not counted as another one. */
+void *
+mem_realloc(int tag, void *p, size_t n)
+{
+	size_t old = p ? malloc_usable_size(p) : 0;
+	void *np;
+
+	if (!(np = realloc(p, n)))
+		return NULL;
+
+	count(tag, malloc_usable_size(np), old, !p, 0);
+	return np;
+}
+
+/* mem_strdup is strdup(3), counted under tag. */
+char *
+mem_strdup(int tag, const char *s)
+{
+	size_t n = strlen(s) + 1;
+	char *p;
+
+	if ((p = mem_malloc(tag, n)))
+		memcpy(p, s, n);
+	return p;
+}
+
+/* mem_free frees p, which must have come from mem_* with the same tag. */
+void
+mem_free(int tag, void *p)
+{
+	if (!p)
+		return;
+
+	count(tag, 0, malloc_usable_size(p), 0, 1);
+	free(p);
+}
+
+/* mem_get returns the counters of tag as they are now. */
+struct mem_tag
+mem_get(int tag)
+{
+	struct mem_tag t;
+
+	t.live = __atomic_load_n(&mem_tags[tag].live, __ATOMIC_RELAXED);
+	t.peak = __atomic_load_n(&mem_tags[tag].peak, __ATOMIC_RELAXED);
+	t.allocs = __atomic_load_n(&mem_tags[tag].allocs, __ATOMIC_RELAXED);
+	t.frees = __atomic_load_n(&mem_tags[tag].frees, __ATOMIC_RELAXED);
+	return t;
+}
+
+/* mem_live returns the bytes live under every tag. */
+size_t
+mem_live(void)
+{
+	size_t n = 0;
+
+	for (int i = 0; i < MEM_LAST; ++i)
+		n += __atomic_load_n(&mem_tags[i].live, __ATOMIC_RELAXED);
+	return n;
+}
+
+/* mem_report logs what every tag holds. */
+void
+mem_report(void)
+{
+	for (int i = 0; i < MEM_LAST; ++i) {
+		struct mem_tag t = mem_get(i);
+
+		infof("mem: %-8s %10zu bytes live, %10zu peak, %llu allocations, %llu frees",
+			mem_names[i], t.live, t.peak, (unsigned long long)t.allocs,
+			(unsigned long long)t.frees);
+	}
+
+	infof("mem: total    %10zu bytes live", mem_live());
+}
@@ -0,0 +1,43 @@
+#ifndef MEM_H_INC
+#define MEM_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+/* What memory is for. Everything allocated through mem_* is counted under
+ * one of these; memory from mem_* must be freed with mem_free and the same
+ * tag. */
+enum {
+	MEM_NETWORKS, // Networks, loops and clients waiting to pick one
+	MEM_CLIENTS, // The clients arrays
+	MEM_BUFIO, // Send buffers
+	MEM_EV, // Event loop
+	MEM_VEC, // Vector storage
+	MEM_ISUPPORT, // ISUPPORT tokens
+	MEM_NAMES, // Interned nicknames
+	MEM_CAPTURE, // Capture file buffer
+	MEM_LOG, // Log rings
+	MEM_TRACE, // Trace rings
+	MEM_IO, // I/O workers, their queues and shared lines
+	MEM_HISTORY, // Message log blocks and search indexes
+
+	MEM_LAST
+};
+
+struct mem_tag {
+	size_t live, peak; // Bytes, as malloc_usable_size(3) counts them
+	uint64_t allocs, frees;
+};
+
+extern struct mem_tag mem_tags[MEM_LAST];
+extern const char *mem_names[MEM_LAST];
+
+void *mem_malloc(int tag, size_t n);
+void *mem_calloc(int tag, size_t n, size_t size);
+void *mem_realloc(int tag, void *p, size_t n);
+char *mem_strdup(int tag, const char *s);
+void mem_free(int tag, void *p);
+
+struct mem_tag mem_get(int tag);
+size_t mem_live(void);
+void mem_report(void);
+#endif
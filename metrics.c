@@ -0,0 +1,563 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "clk.h"
+#include "intern.h"
+#include "log.h"
+#include "mem.h"
+#include "metrics.h"
+#include "network.h"
+#include "stats.h"
+#include "worker.h"
+
+#define METRICS_CONNS 4
+#define METRICS_REQSZ 1024
+#define METRICS_BUFSZ (256 << 10)
+#define METRICS_CLIENTS_MAX 100 // Past this, clients are only counted
+
+/* A scrape in progress. Everything is preallocated, so that serving one
+ * never has to allocate. */
+static struct {
+	int fd;
+	char req[METRICS_REQSZ];
+	size_t reqlen;
+	size_t outlen, outptr;
+} conns[METRICS_CONNS];
+
+static char outbufs[METRICS_CONNS][METRICS_BUFSZ];
+
+int metricsfd = -1;
+
+// Bucket bounds for histograms, in nanoseconds.
+static const uint64_t bounds[] = {
+	1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 25000000, 50000000, 100000000,
+	250000000, 500000000, 1000000000, 2500000000ULL, 5000000000ULL,
+};
+
+/* metrics_listen listens for scrapes on addr, which is either "host:port"
+ * or the path of a unix socket.
+ *
+ * On error, -1 is returned.
+ */
+int
+metrics_listen(const char *addr)
+{
+	int fd = -1, yes = 1;
+
+	for (int i = 0; i < METRICS_CONNS; ++i)
+		conns[i].fd = -1;
+
+	if (strchr(addr, '/')) {
+		struct sockaddr_un sun = {0};
+
+		if (strlen(addr) >= sizeof(sun.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr);
+		unlink(addr);
+
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			return -1;
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+			goto fail;
+	} else {
+		struct addrinfo hints = {0}, *res, *p;
+		char host[256];
+		const char *port = strrchr(addr, ':');
+		int rv;
+
+		if (!port || port - addr >= sizeof(host)) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		memcpy(host, addr, port - addr);
+		host[port - addr] = 0;
+
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+
+		if ((rv = getaddrinfo(*host ? host : NULL, port + 1, &hints, &res)) != 0) {
+			errorf("getaddrinfo: %s", gai_strerror(rv));
+			errno = EINVAL;
+			return -1;
+		}
+
+		for (p = res; p; p = p->ai_next) {
+			if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+				continue;
+
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+			if (bind(fd, p->ai_addr, p->ai_addrlen) == 0)
+				break;
+
+			close(fd);
+			fd = -1;
+		}
+
+		freeaddrinfo(res);
+		if (fd == -1)
+			return -1;
+	}
+
+	if (listen(fd, METRICS_CONNS) == -1)
+		goto fail;
+
+	fcntl(fd, F_SETFL, O_NONBLOCK); // Set non-blocking
+	return metricsfd = fd;
+
+fail:
+	close(fd);
+	return -1;
+}
+
+/* metrics_adopt serves scrapes on fd, a socket already listening, such as
+ * one handed over by the process before. */
+void
+metrics_adopt(int fd)
+{
+	for (int i = 0; i < METRICS_CONNS; ++i)
+		conns[i].fd = -1;
+
+	metricsfd = fd;
+}
+
+static int
+slot(int fd)
+{
+	for (int i = 0; i < METRICS_CONNS; ++i)
+		if (conns[i].fd == fd)
+			return i;
+	return -1;
+}
+
+/* metrics_owns reports whether fd is a scrape in progress. */
+int
+metrics_owns(int fd)
+{
+	return fd != -1 && slot(fd) != -1;
+}
+
+/* metrics_accept takes a new scrape, if there is room for it. */
+void
+metrics_accept(void)
+{
+	int fd, i;
+
+	if ((fd = accept(metricsfd, NULL, NULL)) == -1)
+		return;
+
+	if ((i = slot(-1)) == -1) {
+		// Scrapers retry; the IRC side matters more.
+		close(fd);
+		return;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK); // Set non-blocking
+
+	conns[i].fd = fd;
+	conns[i].reqlen = conns[i].outlen = conns[i].outptr = 0;
+	mca_ev_append(ev, fd, MCA_EV_READ);
+}
+
+static void
+finish(int i)
+{
+	// The event loop calls metrics_remove, then closes it.
+	loop_close(conns[i].fd);
+}
+
+/* escape copies s into buf as an OpenMetrics label value. */
+static const char *
+escape(const char *s, char *buf, size_t n)
+{
+	size_t ptr = 0;
+
+	for (; *s && ptr + 2 < n; ++s) {
+		if (*s == '\\' || *s == '"')
+			buf[ptr++] = '\\';
+		buf[ptr++] = *s;
+	}
+
+	buf[ptr] = 0;
+	return buf;
+}
+
+struct out {
+	char *buf;
+	size_t len, cap;
+};
+
+static void
+put(struct out *o, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (o->len >= o->cap)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(o->buf + o->len, o->cap - o->len, fmt, ap);
+	va_end(ap);
+
+	// Anything cut off is lost, rather than sent half written.
+	if (n > 0 && n < o->cap - o->len)
+		o->len += n;
+	else
+		o->cap = o->len;
+}
+
+static void
+histogram_head(struct out *o, const char *name, const char *help)
+{
+	put(o, "# TYPE %s histogram\n# UNIT %s seconds\n# HELP %s %s\n", name, name, name, help);
+}
+
+static void
+histogram(struct out *o, const char *name, const char *label, const struct histo *h)
+{
+	uint64_t seen = 0;
+	size_t b = 0;
+
+	// A bucket of ours is counted under the first bound it fits under
+	// entirely. One that straddles a bound only counts under the next one
+	// up, so the counts are never too high, but may be too low.
+	for (int i = 0; i < HISTO_BUCKETS && b < sizeof(bounds)/sizeof(*bounds); ++i) {
+		while (b < sizeof(bounds)/sizeof(*bounds) && histo_bucket_max(i) > bounds[b]) {
+			put(o, "%s_bucket{%s,le=\"%g\"} %llu\n", name, label, bounds[b] / 1e9,
+				(unsigned long long)seen);
+			b++;
+		}
+		seen += h->b[i];
+	}
+
+	for (; b < sizeof(bounds)/sizeof(*bounds); ++b)
+		put(o, "%s_bucket{%s,le=\"%g\"} %llu\n", name, label, bounds[b] / 1e9,
+			(unsigned long long)h->count);
+
+	put(o, "%s_bucket{%s,le=\"+Inf\"} %llu\n%s_count{%s} %llu\n%s_sum{%s} %g\n", name, label,
+		(unsigned long long)h->count, name, label, (unsigned long long)h->count, name, label,
+		h->sum / 1e9);
+}
+
+// The series kept for every connection, each a family of its own.
+enum { LINES, BYTES, DROPPED, SENDQ, SENDQ_MAX, QUEUE, WRITE, NFAMILIES };
+
+static const char *families[] = {
+	[LINES] = "# TYPE icbm_lines counter\n",
+	[BYTES] = "# TYPE icbm_bytes counter\n",
+	[DROPPED] = "# TYPE icbm_dropped_lines counter\n"
+		"# HELP icbm_dropped_lines Lines that did not fit in the send buffer.\n",
+	[SENDQ] = "# TYPE icbm_sendq_bytes gauge\n",
+	[SENDQ_MAX] = "# TYPE icbm_sendq_max_bytes gauge\n",
+	[QUEUE] = "# TYPE icbm_client_queue_seconds summary\n# UNIT icbm_client_queue_seconds seconds\n",
+	[WRITE] = "# TYPE icbm_client_write_seconds summary\n# UNIT icbm_client_write_seconds seconds\n",
+};
+
+static void
+summary(struct out *o, const char *name, const char *label, struct histo_small *h)
+{
+	static const double qs[] = { 0.5, 0.99, 0.999 };
+
+	for (int i = 0; i < sizeof(qs)/sizeof(*qs); ++i)
+		put(o, "%s{%s,quantile=\"%g\"} %g\n", name, label, qs[i],
+			histo_small_quantile(h, qs[i]) / 1e9);
+	put(o, "%s_count{%s} %llu\n%s_sum{%s} %g\n", name, label,
+		(unsigned long long)h->count, name, label, h->sum / 1e9);
+}
+
+static void
+conn(struct out *o, int f, const char *label, struct stats_conn *st, struct bufio *b,
+	struct stats_lat *l)
+{
+	switch (f) {
+	case LINES:
+		put(o, "icbm_lines_total{%s,direction=\"in\"} %llu\n", label, (unsigned long long)st->lines_in);
+		put(o, "icbm_lines_total{%s,direction=\"out\"} %llu\n", label, (unsigned long long)st->lines_out);
+		break;
+	case BYTES:
+		put(o, "icbm_bytes_total{%s,direction=\"in\"} %llu\n", label, (unsigned long long)st->bytes_in);
+		put(o, "icbm_bytes_total{%s,direction=\"out\"} %llu\n", label, (unsigned long long)st->bytes_out);
+		break;
+	case DROPPED:
+		put(o, "icbm_dropped_lines_total{%s} %llu\n", label, (unsigned long long)st->dropped);
+		break;
+	case SENDQ:
+		put(o, "icbm_sendq_bytes{%s} %d\n", label, b->sendptr);
+		break;
+	case SENDQ_MAX:
+		put(o, "icbm_sendq_max_bytes{%s} %zu\n", label, st->sendq_max);
+		break;
+	case QUEUE:
+		if (l)
+			summary(o, "icbm_client_queue_seconds", label, &l->queue);
+		break;
+	case WRITE:
+		if (l)
+			summary(o, "icbm_client_write_seconds", label, &l->write);
+		break;
+	}
+}
+
+// The series kept for every network.
+enum { UPTIME, CONNECTS, CLIENTS, FORWARDED, PERSEC, NNETFAMILIES };
+
+static const char *netfamilies[] = {
+	[UPTIME] = "# TYPE icbm_uptime_seconds gauge\n",
+	[CONNECTS] = "# TYPE icbm_upstream_connects counter\n",
+	[CLIENTS] = "# TYPE icbm_clients gauge\n",
+	[FORWARDED] = "# TYPE icbm_forwarded_lines counter\n"
+		"# HELP icbm_forwarded_lines Lines from the server written to clients.\n",
+	[PERSEC] = "# TYPE icbm_forwarded_lines_per_second gauge\n",
+};
+
+static void
+network(struct out *o, int f, const char *label, struct network *n)
+{
+	switch (f) {
+	case UPTIME:
+		put(o, "icbm_uptime_seconds{%s} %lld\n", label, (clk_mono_ms() - n->stats.started) / 1000);
+		break;
+	case CONNECTS:
+		put(o, "icbm_upstream_connects_total{%s} %llu\n", label, (unsigned long long)n->stats.connects);
+		break;
+	case CLIENTS:
+		put(o, "icbm_clients{%s} %d\n", label, n->clientptr);
+		break;
+	case FORWARDED:
+		put(o, "icbm_forwarded_lines_total{%s} %llu\n", label, (unsigned long long)n->stats.forwarded);
+		break;
+	case PERSEC:
+		put(o, "icbm_forwarded_lines_per_second{%s} %llu\n", label, (unsigned long long)n->stats.persec);
+		break;
+	}
+}
+
+/* hold makes every network, loop and worker safe to read. Ours is already
+ * held. */
+static void
+hold(void)
+{
+	for (int i = 0; i < nloops; ++i)
+		if (&loops[i] != loop)
+			pthread_mutex_lock(&loops[i].mu);
+	worker_lock_all();
+}
+
+static void
+release(void)
+{
+	worker_unlock_all();
+	for (int i = 0; i < nloops; ++i)
+		if (&loops[i] != loop)
+			pthread_mutex_unlock(&loops[i].mu);
+}
+
+/* render writes the metrics out as OpenMetrics text. Its cost is bounded by
+ * METRICS_CLIENTS_MAX, the number of networks and the size of buf.
+ *
+ * Every loop and the workers are held once, for the whole of it, rather
+ * than over and over for each family: a scrape stops them all for a while,
+ * but only once.
+ */
+static size_t
+render(char *buf, size_t cap)
+{
+	struct out o = { buf, 0, cap };
+	char label[192], name[64], nick[64];
+	int shown;
+
+	put(&o, "# TYPE icbm_log_dropped_messages counter\nicbm_log_dropped_messages_total %llu\n",
+		log_dropped());
+
+	put(&o, "# TYPE icbm_memory_bytes gauge\n");
+	for (int i = 0; i < MEM_LAST; ++i)
+		put(&o, "icbm_memory_bytes{kind=\"%s\"} %zu\n", mem_names[i], mem_get(i).live);
+	put(&o, "# TYPE icbm_memory_peak_bytes gauge\n");
+	for (int i = 0; i < MEM_LAST; ++i)
+		put(&o, "icbm_memory_peak_bytes{kind=\"%s\"} %zu\n", mem_names[i], mem_get(i).peak);
+	put(&o, "# TYPE icbm_allocations counter\n");
+	for (int i = 0; i < MEM_LAST; ++i)
+		put(&o, "icbm_allocations_total{kind=\"%s\"} %llu\n", mem_names[i],
+			(unsigned long long)mem_get(i).allocs);
+
+	// Every sample of a family has to come together, so the networks and
+	// their connections are walked once per family.
+	hold();
+	for (int f = 0; f < NNETFAMILIES; ++f) {
+		put(&o, "%s", netfamilies[f]);
+
+		for (int i = 0; i < nnetworks; ++i) {
+			snprintf(label, sizeof(label), "network=\"%s\"", escape(networks[i].name, name, sizeof(name)));
+
+			network(&o, f, label, &networks[i]);
+		}
+	}
+
+	for (int f = 0; f < NFAMILIES; ++f) {
+		put(&o, "%s", families[f]);
+		shown = 0;
+
+		for (int i = 0; i < nnetworks; ++i) {
+			struct network *n = &networks[i];
+
+			escape(n->name, name, sizeof(name));
+			snprintf(label, sizeof(label), "network=\"%s\",conn=\"server\"", name);
+
+			conn(&o, f, label, &n->stats.server, &n->bufio, NULL);
+
+			for (int c = 0; c < n->clientptr && shown < METRICS_CLIENTS_MAX; ++c, ++shown) {
+				const char *cn = n->clients[c].nick ? intern_str(n->names, n->clients[c].nick) : "*";
+				struct stats_conn st;
+				struct stats_lat *lat;
+				struct bufio *b;
+
+				client_view(&n->clients[c], &st, &b, &lat);
+				snprintf(label, sizeof(label), "network=\"%s\",conn=\"fd%d\",nick=\"%s\"", name,
+					n->clients[c].fd, escape(cn, nick, sizeof(nick)));
+				conn(&o, f, label, &st, b, lat);
+			}
+		}
+	}
+
+	histogram_head(&o, "icbm_loop_seconds", "Time spent handling each wakeup of an event loop.");
+	for (int i = 0; i < nloops; ++i) {
+		snprintf(label, sizeof(label), "loop=\"%d\"", i);
+		histogram(&o, "icbm_loop_seconds", label, &loops[i].stats.loop);
+	}
+
+	for (int i = 0; i < nworkers; ++i) {
+		snprintf(label, sizeof(label), "loop=\"%s\"", workers[i].l.name);
+		histogram(&o, "icbm_loop_seconds", label, &workers[i].l.stats.loop);
+	}
+
+	static const struct {
+		const char *name, *help;
+		size_t off;
+		int io; // Also kept by I/O workers, for the clients they write to
+	} hists[] = {
+		{ "icbm_forward_seconds", "Time from reading a line off the server to queueing it for every client.",
+			offsetof(struct stats, forward), 0 },
+		{ "icbm_queue_seconds", "Time lines from the server spend in a client's send buffer.",
+			offsetof(struct stats, queue), 1 },
+		{ "icbm_write_seconds", "Time from reading a line off the server to writing it to a client.",
+			offsetof(struct stats, write), 1 },
+	};
+
+	for (int h = 0; h < sizeof(hists)/sizeof(*hists); ++h) {
+		histogram_head(&o, hists[h].name, hists[h].help);
+
+		for (int i = 0; i < nnetworks; ++i) {
+			snprintf(label, sizeof(label), "network=\"%s\"", escape(networks[i].name, name, sizeof(name)));
+
+			histogram(&o, hists[h].name, label,
+				stats_histo(*(struct histo **)((char *)&networks[i].stats + hists[h].off)));
+		}
+
+		if (!hists[h].io)
+			continue;
+
+		for (int i = 0; i < nworkers; ++i) {
+			snprintf(label, sizeof(label), "worker=\"%d\"", i);
+			histogram(&o, hists[h].name, label,
+				stats_histo(*(struct histo **)((char *)&workers[i].stats + hists[h].off)));
+		}
+	}
+
+	release();
+
+	// Cut off or not, the exposition must end like this.
+	if (o.len + 6 > cap)
+		o.len = cap - 6;
+	memcpy(buf + o.len, "# EOF\n", 6);
+	return o.len + 6;
+}
+
+/* metrics_readable reads the request of a scrape and answers it. Whatever
+ * was asked for, the answer is the metrics. */
+int
+metrics_readable(int fd)
+{
+	int i = slot(fd), n, hdr;
+	char *out;
+
+	if (i == -1)
+		return 0;
+
+	n = read(fd, conns[i].req + conns[i].reqlen, sizeof(conns[i].req) - 1 - conns[i].reqlen);
+	if (n == -1 && errno == EAGAIN)
+		return 0;
+	if (n <= 0 || conns[i].outlen) {
+		finish(i);
+		return 0;
+	}
+
+	conns[i].reqlen += n;
+	conns[i].req[conns[i].reqlen] = 0;
+
+	if (!strstr(conns[i].req, "\r\n\r\n") && !strstr(conns[i].req, "\n\n")) {
+		if (conns[i].reqlen == sizeof(conns[i].req) - 1)
+			finish(i);
+		return 0;
+	}
+
+	// Leave room at the front for the headers, which need the length.
+	out = outbufs[i];
+	n = render(out + 256, METRICS_BUFSZ - 256);
+	hdr = snprintf(conns[i].req, sizeof(conns[i].req), "HTTP/1.0 200 OK\r\n"
+		"Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		"Content-Length: %d\r\nConnection: close\r\n\r\n", n);
+	memcpy(out + 256 - hdr, conns[i].req, hdr);
+
+	conns[i].outptr = 256 - hdr;
+	conns[i].outlen = 256 + n;
+
+	mca_ev_set_write(ev, fd, 1);
+	return 0;
+}
+
+/* metrics_writable sends as much of the answer as it can, and hangs up once
+ * it is all out. */
+void
+metrics_writable(int fd)
+{
+	int i = slot(fd), n;
+
+	if (i == -1 || !conns[i].outlen)
+		return;
+
+	n = write(fd, outbufs[i] + conns[i].outptr, conns[i].outlen - conns[i].outptr);
+	if (n == -1 && errno == EAGAIN)
+		return;
+	if (n <= 0 || (conns[i].outptr += n) == conns[i].outlen)
+		finish(i);
+}
+
+/* metrics_remove frees the slot of a scrape once the event loop has let go
+ * of it. */
+void
+metrics_remove(int fd)
+{
+	int i = slot(fd);
+
+	if (i != -1)
+		conns[i].fd = -1;
+}
@@ -0,0 +1,14 @@
+#ifndef METRICS_H_INC
+#define METRICS_H_INC
+
+/* The socket scrapes are accepted on, or -1 if there is none. */
+extern int metricsfd;
+
+int metrics_listen(const char *addr);
+void metrics_adopt(int fd);
+int metrics_owns(int fd);
+void metrics_accept(void);
+int metrics_readable(int fd);
+void metrics_writable(int fd);
+void metrics_remove(int fd);
+#endif
@@ -0,0 +1,318 @@
+#define _DEFAULT_SOURCE
+
+/* microbench times the pieces every line goes through on its own: parsing,
+ * serializing, framing off a socket, and finding the handler for it.
+ *
+ * Usage: microbench [corpus]
+ *
+ * corpus is either a file of IRC lines, one per line, or a capture made with
+ * icbm -c. Without one, a built in corpus of typical lines is used, tagged
+ * IRCv3 ones included.
+ *
+ * Each benchmark is warmed up, then run RUNS times; the median run is
+ * reported. Cycles come from perf_event_open(2) and are left out if it is
+ * not allowed.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bufio.h"
+#include "capture.h"
+#include "client.h"
+#include "irc.h"
+#include "server.h"
+
+#define RUNS 11
+#define TARGET_LINES 1000000 // Per run
+
+static const char *builtin[] = {
+	":irc.example.net 001 icbm :Welcome to the ExampleNet IRC Network icbm!~icbm@localhost",
+	":irc.example.net 005 icbm CASEMAPPING=rfc1459 CHANMODES=beI,k,l,imnpst CHANTYPES=# NICKLEN=30 :are supported by this server",
+	":irc.example.net 353 icbm = #linux :alice bob @carol +dave eve mallory trent peggy victor walter",
+	":irc.example.net 366 icbm #linux :End of /NAMES list.",
+	"PING :irc.example.net",
+	":alice!~alice@user/alice PRIVMSG #linux :has anyone tried the new kernel yet?",
+	":bob!~bob@192.0.2.7 PRIVMSG #linux :yes, works fine here",
+	":carol!carol@gateway/web/irccloud.com/x-abcdefgh NOTICE icbm :hello",
+	":dave!~dave@host-198-51-100-3.example.org JOIN #linux",
+	":eve!~eve@2001:db8::1 QUIT :Ping timeout: 240 seconds",
+	":mallory!~m@user/mallory PART #linux :Leaving",
+	":trent!~t@user/trent MODE #linux +o peggy",
+	"@time=2023-06-01T12:00:00.123Z :alice!~alice@user/alice PRIVMSG #linux :tagged hello",
+	"@time=2023-06-01T12:00:01.456Z;account=alice;msgid=Zm9vYmFyYmF6 :alice!~alice@user/alice PRIVMSG #linux :with an account",
+	"@batch=abc123;time=2023-06-01T12:00:02.000Z :irc.example.net BATCH +abc123 chathistory #linux",
+	"@+draft/reply=Zm9vYmFyYmF6;+draft/react=lol;+typing=active;account=bob;msgid=YmF6cXV4;time=2023-06-01T12:00:03.789Z :bob!~bob@192.0.2.7 TAGMSG #linux",
+	"@account=carol;msgid=cXV1eGNvcmdl;time=2023-06-01T12:00:04.000Z;+example.com/some-long-vendor-tag=aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa :carol!carol@gateway/web/irccloud.com/x-abcdefgh PRIVMSG #linux :Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et dolore magna aliqua.",
+	"PRIVMSG #linux :sent by a client",
+	"CAP REQ :message-tags server-time batch",
+	"NICK icbm",
+	"USER icbm 0 * :icbm",
+	"ICBM HISTORY #linux * * 50",
+};
+
+static char **corpus;
+static size_t ncorpus, corpusbytes;
+
+static int cycfd = -1;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+cycles(void)
+{
+	uint64_t v = 0;
+
+	if (cycfd == -1 || read(cycfd, &v, sizeof(v)) != sizeof(v))
+		return 0;
+	return v;
+}
+
+static void
+cycles_open(void)
+{
+	struct perf_event_attr pe = {0};
+
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CPU_CYCLES;
+	pe.exclude_hv = 1;
+
+	if ((cycfd = syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0)) == -1)
+		fprintf(stderr, "perf_event_open: %s, not counting cycles\n", strerror(errno));
+}
+
+static void
+add(const char *line, size_t n)
+{
+	if (!n || n >= 4096 - 2)
+		return;
+
+	if (!(corpus = realloc(corpus, sizeof(*corpus) * (ncorpus + 1))) ||
+	    !(corpus[ncorpus] = malloc(n + 1))) {
+		perror("malloc");
+		exit(1);
+	}
+
+	memcpy(corpus[ncorpus], line, n);
+	corpus[ncorpus++][n] = 0;
+	corpusbytes += n + 2;
+}
+
+static void
+load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	char magic[8], *line = NULL;
+	size_t cap = 0;
+	ssize_t n;
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	if (fread(magic, 1, 8, f) == 8 && memcmp(magic, CAPTURE_MAGIC, 8) == 0) {
+		struct capture_rec rec;
+		char buf[65536];
+
+		while (fread(&rec, sizeof(rec), 1, f) == 1 && rec.len <= sizeof(buf) &&
+		    fread(buf, 1, rec.len, f) == rec.len)
+			if (rec.type == CAPTURE_LINE)
+				add(buf, rec.len);
+	} else {
+		rewind(f);
+		while ((n = getline(&line, &cap, f)) > 0)
+			add(line, strcspn(line, "\r\n"));
+		free(line);
+	}
+
+	fclose(f);
+}
+
+static int
+cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* bench runs f over the corpus RUNS times, after a warmup, and prints the
+ * median run. f returns how many lines it handled. */
+static void
+bench(const char *name, size_t (*f)(void))
+{
+	uint64_t ns[RUNS], cyc[RUNS], t, c;
+	size_t lines = 0;
+
+	f(); // Warm up
+
+	for (int r = 0; r < RUNS; ++r) {
+		c = cycles();
+		t = now();
+		lines = f();
+		ns[r] = now() - t;
+		cyc[r] = cycles() - c;
+	}
+
+	qsort(ns, RUNS, sizeof(*ns), cmp);
+	qsort(cyc, RUNS, sizeof(*cyc), cmp);
+
+	printf("%-16s %8.1f ns/line %8.1f MB/s", name, (double)ns[RUNS/2] / lines,
+		(double)corpusbytes * (lines / ncorpus) / ns[RUNS/2] * 1e3);
+	if (cycfd != -1)
+		printf(" %8.1f cycles/line", (double)cyc[RUNS/2] / lines);
+	printf("\n");
+}
+
+static size_t reps;
+static volatile size_t sink;
+
+static size_t
+b_parse(void)
+{
+	struct irc_message msg;
+	char buf[4096];
+
+	// irc_parse works in place, so the line is copied first as it would
+	// be sitting in a receive buffer.
+	for (size_t r = 0; r < reps; ++r) {
+		for (size_t i = 0; i < ncorpus; ++i) {
+			strcpy(buf, corpus[i]);
+			sink += irc_parse(buf, &msg);
+		}
+	}
+
+	return reps * ncorpus;
+}
+
+static struct irc_message *parsed;
+
+static size_t
+b_string(void)
+{
+	char buf[4096];
+
+	for (size_t r = 0; r < reps; ++r)
+		for (size_t i = 0; i < ncorpus; ++i)
+			sink += irc_string(&parsed[i], buf, sizeof(buf));
+
+	return reps * ncorpus;
+}
+
+static size_t
+b_dispatch(void)
+{
+	for (size_t r = 0; r < reps; ++r) {
+		for (size_t i = 0; i < ncorpus; ++i) {
+			sink += client_dispatch_find(parsed[i].command);
+			sink += server_dispatch_find(parsed[i].command);
+		}
+	}
+
+	return reps * ncorpus;
+}
+
+static int pfd[2];
+static char *stream;
+static size_t streamlen;
+
+static size_t
+b_framing(void)
+{
+	struct bufio b = {0};
+	size_t lines = 0;
+
+	// The pipe is kept under its capacity, so every write goes straight
+	// through and bufio reads back whatever is there, as it would off a
+	// socket.
+	for (size_t r = 0; r < reps; ++r) {
+		for (size_t off = 0; off < streamlen; ) {
+			size_t n = streamlen - off > 32768 ? 32768 : streamlen - off;
+			int got;
+
+			// Stop on a line boundary so nothing is left over.
+			while (n < streamlen - off && stream[off + n - 1] != '\n')
+				n--;
+
+			if (write(pfd[1], stream + off, n) != n) {
+				perror("write");
+				exit(1);
+			}
+			off += n;
+
+			while ((got = bufio_readable(&b, pfd[0])) > 0)
+				lines++;
+			if (got == -1) {
+				perror("bufio_readable");
+				exit(1);
+			}
+		}
+	}
+
+	return lines;
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc > 1)
+		load(argv[1]);
+	else
+		for (size_t i = 0; i < sizeof(builtin)/sizeof(*builtin); ++i)
+			add(builtin[i], strlen(builtin[i]));
+
+	if (!ncorpus) {
+		fprintf(stderr, "empty corpus\n");
+		return 1;
+	}
+
+	reps = TARGET_LINES / ncorpus + 1;
+	printf("%zu lines, %zu bytes, %zu passes per run\n", ncorpus, corpusbytes, reps);
+
+	cycles_open();
+
+	// Parsed copies for the benchmarks that start from a message.
+	if (!(parsed = malloc(sizeof(*parsed) * ncorpus)) ||
+	    !(stream = malloc(corpusbytes))) {
+		perror("malloc");
+		return 1;
+	}
+	for (size_t i = 0; i < ncorpus; ++i) {
+		char *copy = strdup(corpus[i]);
+
+		if (!copy || irc_parse(copy, &parsed[i]) != 0) {
+			fprintf(stderr, "line %zu does not parse: %s\n", i, corpus[i]);
+			return 1;
+		}
+
+		streamlen += sprintf(stream + streamlen, "%s\r\n", corpus[i]);
+	}
+
+	if (pipe(pfd) == -1) {
+		perror("pipe");
+		return 1;
+	}
+	fcntl(pfd[0], F_SETFL, O_NONBLOCK);
+
+	bench("irc_parse", b_parse);
+	bench("irc_string", b_string);
+	bench("dispatch", b_dispatch);
+	bench("bufio framing", b_framing);
+
+	return 0;
+}
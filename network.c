@@ -0,0 +1,758 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "client.h"
+#include "clk.h"
+#include "irc.h"
+#include "log.h"
+#include "mem.h"
+#include "network.h"
+#include "probe.h"
+#include "ring.h"
+#include "split.h"
+#include "worker.h"
+
+struct user *users;
+struct network *networks;
+int nnetworks;
+static int networkscap;
+struct loop *loops;
+int nloops;
+
+__thread struct network *net;
+__thread struct loop *loop;
+__thread struct mca_ev *ev;
+
+
+/* user_add adds someone to host networks for. The strings must live
+ * forever.
+ *
+ * On error, NULL is returned.
+ */
+struct user *
+user_add(const char *name, const char *pass)
+{
+	struct user *u;
+
+	for (u = users; u; u = u->next) {
+		if (strcasecmp(u->name, name) == 0) {
+			errno = EEXIST;
+			return NULL;
+		}
+	}
+
+	if (!(u = mem_calloc(MEM_NETWORKS, 1, sizeof(*u))))
+		return NULL;
+
+	u->name = name;
+	u->pass = pass;
+	u->uid = -1;
+	u->next = users;
+	users = u;
+	return u;
+}
+
+/* user_take counts a client of u in, unless u already has as many as they
+ * may. */
+static int
+user_take(struct user *u)
+{
+	int n = __atomic_add_fetch(&u->clients, 1, __ATOMIC_RELAXED);
+
+	if (!u->maxclients || n <= u->maxclients)
+		return 1;
+
+	__atomic_sub_fetch(&u->clients, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+static void
+user_put(struct user *u)
+{
+	if (u)
+		__atomic_sub_fetch(&u->clients, 1, __ATOMIC_RELAXED);
+}
+
+/* network_add adds a network to connect to, for u if it is not NULL. The
+ * strings must live forever.
+ *
+ * Networks may move in memory until the loops are started, so pointers to
+ * them should not be taken before then.
+ *
+ * On error, -1 is returned.
+ */
+int
+network_add(struct user *u, const char *name, const char *address, const char *port,
+	const char *nick)
+{
+	struct network *n;
+
+	if (network_find(name)) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	// There may be thousands, one per user and network.
+	if (nnetworks == networkscap) {
+		int cap = networkscap ? networkscap * 2 : 4;
+
+		if (!(n = mem_realloc(MEM_NETWORKS, networks, sizeof(*n) * cap)))
+			return -1;
+
+		networks = n;
+		networkscap = cap;
+	}
+
+	n = &networks[nnetworks];
+	memset(n, 0, sizeof(*n));
+
+	n->name = name;
+	n->address = address;
+	n->port = port;
+	n->nick = nick;
+	n->ircfd = -1;
+	n->pool.casemap = CASEMAP_RFC1459;
+	n->user = u;
+
+	nnetworks++;
+	return 0;
+}
+
+/* network_find returns the network called name, ignoring case, or NULL. */
+struct network *
+network_find(const char *name)
+{
+	for (int i = 0; i < nnetworks; ++i)
+		if (strcasecmp(networks[i].name, name) == 0)
+			return &networks[i];
+	return NULL;
+}
+
+/* network_share points each network at its pool of nicks. Networks on the
+ * same server and loop share one, so that a nick seen by many users is only
+ * kept once. Call it once networks have stopped moving and have their loops.
+ */
+void
+network_share(void)
+{
+	for (int i = 0; i < nnetworks; ++i) {
+		struct network *n = &networks[i];
+
+		n->names = &n->pool;
+
+		for (int j = 0; j < i; ++j) {
+			struct network *o = &networks[j];
+
+			if (o->loop == n->loop && strcasecmp(o->address, n->address) == 0 &&
+			    strcmp(o->port, n->port) == 0) {
+				n->names = o->names;
+				break;
+			}
+		}
+	}
+}
+
+/* network_attach adds the client on fd to n, which must run on the calling
+ * thread's loop, and has the loop watch it. Nothing is sent to it.
+ *
+ * On error, fd is closed and NULL is returned.
+ */
+struct client *
+network_attach(struct network *n, int fd)
+{
+	static const char full[] = "ERROR :Too many clients\r\n";
+	struct client *c;
+
+	// Told why, then let go of, if its user has all the clients they may.
+	if (n->user && !user_take(n->user)) {
+		infof("%s: refusing client fd %d, %s has %d already", n->name, fd, n->user->name,
+			n->user->maxclients);
+		write(fd, full, sizeof(full) - 1);
+		close(fd);
+		return NULL;
+	}
+
+	// Networks nobody is attached to cost nothing here.
+	if (n->clientptr + 1 >= n->clientsz) {
+		int sz = n->clientsz ? n->clientsz * 2 : 4;
+
+		if (!(c = mem_realloc(MEM_CLIENTS, n->clients, sizeof(*c) * sz)))
+			goto fail;
+
+		n->clients = c;
+		n->clientsz = sz;
+	}
+
+	if (loop_own(loop, fd, n, OWN_CLIENT) == -1)
+		goto fail;
+
+	if (mca_ev_append(ev, fd, MCA_EV_READ) == -1) {
+		loop_own(loop, fd, NULL, OWN_NONE);
+		goto fail;
+	}
+
+	c = &n->clients[n->clientptr++];
+	memset(c, 0, sizeof(*c));
+	c->fd = fd;
+	if (n->user)
+		c->b.sendmax = n->user->sendq;
+
+	// Without a worker, the loop writes to it like any other.
+	if (nworkers && worker_open(c) == -1)
+		warnf("%s: no I/O worker for client fd %d, writing from %s", n->name, fd, loop->name);
+
+	return c;
+
+fail:
+	warnf("Failed to take client fd %d for %s", fd, n->name);
+	user_put(n->user);
+	close(fd);
+	return NULL;
+}
+
+/* network_accept attaches the client on fd to n, which must run on the
+ * calling thread's loop. buf holds the len bytes it sent before it picked
+ * n, which are handled right away. Clients of a network whose server
+ * connection is gone are told so, and turned away.
+ *
+ * On error, fd is closed and -1 is returned.
+ */
+int
+network_accept(struct network *n, int fd, const char *buf, size_t len)
+{
+	struct client *c;
+	char err[512];
+
+	if (n->ircfd == -1) {
+		infof("fd %d: turned away, %s is not connected", fd, n->name);
+		snprintf(err, sizeof(err), "ERROR :%s is not connected to its server\r\n", n->name);
+		write(fd, err, strlen(err));
+		close(fd);
+		return -1;
+	}
+
+	if (!(c = network_attach(n, fd)))
+		return -1;
+
+	memcpy(c->b.recvbuf, buf, len);
+	c->b.recvptr = len;
+
+	capture_event(fd, CAPTURE_OPEN);
+	PROBE1(accept, fd);
+
+	debugf("New connection on fd %d for %s", fd, n->name);
+
+	net = n;
+	client_sendf(c, "PING :%lld", (long long)clk_real.tv_sec);
+
+	// What is already buffered will not make the fd readable again.
+	if (len)
+		while (client_readable(fd));
+
+	return 0;
+}
+
+/* network_remove_client forgets about the client on fd, once the loop has
+ * let go of it.
+ *
+ * If an I/O worker was writing to it, the worker is left to close fd and 1
+ * is returned. Otherwise, closing fd is up to the caller.
+ */
+int
+network_remove_client(struct network *n, int fd)
+{
+	struct ioconn *io;
+	int cli;
+
+	for (cli = 0; cli < n->clientptr; ++cli)
+		if (n->clients[cli].fd == fd)
+			break;
+
+	if (cli == n->clientptr)
+		return 0;
+
+	io = n->clients[cli].io;
+	user_put(n->user);
+	intern_put(n->names, n->clients[cli].nick);
+	bufio_free(&n->clients[cli].b);
+
+	// We must move all clients ahead of it back one space
+	memmove(&n->clients[cli], &n->clients[cli+1], sizeof(struct client)*(n->clientptr-cli-1));
+	n->clientptr--;
+
+	if (!io)
+		return 0;
+
+	worker_close(io);
+	return 1;
+}
+
+/* network_down lets go of the clients of n once its server connection is
+ * gone. Whatever is queued for them is written out, if that can be done
+ * without waiting. */
+void
+network_down(struct network *n)
+{
+	while (n->clientptr) {
+		struct client *c = &n->clients[n->clientptr - 1];
+
+		if (c->b.sendptr)
+			bufio_writable(&c->b, c->fd);
+		loop_close(c->fd);
+	}
+}
+
+/* network_free closes and frees everything n holds. Networks sharing its
+ * names (see network_share) must have been freed already. */
+void
+network_free(struct network *n)
+{
+	for (int cli = 0; cli < n->clientptr; ++cli) {
+		intern_put(n->names, n->clients[cli].nick);
+		bufio_free(&n->clients[cli].b);
+		close(n->clients[cli].fd);
+	}
+	mem_free(MEM_CLIENTS, n->clients);
+
+	if (n->ircfd != -1)
+		close(n->ircfd);
+	bufio_free(&n->bufio);
+
+	for (size_t i = 0; i < n->isupport.len; ++i)
+		mem_free(MEM_ISUPPORT, n->isupport.data[i]);
+	mem_free(MEM_VEC, n->isupport.data);
+
+	history_close(&n->history);
+	stats_free(&n->stats);
+	ring_free(n->ring);
+	split_free(n);
+	if (n->names == &n->pool)
+		intern_free(&n->pool);
+}
+
+/* loop_init sets up l, but does not start it. The caller sets the event
+ * handlers.
+ *
+ * On error, -1 is returned.
+ */
+int
+loop_init(struct loop *l, int id)
+{
+	memset(l, 0, sizeof(*l));
+	l->id = id;
+	l->wake = -1;
+	snprintf(l->name, sizeof(l->name), "loop %d", id);
+
+	pthread_mutex_init(&l->mu, NULL);
+	pthread_mutex_init(&l->inboxmu, NULL);
+
+	if (mca_ev_new(&l->ev) == -1)
+		return -1;
+	mca_ev_set_userdata(l->ev, l);
+
+	if ((l->wake = eventfd(0, EFD_NONBLOCK)) == -1)
+		return -1;
+
+	if (loop_own(l, l->wake, NULL, OWN_WAKE) == -1)
+		return -1;
+	return mca_ev_append(l->ev, l->wake, MCA_EV_READ);
+}
+
+/* loop_free frees l, which must have stopped. */
+void
+loop_free(struct loop *l)
+{
+	if (l->ev)
+		mca_ev_free(l->ev);
+	if (l->wake != -1)
+		close(l->wake);
+
+	mem_free(MEM_NETWORKS, l->owners);
+	mem_free(MEM_NETWORKS, l->inbox);
+	pthread_mutex_destroy(&l->mu);
+	pthread_mutex_destroy(&l->inboxmu);
+}
+
+/* loop_own records that fd, in l, is of kind and belongs to n.
+ *
+ * On error, -1 is returned.
+ */
+int
+loop_own(struct loop *l, int fd, struct network *n, int kind)
+{
+	if (fd >= l->nowners) {
+		size_t sz = l->nowners ? l->nowners : 64;
+		struct owner *o;
+
+		while (sz <= fd)
+			sz *= 2;
+
+		if (!(o = mem_realloc(MEM_NETWORKS, l->owners, sizeof(*o) * sz)))
+			return -1;
+
+		memset(o + l->nowners, 0, sizeof(*o) * (sz - l->nowners));
+		l->owners = o;
+		l->nowners = sz;
+	}
+
+	l->owners[fd].net = n;
+	l->owners[fd].kind = kind;
+	return 0;
+}
+
+/* loop_owner returns what fd is in l. */
+struct owner
+loop_owner(struct loop *l, int fd)
+{
+	struct owner none = { NULL, OWN_NONE };
+
+	return fd >= 0 && fd < l->nowners ? l->owners[fd] : none;
+}
+
+/* loop_post hands the client on fd over to n, which runs on l, along with
+ * the len bytes in buf it has already sent. It may be called from any
+ * thread.
+ *
+ * On error, -1 is returned and fd is left alone.
+ */
+int
+loop_post(struct loop *l, struct network *n, int fd, const char *buf, size_t len)
+{
+	struct handoff *h;
+
+	pthread_mutex_lock(&l->inboxmu);
+
+	if (l->inboxlen == l->inboxcap) {
+		size_t cap = l->inboxcap ? l->inboxcap * 2 : 4;
+
+		if (!(h = mem_realloc(MEM_NETWORKS, l->inbox, sizeof(*h) * cap))) {
+			pthread_mutex_unlock(&l->inboxmu);
+			return -1;
+		}
+
+		l->inbox = h;
+		l->inboxcap = cap;
+	}
+
+	h = &l->inbox[l->inboxlen++];
+	h->net = n;
+	h->fd = fd;
+	h->len = len;
+	memcpy(h->buf, buf, len);
+
+	pthread_mutex_unlock(&l->inboxmu);
+
+	loop_wake(l);
+	return 0;
+}
+
+/* loop_inbox takes the clients handed over to l, on l's own thread. */
+void
+loop_inbox(struct loop *l)
+{
+	uint64_t n;
+
+	read(l->wake, &n, sizeof(n));
+
+	pthread_mutex_lock(&l->inboxmu);
+	for (size_t i = 0; i < l->inboxlen; ++i)
+		network_accept(l->inbox[i].net, l->inbox[i].fd, l->inbox[i].buf, l->inbox[i].len);
+	l->inboxlen = 0;
+	pthread_mutex_unlock(&l->inboxmu);
+}
+
+/* loop_wake makes l's poll(2) return. It may be called from any thread, or
+ * a signal handler. */
+void
+loop_wake(struct loop *l)
+{
+	uint64_t one = 1;
+	int e = errno;
+
+	// EAGAIN means it is going to wake up anyway.
+	write(l->wake, &one, sizeof(one));
+	errno = e;
+}
+
+/* loop_lock takes l's mu, unless it already has it. Only l's own thread may
+ * call it; everyone else locks mu directly. */
+void
+loop_lock(struct loop *l)
+{
+	if (l->locked)
+		return;
+
+	pthread_mutex_lock(&l->mu);
+	l->locked = 1;
+}
+
+/* loop_unlock gives l's mu back, if l has it. */
+void
+loop_unlock(struct loop *l)
+{
+	if (!l->locked)
+		return;
+
+	l->locked = 0;
+	pthread_mutex_unlock(&l->mu);
+}
+
+/* loop_close takes fd out of the calling thread's loop, whose on_remove
+ * handler closes it.
+ *
+ * fd must not be closed first: another thread could be handed the same
+ * number before this loop has let go of it.
+ */
+void
+loop_close(int fd)
+{
+	mca_ev_remove(ev, fd);
+}
+
+/* lobby_add keeps the client on fd in the lobby until it picks a network.
+ * uid is that of a peer on a unix socket, or -1.
+ *
+ * On error, fd is closed and -1 is returned.
+ */
+int
+lobby_add(int fd, long uid)
+{
+	struct loop *l = loop;
+	struct lobby *lb;
+
+	if (l->nlobby == l->lobbycap) {
+		size_t cap = l->lobbycap ? l->lobbycap * 2 : 8;
+
+		if (!(lb = mem_realloc(MEM_NETWORKS, l->lobby, sizeof(*lb) * cap))) {
+			close(fd);
+			return -1;
+		}
+
+		l->lobby = lb;
+		l->lobbycap = cap;
+	}
+
+	if (loop_own(l, fd, NULL, OWN_LOBBY) == -1 || mca_ev_append(ev, fd, MCA_EV_READ) == -1) {
+		loop_own(l, fd, NULL, OWN_NONE);
+		close(fd);
+		return -1;
+	}
+
+	lb = &l->lobby[l->nlobby++];
+	lb->fd = fd;
+	lb->uid = uid;
+	lb->len = 0;
+
+	debugf("New connection on fd %d, waiting for it to pick a network", fd);
+	return 0;
+}
+
+static struct lobby *
+lobby_find(int fd)
+{
+	for (size_t i = 0; i < loop->nlobby; ++i)
+		if (loop->lobby[i].fd == fd)
+			return &loop->lobby[i];
+	return NULL;
+}
+
+/* pick finds the network named by line, which is len bytes long. Either of
+ *
+ *	PASS [<user>/]<network>
+ *	USER [<user>/]<network> ...
+ *
+ * names one. refuse is set if line is a USER that does not, since the
+ * client has then finished registering without picking one.
+ */
+static struct network *
+pick(const char *line, size_t len, int *refuse)
+{
+	struct irc_message msg = {0};
+	struct network *n;
+	char buf[sizeof(((struct bufio *)0)->recvbuf)];
+	char *name;
+
+	snprintf(buf, sizeof(buf), "%.*s", (int)len, line);
+	buf[strcspn(buf, "\r")] = 0;
+
+	if (irc_parse(buf, &msg) || !msg.params[0])
+		return NULL;
+
+	if (strcasecmp(msg.command, "PASS") != 0 && strcasecmp(msg.command, "USER") != 0)
+		return NULL;
+
+	name = strrchr(msg.params[0], '/');
+	name = name ? name + 1 : msg.params[0];
+
+	if (!(n = network_find(name)) && strcasecmp(msg.command, "USER") == 0)
+		*refuse = 1;
+	return n;
+}
+
+/* passeq compares passwords in time that depends only on the length of the
+ * one given. */
+static int
+passeq(const char *want, const char *got)
+{
+	size_t wl = strlen(want), gl = strlen(got);
+	unsigned char d = wl != gl;
+
+	for (size_t i = 0; i < gl; ++i)
+		d |= (unsigned char)got[i] ^ (unsigned char)want[wl ? i % wl : 0];
+	return !d;
+}
+
+/* login finds the network a client logs in to when there are users, from
+ * the len bytes it has sent. A password is needed as well as a network, so
+ * it waits for USER, which ends registration, and takes either of
+ *
+ *	PASS <password>
+ *	USER <user>/<network> ...
+ *
+ *	PASS <user>/<network>:<password>
+ *	USER ...
+ *
+ * Peers on a unix socket whose uid is the user's may leave PASS out. refuse
+ * is set if the client got it wrong; it only gets the one try.
+ */
+static struct network *
+login(const char *buf, size_t len, long uid, int *refuse)
+{
+	char line[sizeof(((struct bufio *)0)->recvbuf)];
+	char pass[512] = "", *name, *pw, *colon;
+	struct network *n;
+
+	for (const char *p = buf, *nl; (nl = memchr(p, '\n', buf + len - p)); p = nl + 1) {
+		struct irc_message msg = {0};
+
+		snprintf(line, sizeof(line), "%.*s", (int)(nl - p), p);
+		line[strcspn(line, "\r")] = 0;
+
+		if (irc_parse(line, &msg) || !msg.params[0])
+			continue;
+
+		if (strcasecmp(msg.command, "PASS") == 0) {
+			snprintf(pass, sizeof(pass), "%s", msg.params[0]);
+			continue;
+		} else if (strcasecmp(msg.command, "USER") != 0) {
+			continue;
+		}
+
+		name = msg.params[0];
+		pw = pass;
+		if ((colon = strchr(pass, ':')) && memchr(pass, '/', colon - pass)) {
+			*colon = 0;
+			name = pass;
+			pw = colon + 1;
+		}
+
+		if ((n = network_find(name)) && n->user &&
+		    ((uid != -1 && n->user->uid == uid) || passeq(n->user->pass, pw)))
+			return n;
+
+		*refuse = 1;
+		return NULL;
+	}
+
+	return NULL;
+}
+
+/* lobby_readable reads from a client in the lobby, and sends it off to its
+ * network once it has picked one. */
+int
+lobby_readable(int fd)
+{
+	struct lobby *lb = lobby_find(fd);
+	struct network *n = NULL;
+	char buf[sizeof(lb->buf)];
+	size_t len;
+	int r, refuse = 0;
+
+	if (!lb)
+		return 0;
+
+	r = read(fd, lb->buf + lb->len, sizeof(lb->buf) - lb->len);
+	if (r == -1 && errno == EAGAIN)
+		return 0;
+	if (r <= 0) {
+		loop_close(fd);
+		return 0;
+	}
+	lb->len += r;
+
+	if (users)
+		n = login(lb->buf, lb->len, lb->uid, &refuse);
+
+	for (char *line = lb->buf, *nl; !users && !n && !refuse &&
+	    (nl = memchr(line, '\n', lb->buf + lb->len - line)); line = nl + 1)
+		n = pick(line, nl - line, &refuse);
+
+	if (!n) {
+		if (refuse || lb->len == sizeof(lb->buf)) {
+			static const char err[] = ":example.com 464 * :Pick a network with PASS <network> "
+				"or USER <user>/<network>\r\n";
+			static const char bad[] = ":example.com 464 * :Password incorrect\r\n";
+
+			if (users) {
+				infof("fd %d failed to log in", fd);
+				write(fd, bad, sizeof(bad) - 1);
+			} else {
+				write(fd, err, sizeof(err) - 1);
+			}
+			loop_close(fd);
+		}
+		return 0;
+	}
+
+	len = lb->len;
+	memcpy(buf, lb->buf, len);
+
+	// Out of this loop without closing it, then over to the network's.
+	loop_own(loop, fd, NULL, OWN_NONE);
+	mca_ev_remove(ev, fd);
+	lobby_remove(fd);
+
+	debugf("fd %d picked %s", fd, n->name);
+
+	if (n->loop == loop)
+		network_accept(n, fd, buf, len);
+	else if (loop_post(n->loop, n, fd, buf, len) == -1)
+		close(fd);
+
+	return 0;
+}
+
+/* lobby_remove forgets about the client on fd. */
+void
+lobby_remove(int fd)
+{
+	struct lobby *lb = lobby_find(fd);
+
+	if (!lb)
+		return;
+
+	memmove(lb, lb + 1, sizeof(*lb) * (loop->lobby + loop->nlobby - lb - 1));
+	loop->nlobby--;
+}
+
+/* lobby_free hangs up on every client still in the lobby of l. */
+void
+lobby_free(struct loop *l)
+{
+	for (size_t i = 0; i < l->nlobby; ++i)
+		close(l->lobby[i].fd);
+
+	mem_free(MEM_NETWORKS, l->lobby);
+	l->lobby = NULL;
+	l->nlobby = l->lobbycap = 0;
+}
@@ -0,0 +1,160 @@
+#ifndef NETWORK_H_INC
+#define NETWORK_H_INC
+#include <pthread.h>
+#include <stddef.h>
+
+#include "bufio.h"
+#include "client.h"
+#include "ev.h"
+#include "history.h"
+#include "intern.h"
+#include "stats.h"
+#include "vec.h"
+
+struct ioconn;
+struct ring;
+struct split;
+struct loop;
+
+/* user is someone networks are bounced for, when several are hosted by one
+ * process. Their networks may run on any loop, so clients is atomic. */
+struct user {
+	const char *name, *pass;
+	int maxclients; // Attached at once, over all their networks; 0 for any
+	int sendq; // Bytes each of their clients may have queued; 0 for the default
+	long uid; // Logs in over a unix socket without a password, or -1
+	int clients;
+
+	struct user *next;
+};
+
+/* network is everything kept for one upstream connection and the clients
+ * attached to it. It is only touched by the thread of the loop it runs on;
+ * anyone else has to hold that loop's mu. */
+struct network {
+	const char *name;
+	const char *address, *port, *nick;
+
+	int ircfd;
+	int resumed; // Taken over from the process before, already registered
+	int warm; // ISUPPORT is from the snapshot, until the server sends its own
+	struct ring *ring; // For local consumers, once one has asked for it
+	struct split *splits; // SPLIT_MAX of them, once there has been a netsplit
+	struct bufio bufio;
+	int caps; // Negotiated with the server
+	int capend, capwant;
+
+	struct mca_vector isupport;
+	struct intern *names; // Nicks, casemapped as the server says
+	struct intern pool; // What names points to, unless it is shared
+	struct history history;
+
+	struct client *clients;
+	int clientptr, clientsz;
+
+	struct stats stats;
+	struct loop *loop;
+	struct user *user; // Who it is for, if anyone in particular
+};
+
+// What an fd in a loop is.
+enum {
+	OWN_NONE,
+	OWN_WAKE,
+	OWN_LOBBY,
+	OWN_SERVER,
+	OWN_CLIENT,
+	OWN_IO, // The send side of a client, in an I/O worker
+};
+
+struct owner {
+	struct network *net;
+	struct ioconn *io; // OWN_IO only
+	int kind;
+};
+
+/* A client that has not picked a network yet, kept by the loop that accepted
+ * it. */
+struct lobby {
+	int fd;
+	long uid; // Of a peer on a unix socket, or -1
+	size_t len;
+	char buf[sizeof(((struct bufio *)0)->recvbuf)];
+};
+
+/* A client on its way to the loop of the network it picked, with whatever
+ * it sent before it picked one. */
+struct handoff {
+	struct network *net;
+	int fd;
+	size_t len;
+	char buf[sizeof(((struct bufio *)0)->recvbuf)];
+};
+
+/* loop is an event loop thread, which runs any number of networks. */
+struct loop {
+	int id;
+	char name[16];
+	pthread_t thread;
+	struct mca_ev *ev;
+	int wake; // eventfd, written to when there is something for the loop
+
+	// Held by the loop for as long as it is not in poll(2).
+	pthread_mutex_t mu;
+	int locked;
+
+	pthread_mutex_t inboxmu;
+	struct handoff *inbox;
+	size_t inboxlen, inboxcap;
+
+	// Indexed by fd.
+	struct owner *owners;
+	size_t nowners;
+
+	struct lobby *lobby;
+	size_t nlobby, lobbycap;
+
+	int splits; // Networks keeping track of netsplits
+
+	struct stats_loop stats;
+};
+
+extern struct user *users;
+extern struct network *networks;
+extern int nnetworks;
+extern struct loop *loops;
+extern int nloops;
+
+// The network being handled, and the loop of the calling thread.
+extern __thread struct network *net;
+extern __thread struct loop *loop;
+extern __thread struct mca_ev *ev;
+
+struct user *user_add(const char *name, const char *pass);
+
+int network_add(struct user *u, const char *name, const char *address, const char *port,
+	const char *nick);
+struct network *network_find(const char *name);
+void network_share(void);
+struct client *network_attach(struct network *n, int fd);
+int network_accept(struct network *n, int fd, const char *buf, size_t len);
+int network_remove_client(struct network *n, int fd);
+void network_down(struct network *n);
+void network_free(struct network *n);
+
+int loop_init(struct loop *l, int id);
+void loop_free(struct loop *l);
+int loop_own(struct loop *l, int fd, struct network *n, int kind);
+struct owner loop_owner(struct loop *l, int fd);
+int loop_post(struct loop *l, struct network *n, int fd, const char *buf, size_t len);
+void loop_inbox(struct loop *l);
+void loop_wake(struct loop *l);
+void loop_lock(struct loop *l);
+void loop_unlock(struct loop *l);
+void loop_close(int fd);
+
+int lobby_add(int fd, long uid);
+int lobby_readable(int fd);
+void lobby_remove(int fd);
+void lobby_free(struct loop *l);
+#endif
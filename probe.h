@@ -0,0 +1,29 @@
+#ifndef PROBE_H_INC
+#define PROBE_H_INC
+
+/* USDT probes, for bpftrace and perf to hook into a running icbm. Until
+ * something attaches, each is a single nop. They are only compiled in when
+ * <sys/sdt.h> is around (systemtap-sdt-dev on Debian), unless NO_SDT is
+ * defined.
+ *
+ * Every probe is in the icbm provider; see bpftrace/ for what they carry.
+ */
+#if !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define HAVE_SDT
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE1(name, a) DTRACE_PROBE1(icbm, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(icbm, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(icbm, name, a, b, c)
+#else
+// Arguments are still evaluated, so that what is only probed is used.
+#define PROBE1(name, a) ((void)(a))
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#endif
+#endif
@@ -0,0 +1,348 @@
+#define _POSIX_C_SOURCE 200809L
+
+/* replay feeds a capture made with icbm -c back into icbm, playing both the
+ * upstream server and every client.
+ *
+ * Usage: replay [-r] [-s speed] [-p port] [-A address] [-P port] capture
+ *
+ * replay listens on 127.0.0.1:port (6667) for icbm to connect to it as if it
+ * were the server, then connects clients to icbm on address:port
+ * (127.0.0.1:16667) in the order they connected when the capture was made.
+ *
+ * Lines are sent as fast as icbm takes them or, with -r, at the pace they
+ * were captured at, sped up -s times. Everything icbm sends back is read and
+ * thrown away.
+ *
+ * Once the capture runs out, replay pings icbm through the server connection
+ * and stops at the answer, so the time it prints covers icbm handling every
+ * line.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define HIGHWATER (64 << 10)
+#define DONE "replay-done"
+
+struct conn {
+	int fd;
+	int32_t id; // As in the capture
+	int closing, dead;
+
+	char *out;
+	size_t len, cap;
+};
+
+static struct conn *conns;
+static size_t nconns, connscap;
+
+// What icbm sent the server, scanned for the answer to our ping.
+static char upbuf[8192];
+static size_t uplen;
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+die(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+static struct conn *
+conn_find(int32_t id)
+{
+	for (size_t i = 0; i < nconns; ++i)
+		if (conns[i].id == id && !conns[i].dead && !conns[i].closing)
+			return &conns[i];
+	return NULL;
+}
+
+static struct conn *
+conn_add(int fd, int32_t id)
+{
+	if (nconns == connscap) {
+		connscap = connscap ? connscap * 2 : 16;
+		if (!(conns = realloc(conns, sizeof(*conns) * connscap)))
+			die("realloc");
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	memset(&conns[nconns], 0, sizeof(*conns));
+	conns[nconns].fd = fd;
+	conns[nconns].id = id;
+	return &conns[nconns++];
+}
+
+/* queue queues a line to be sent on c, adding "\r\n". */
+static void
+queue(struct conn *c, const char *line, size_t n)
+{
+	if (c->len + n + 2 > c->cap) {
+		while (c->len + n + 2 > c->cap)
+			c->cap = c->cap ? c->cap * 2 : 4096;
+		if (!(c->out = realloc(c->out, c->cap)))
+			die("realloc");
+	}
+
+	memcpy(c->out + c->len, line, n);
+	memcpy(c->out + c->len + n, "\r\n", 2);
+	c->len += n + 2;
+}
+
+static int
+sock(const char *addr, const char *port, int server)
+{
+	struct addrinfo hints = {0}, *res, *p;
+	int fd = -1, yes = 1, rv;
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = server ? AI_PASSIVE : 0;
+
+	if ((rv = getaddrinfo(addr, port, &hints, &res)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		exit(1);
+	}
+
+	for (p = res; p; p = p->ai_next) {
+		if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1)
+			continue;
+
+		if (server) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+			if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 && listen(fd, 1) == 0)
+				break;
+		} else if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* next reads the next record of the capture. 0 is returned at the end. */
+static int
+next(FILE *f, struct capture_rec *rec, char **data, size_t *cap)
+{
+	if (fread(rec, sizeof(*rec), 1, f) != 1)
+		return 0;
+
+	if (rec->len > *cap) {
+		*cap = rec->len;
+		if (!(*data = realloc(*data, *cap)))
+			die("realloc");
+	}
+
+	return fread(*data, 1, rec->len, f) == rec->len;
+}
+
+/* upstream looks through what icbm sent the server for the answer to our
+ * ping. */
+static int
+upstream(char *buf, size_t n)
+{
+	char *nl;
+	int done = 0;
+
+	if (n > sizeof(upbuf) - uplen)
+		n = sizeof(upbuf) - uplen;
+	memcpy(upbuf + uplen, buf, n);
+	uplen += n;
+
+	while ((nl = memchr(upbuf, '\n', uplen))) {
+		*nl = 0;
+		if (strncmp(upbuf, "PONG", 4) == 0 && strstr(upbuf, DONE))
+			done = 1;
+
+		uplen -= nl + 1 - upbuf;
+		memmove(upbuf, nl + 1, uplen);
+	}
+
+	// A line this long is not our answer.
+	if (uplen == sizeof(upbuf))
+		uplen = 0;
+
+	return done;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *port = "6667", *laddress = "127.0.0.1", *lport = "16667";
+	int realtime = 0, opt, lfd, fd, have, done = 0, pinged = 0;
+	double speed = 1, start, t;
+	unsigned long long lines = 0, bytes = 0;
+	struct capture_rec rec;
+	struct pollfd *pfds = NULL;
+	char *data = NULL, magic[8], buf[65536];
+	size_t datacap = 0;
+	FILE *f;
+
+	while ((opt = getopt(argc, argv, "rs:p:A:P:")) != -1) {
+		switch (opt) {
+		case 'r': realtime = 1; break;
+		case 's': speed = atof(optarg); break;
+		case 'p': port = optarg; break;
+		case 'A': laddress = optarg; break;
+		case 'P': lport = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-r] [-s speed] [-p port] [-A address] [-P port] capture\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind >= argc || speed <= 0) {
+		fprintf(stderr, "usage: %s [-r] [-s speed] [-p port] [-A address] [-P port] capture\n", argv[0]);
+		return 1;
+	}
+
+	if (!(f = fopen(argv[optind], "rb")))
+		die(argv[optind]);
+	if (fread(magic, 1, 8, f) != 8 || memcmp(magic, CAPTURE_MAGIC, 8) != 0) {
+		fprintf(stderr, "%s: not a capture\n", argv[optind]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((lfd = sock("127.0.0.1", port, 1)) == -1)
+		die("listen");
+
+	fprintf(stderr, "waiting for icbm on port %s\n", port);
+	if ((fd = accept(lfd, NULL, NULL)) == -1)
+		die("accept");
+	close(lfd);
+
+	conn_add(fd, CAPTURE_SERVER);
+
+	have = next(f, &rec, &data, &datacap);
+	start = now();
+
+	while (!done) {
+		int timeout = -1;
+		size_t n;
+
+		// Feed as much of the capture as we may right now.
+		while (have) {
+			struct conn *c = conn_find(rec.conn);
+
+			if (realtime && (t = start + rec.ns / 1e9 / speed - now()) > 0) {
+				timeout = t * 1000 + 1;
+				break;
+			}
+
+			// Let it drain before giving it more.
+			if (c && c->len > HIGHWATER)
+				break;
+
+			if (rec.type == CAPTURE_OPEN && !c) {
+				if ((fd = sock(laddress, lport, 0)) == -1)
+					die("connect");
+				conn_add(fd, rec.conn);
+			} else if (rec.type == CAPTURE_CLOSE && c) {
+				c->closing = 1;
+			} else if (rec.type == CAPTURE_LINE && c) {
+				queue(c, data, rec.len);
+				lines++;
+				bytes += rec.len + 2;
+			}
+
+			have = next(f, &rec, &data, &datacap);
+		}
+
+		if (!have && !pinged) {
+			queue(&conns[0], "PING :" DONE, strlen("PING :" DONE));
+			pinged = 1;
+		}
+
+		if (!(pfds = realloc(pfds, sizeof(*pfds) * nconns)))
+			die("realloc");
+
+		for (size_t i = 0; i < nconns; ++i) {
+			pfds[i].fd = conns[i].fd;
+			pfds[i].events = POLLIN | (conns[i].len ? POLLOUT : 0);
+			pfds[i].revents = 0;
+		}
+
+		if (poll(pfds, nconns, timeout) == -1 && errno != EINTR)
+			die("poll");
+
+		n = nconns;
+		for (size_t i = 0; i < n; ++i) {
+			struct conn *c = &conns[i];
+			ssize_t r;
+
+			if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				if ((r = read(c->fd, buf, sizeof(buf))) > 0) {
+					if (i == 0)
+						done |= upstream(buf, r);
+				} else if (r == 0 || errno != EAGAIN) {
+					if (i == 0) {
+						fprintf(stderr, "icbm went away\n");
+						return 1;
+					}
+					c->dead = 1;
+				}
+			}
+
+			if (!c->dead && pfds[i].revents & POLLOUT) {
+				if ((r = write(c->fd, c->out, c->len)) > 0) {
+					memmove(c->out, c->out + r, c->len - r);
+					c->len -= r;
+				} else if (r == -1 && errno != EAGAIN)
+					c->dead = 1;
+			}
+
+			if (c->closing && !c->len)
+				c->dead = 1;
+		}
+
+		// Drop whatever went away. The server is never dropped.
+		for (size_t i = 1; i < nconns; ) {
+			if (!conns[i].dead) {
+				++i;
+				continue;
+			}
+
+			close(conns[i].fd);
+			free(conns[i].out);
+			conns[i] = conns[--nconns];
+		}
+	}
+
+	t = now() - start;
+	printf("%llu lines, %llu bytes in %.3f s: %.0f lines/s, %.1f MB/s\n",
+		lines, bytes, t, lines / t, bytes / t / 1e6);
+
+	for (size_t i = 0; i < nconns; ++i) {
+		close(conns[i].fd);
+		free(conns[i].out);
+	}
+	free(conns);
+	free(pfds);
+	free(data);
+	fclose(f);
+	return 0;
+}
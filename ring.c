@@ -0,0 +1,368 @@
+#define _GNU_SOURCE // For memfd_create, struct ucred and SCM_RIGHTS
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "clk.h"
+#include "icbmring.h"
+#include "irc.h"
+#include "log.h"
+#include "mem.h"
+#include "network.h"
+#include "ring.h"
+
+#define RING_CONNS 8
+#define RING_REQSZ 256
+
+/* A consumer asking for a ring. */
+static struct {
+	int fd;
+	long uid;
+	char req[RING_REQSZ];
+	size_t reqlen;
+} conns[RING_CONNS];
+
+int ringfd = -1;
+
+/* ring_new makes a ring for the network called name.
+ *
+ * On error, NULL is returned.
+ */
+struct ring *
+ring_new(const char *name)
+{
+	struct ring *r;
+	char memname[256];
+	void *map;
+
+	if (!(r = mem_calloc(MEM_NETWORKS, 1, sizeof(*r))))
+		return NULL;
+
+	snprintf(memname, sizeof(memname), "icbm-ring:%s", name);
+	if ((r->fd = memfd_create(memname, MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1)
+		goto fail;
+
+	// Consumers may not shrink it out from under us.
+	if (ftruncate(r->fd, ICBM_RING_HDRSZ + RING_SIZE) == -1 ||
+	    fcntl(r->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+		goto fail;
+
+	map = mmap(NULL, ICBM_RING_HDRSZ + RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+	if (map == MAP_FAILED)
+		goto fail;
+
+	r->hdr = map;
+	r->data = (char *)map + ICBM_RING_HDRSZ;
+	r->size = RING_SIZE;
+
+	r->hdr->size = RING_SIZE;
+	r->hdr->version = ICBM_RING_VERSION;
+	__atomic_store_n(&r->hdr->magic, ICBM_RING_MAGIC, __ATOMIC_RELEASE);
+	return r;
+
+fail:
+	if (r->fd != -1)
+		close(r->fd);
+	mem_free(MEM_NETWORKS, r);
+	return NULL;
+}
+
+/* ring_publish writes the line msg was parsed from to r. line holds len
+ * bytes, as irc_parse left them, which is with its separators cut. */
+void
+ring_publish(struct ring *r, const char *line, size_t len, const struct irc_message *msg)
+{
+	struct icbm_ring_rec rec = {0};
+	const char *tok[ICBM_RING_TOKENS] = { msg->tags, msg->source, msg->command };
+	uint64_t pos, skip = 0, size, waiters;
+	char *p;
+
+	for (int i = 0; i < IRC_PARAM_MAX && msg->params[i]; ++i)
+		tok[3 + i] = msg->params[i];
+
+	rec.ntok = 3;
+	while (rec.ntok < ICBM_RING_TOKENS && tok[rec.ntok])
+		rec.ntok++;
+
+	rec.len = len;
+	rec.time = clk_real_ms();
+	size = (sizeof(rec) + rec.ntok * sizeof(rec.tok[0]) + len + 7) & ~7ull;
+	rec.size = size;
+
+	// A record never wraps; the space left at the end is skipped.
+	pos = r->head & (r->size - 1);
+	if (pos + size > r->size)
+		skip = r->size - pos;
+
+	if (len > UINT16_MAX || size + skip > r->size) {
+		r->dropped++;
+		return;
+	}
+
+	// Consumers learn what is about to be written over before it is.
+	__atomic_store_n(&r->hdr->reserve, r->head + skip + size, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	if (skip) {
+		memset(r->data + pos, 0, sizeof(uint32_t));
+		pos = 0;
+	}
+
+	p = r->data + pos;
+	memcpy(p, &rec, sizeof(rec));
+	p += sizeof(rec);
+
+	for (int i = 0; i < rec.ntok; ++i) {
+		uint16_t t[2] = { ICBM_RING_NONE, 0 };
+
+		if (tok[i]) {
+			t[0] = tok[i] - line;
+			t[1] = strlen(tok[i]);
+		}
+		memcpy(p, t, sizeof(t));
+		p += sizeof(t);
+	}
+
+	// irc_parse cut the line up with NULs where the spaces were.
+	for (size_t i = 0; i < len; ++i)
+		p[i] = line[i] ? line[i] : ' ';
+
+	r->head += skip + size;
+	r->published++;
+	__atomic_store_n(&r->hdr->head, r->head, __ATOMIC_SEQ_CST);
+
+	// Only ever a syscall when someone is asleep.
+	waiters = __atomic_load_n(&r->hdr->waiters, __ATOMIC_SEQ_CST);
+	if (waiters) {
+		__atomic_add_fetch(&r->hdr->wake, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &r->hdr->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+	}
+}
+
+/* ring_close tells consumers of r that nothing more is coming. */
+void
+ring_close(struct ring *r)
+{
+	if (!r)
+		return;
+
+	__atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&r->hdr->wake, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &r->hdr->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* ring_free closes r, and frees it. Consumers keep their mapping. */
+void
+ring_free(struct ring *r)
+{
+	if (!r)
+		return;
+
+	ring_close(r);
+	munmap(r->hdr, ICBM_RING_HDRSZ + r->size);
+	close(r->fd);
+	mem_free(MEM_NETWORKS, r);
+}
+
+/* ring_adopt hands rings out on fd, a unix socket already listening. */
+void
+ring_adopt(int fd)
+{
+	for (int i = 0; i < RING_CONNS; ++i)
+		conns[i].fd = -1;
+
+	ringfd = fd;
+}
+
+/* ring_listen hands rings out on the unix socket at path, or in the abstract
+ * namespace if it starts with '@'.
+ *
+ * On error, -1 is returned.
+ */
+int
+ring_listen(const char *path)
+{
+	struct sockaddr_un sun = {0};
+	socklen_t len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, path);
+	if (*path == '@')
+		sun.sun_path[0] = 0;
+	else
+		unlink(path);
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+
+	if (bind(fd, (struct sockaddr *)&sun, *path == '@' ? len : sizeof(sun)) == -1 ||
+	    listen(fd, RING_CONNS) == -1) {
+		close(fd);
+		return -1;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK); // Set non-blocking
+	ring_adopt(fd);
+	return fd;
+}
+
+static int
+slot(int fd)
+{
+	for (int i = 0; i < RING_CONNS; ++i)
+		if (conns[i].fd == fd)
+			return i;
+	return -1;
+}
+
+/* ring_owns reports whether fd is a consumer asking for a ring. */
+int
+ring_owns(int fd)
+{
+	return fd != -1 && slot(fd) != -1;
+}
+
+/* ring_accept takes a new consumer, if there is room for it. */
+void
+ring_accept(void)
+{
+	struct ucred cred;
+	socklen_t credlen = sizeof(cred);
+	int fd, i;
+
+	if ((fd = accept(ringfd, NULL, NULL)) == -1)
+		return;
+
+	if ((i = slot(-1)) == -1 || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1) {
+		close(fd);
+		return;
+	}
+
+	fcntl(fd, F_SETFL, O_NONBLOCK); // Set non-blocking
+
+	conns[i].fd = fd;
+	conns[i].uid = cred.uid;
+	conns[i].reqlen = 0;
+	mca_ev_append(ev, fd, MCA_EV_READ);
+}
+
+/* grant gives the consumer in slot i the ring of n, making it first if it
+ * has to. */
+static int
+grant(int i, struct network *n)
+{
+	static const char denied[] = "ERR access\n", failed[] = "ERR failed\n";
+	char ok[64], ctl[CMSG_SPACE(sizeof(int))] = {0};
+	struct iovec iov;
+	struct msghdr msg = {0};
+	struct cmsghdr *cm;
+	long uid = conns[i].uid;
+
+	// The owner's, and root's, or the user's own.
+	if (uid != geteuid() && uid != 0 && !(n->user && n->user->uid == uid)) {
+		infof("ring: uid %ld may not have %s", uid, n->name);
+		return write(conns[i].fd, denied, sizeof(denied) - 1);
+	}
+
+	// The network's loop publishes to it, so it has to hold still.
+	if (!n->ring) {
+		if (n->loop != loop)
+			pthread_mutex_lock(&n->loop->mu);
+		n->ring = ring_new(n->name);
+		if (n->loop != loop)
+			pthread_mutex_unlock(&n->loop->mu);
+
+		if (!n->ring) {
+			warnf("ring: failed to make one for %s: %s", n->name, strerror(errno));
+			return write(conns[i].fd, failed, sizeof(failed) - 1);
+		}
+
+		infof("ring: publishing %s", n->name);
+	}
+
+	iov.iov_base = ok;
+	iov.iov_len = snprintf(ok, sizeof(ok), "OK %llu\n", (unsigned long long)n->ring->size);
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof(ctl);
+
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &n->ring->fd, sizeof(int));
+
+	return sendmsg(conns[i].fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+/* ring_readable reads which network a consumer wants, and answers once it
+ * knows, with the ring's fd if it may have it. */
+int
+ring_readable(int fd)
+{
+	static const char unknown[] = "ERR unknown network\n";
+	struct network *n;
+	char *nl;
+	int i = slot(fd), r;
+
+	if (i == -1)
+		return 0;
+
+	r = read(fd, conns[i].req + conns[i].reqlen, sizeof(conns[i].req) - 1 - conns[i].reqlen);
+	if (r == -1 && errno == EAGAIN)
+		return 0;
+	if (r <= 0) {
+		loop_close(fd);
+		return 0;
+	}
+
+	conns[i].reqlen += r;
+	conns[i].req[conns[i].reqlen] = 0;
+
+	if (!(nl = strchr(conns[i].req, '\n'))) {
+		if (conns[i].reqlen == sizeof(conns[i].req) - 1)
+			loop_close(fd);
+		return 0;
+	}
+
+	*nl = 0;
+	conns[i].req[strcspn(conns[i].req, "\r")] = 0;
+
+	if ((n = network_find(conns[i].req)))
+		grant(i, n);
+	else
+		write(fd, unknown, sizeof(unknown) - 1);
+
+	// The event loop calls ring_remove, then closes it.
+	loop_close(fd);
+	return 0;
+}
+
+/* ring_remove frees the slot of a consumer once the event loop has let go of
+ * it. */
+void
+ring_remove(int fd)
+{
+	int i = slot(fd);
+
+	if (i != -1)
+		conns[i].fd = -1;
+}
@@ -0,0 +1,39 @@
+#ifndef RING_H_INC
+#define RING_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+// Bytes of records in each ring; a power of two.
+#ifndef RING_SIZE
+#define RING_SIZE (4 << 20)
+#endif
+
+struct irc_message;
+struct network;
+
+/* The producer's side of a network's ring; see icbmring.h. Only the loop of
+ * the network publishes to it. */
+struct ring {
+	int fd; // memfd, handed to consumers
+	struct icbm_ring_hdr *hdr;
+	char *data;
+	uint64_t size;
+	uint64_t head; // Kept here, as consumers may write to the header
+	uint64_t published, dropped;
+};
+
+/* The socket consumers ask for rings on, or -1 if there is none. */
+extern int ringfd;
+
+struct ring *ring_new(const char *name);
+void ring_publish(struct ring *r, const char *line, size_t len, const struct irc_message *msg);
+void ring_close(struct ring *r);
+void ring_free(struct ring *r);
+
+int ring_listen(const char *path);
+void ring_adopt(int fd);
+int ring_owns(int fd);
+void ring_accept(void);
+int ring_readable(int fd);
+void ring_remove(int fd);
+#endif
@@ -0,0 +1,86 @@
+#define _POSIX_C_SOURCE 200809L
+
+/* ringcat prints what icbm publishes to a network's ring, as an example of,
+ * and a test for, reading one with icbmring.
+ *
+ * Usage: ringcat [-t] [-n count] socket network
+ *
+ * socket is what icbm was given with -R. Each line is printed as it was
+ * received from the server; with -t, it is followed by its tokens, one per
+ * line, as icbm parsed them. ringcat stops after count lines, or when icbm
+ * stops publishing, and says how many bytes it missed by falling behind.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "icbmring.h"
+
+static const char *names[] = { "tags", "source", "command" };
+
+int
+main(int argc, char *argv[])
+{
+	static _Alignas(8) char buf[ICBM_RING_RECMAX];
+	struct icbm_ring r;
+	long count = -1, seen = 0;
+	int opt, tokens = 0, fd;
+
+	while ((opt = getopt(argc, argv, "tn:")) != -1) {
+		switch (opt) {
+		case 't': tokens = 1; break;
+		case 'n': count = strtol(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-t] [-n count] socket network\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (argc - optind != 2) {
+		fprintf(stderr, "usage: %s [-t] [-n count] socket network\n", argv[0]);
+		return 1;
+	}
+
+	if ((fd = icbm_ring_connect(argv[optind], argv[optind + 1])) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[optind + 1], strerror(errno));
+		return 1;
+	}
+
+	if (icbm_ring_map(&r, fd) == -1) {
+		fprintf(stderr, "map: %s\n", strerror(errno));
+		return 1;
+	}
+	close(fd);
+
+	while (count == -1 || seen < count) {
+		const struct icbm_ring_rec *rec = (void *)buf;
+		const char *line;
+
+		if (!icbm_ring_read(&r, buf, sizeof(buf))) {
+			fflush(stdout);
+			if (icbm_ring_wait(&r, -1) == -1)
+				break;
+			continue;
+		}
+
+		line = icbm_ring_line(rec);
+		printf("%lld %.*s\n", (long long)rec->time, (int)rec->len, line);
+		seen++;
+
+		for (int i = 0; tokens && i < rec->ntok; ++i) {
+			if (rec->tok[i].off == ICBM_RING_NONE)
+				continue;
+
+			printf("\t%s\t%.*s\n", i < 3 ? names[i] : "param", (int)rec->tok[i].len,
+				line + rec->tok[i].off);
+		}
+	}
+
+	fflush(stdout);
+	fprintf(stderr, "%ld lines, %llu bytes lost\n", seen, (unsigned long long)r.lost);
+	icbm_ring_unmap(&r);
+	return 0;
+}
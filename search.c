@@ -0,0 +1,444 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mem.h"
+#include "search.h"
+
+#define SEARCH_MAGIC "ICBMIDX1"
+#define SEARCH_INIT_SIZE 1024
+#define SEARCH_QUERY_MAX 64
+
+/* On disk, a sealed index looks like this (all integers are native endian
+ * uint32s, since the index never leaves the machine that wrote it):
+ *
+ *	magic[8] count pad
+ *	count * { key len off }   sorted by key
+ *	postings                  off and len are in units of uint32
+ */
+struct search_entry {
+	uint32_t key, len, off;
+};
+
+static uint32_t
+trigram(const char *s)
+{
+	return (uint32_t)tolower((unsigned char)s[0]) << 16 |
+		(uint32_t)tolower((unsigned char)s[1]) << 8 |
+		(uint32_t)tolower((unsigned char)s[2]);
+}
+
+static size_t
+slot(uint32_t key, size_t cap)
+{
+	return (key * 2654435761u) & (cap - 1);
+}
+
+static int
+grow(struct search_index *idx)
+{
+	size_t cap = idx->cap ? idx->cap * 2 : SEARCH_INIT_SIZE;
+	uint32_t *keys;
+	struct search_posting *posts;
+
+	if (!(keys = mem_calloc(MEM_HISTORY, cap, sizeof(*keys))))
+		return -1;
+	if (!(posts = mem_calloc(MEM_HISTORY, cap, sizeof(*posts)))) {
+		mem_free(MEM_HISTORY, keys);
+		return -1;
+	}
+
+	// Rehash everything that we already have.
+	for (size_t i = 0; i < idx->cap; ++i) {
+		if (!idx->keys[i])
+			continue;
+
+		size_t j = slot(idx->keys[i], cap);
+		while (keys[j])
+			j = (j + 1) & (cap - 1);
+
+		keys[j] = idx->keys[i];
+		posts[j] = idx->posts[i];
+	}
+
+	mem_free(MEM_HISTORY, idx->keys);
+	mem_free(MEM_HISTORY, idx->posts);
+	idx->keys = keys;
+	idx->posts = posts;
+	idx->cap = cap;
+	return 0;
+}
+
+static struct search_posting *
+get(struct search_index *idx, uint32_t key)
+{
+	size_t i;
+
+	// Keep the load factor under 3/4.
+	if ((idx->len + 1) * 4 > idx->cap * 3 && grow(idx) == -1)
+		return NULL;
+
+	for (i = slot(key, idx->cap); idx->keys[i]; i = (i + 1) & (idx->cap - 1))
+		if (idx->keys[i] == key)
+			return &idx->posts[i];
+
+	idx->keys[i] = key;
+	idx->len++;
+	return &idx->posts[i];
+}
+
+/* lookup finds the posting list for key in either kind of index. */
+static size_t
+lookup(struct search_index *idx, uint32_t key, const uint32_t **out)
+{
+	if (idx->map) {
+		uint32_t count;
+		const struct search_entry *ents;
+		size_t lo = 0, hi;
+
+		memcpy(&count, idx->map + 8, sizeof(count));
+		ents = (const struct search_entry *)(idx->map + 16);
+		hi = count;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (ents[mid].key == key) {
+				*out = (const uint32_t *)(ents + count) + ents[mid].off;
+				return ents[mid].len;
+			} else if (ents[mid].key < key)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		return 0;
+	}
+
+	if (!idx->cap)
+		return 0;
+
+	for (size_t i = slot(key, idx->cap); idx->keys[i]; i = (i + 1) & (idx->cap - 1)) {
+		if (idx->keys[i] == key) {
+			*out = idx->posts[i].data;
+			return idx->posts[i].len;
+		}
+	}
+
+	return 0;
+}
+
+/* search_add adds every trigram of text to the index under the record id.
+ *
+ * Ids must be added in ascending order; posting lists are kept sorted by
+ * virtue of this.
+ *
+ * On error, -1 is returned.
+ */
+int
+search_add(struct search_index *idx, uint32_t id, const char *text, size_t n)
+{
+	struct search_posting *p;
+
+	if (idx->map)
+		return -1;
+
+	for (size_t i = 0; i + 3 <= n; ++i) {
+		if (!(p = get(idx, trigram(text + i))))
+			return -1;
+
+		// The same trigram may appear several times in one record.
+		if (p->len && p->data[p->len - 1] == id)
+			continue;
+
+		if (p->len == p->cap) {
+			size_t cap = p->cap ? p->cap * 2 : 4;
+			uint32_t *data;
+
+			if (!(data = mem_realloc(MEM_HISTORY, p->data, sizeof(*data) * cap)))
+				return -1;
+
+			p->data = data;
+			p->cap = cap;
+		}
+
+		p->data[p->len++] = id;
+	}
+
+	return 0;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct search_entry *x = a, *y = b;
+	return (x->key > y->key) - (x->key < y->key);
+}
+
+/* search_write writes a live index out to path so that it may be loaded back
+ * later with search_load.
+ *
+ * The file is written under a temporary name and renamed into place, so a
+ * half-written index is never picked up.
+ *
+ * On error, -1 is returned and errno is set.
+ */
+int
+search_write(struct search_index *idx, const char *path)
+{
+	char tmp[4096];
+	struct search_entry *ents;
+	uint32_t hdr[2] = { idx->len, 0 };
+	uint32_t off = 0;
+	size_t n = 0;
+	FILE *f;
+
+	if (!(ents = mem_malloc(MEM_HISTORY, sizeof(*ents) * (idx->len ? idx->len : 1))))
+		return -1;
+
+	for (size_t i = 0; i < idx->cap; ++i) {
+		if (!idx->keys[i])
+			continue;
+
+		ents[n].key = idx->keys[i];
+		ents[n].len = idx->posts[i].len;
+		n++;
+	}
+	qsort(ents, n, sizeof(*ents), entry_cmp);
+
+	for (size_t i = 0; i < n; ++i) {
+		ents[i].off = off;
+		off += ents[i].len;
+	}
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(f = fopen(tmp, "wb"))) {
+		mem_free(MEM_HISTORY, ents);
+		return -1;
+	}
+
+	fwrite(SEARCH_MAGIC, 1, 8, f);
+	fwrite(hdr, sizeof(*hdr), 2, f);
+	fwrite(ents, sizeof(*ents), n, f);
+
+	for (size_t i = 0; i < n; ++i) {
+		const uint32_t *p;
+		size_t len = lookup(idx, ents[i].key, &p);
+		fwrite(p, sizeof(*p), len, f);
+	}
+
+	mem_free(MEM_HISTORY, ents);
+
+	if (ferror(f) | fclose(f)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return rename(tmp, path);
+}
+
+/* search_load maps a sealed index written by search_write, once it has
+ * checked that it is whole.
+ *
+ * On error, -1 is returned and errno is set.
+ */
+int
+search_load(struct search_index *idx, const char *path)
+{
+	const struct search_entry *ents;
+	struct stat st;
+	uint32_t count;
+	size_t npost;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+
+	if (fstat(fd, &st) == -1 || st.st_size < 16) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	memcpy(&count, (char *)map + 8, sizeof(count));
+	if (memcmp(map, SEARCH_MAGIC, 8) != 0 ||
+	    16 + (size_t)count * sizeof(struct search_entry) > (size_t)st.st_size)
+		goto bad;
+
+	// Every posting list has to be in the file, or lookups would read
+	// past the end of it.
+	ents = (const struct search_entry *)((char *)map + 16);
+	npost = ((size_t)st.st_size - 16 - (size_t)count * sizeof(*ents)) / sizeof(uint32_t);
+	for (uint32_t i = 0; i < count; ++i)
+		if (ents[i].off > npost || ents[i].len > npost - ents[i].off)
+			goto bad;
+
+	search_free(idx);
+	idx->map = map;
+	idx->mapsz = st.st_size;
+	return 0;
+
+bad:
+	munmap(map, st.st_size);
+	errno = EINVAL;
+	return -1;
+}
+
+/* search_free releases all memory held by the index. */
+void
+search_free(struct search_index *idx)
+{
+	for (size_t i = 0; i < idx->cap; ++i)
+		mem_free(MEM_HISTORY, idx->posts[i].data);
+	mem_free(MEM_HISTORY, idx->keys);
+	mem_free(MEM_HISTORY, idx->posts);
+
+	if (idx->map)
+		munmap((void *)idx->map, idx->mapsz);
+
+	memset(idx, 0, sizeof(*idx));
+}
+
+/* search_bytes returns the amount of memory the index is using, counting
+ * mapped sealed indexes at their full size. */
+size_t
+search_bytes(struct search_index *idx)
+{
+	size_t n = idx->mapsz;
+
+	n += idx->cap * (sizeof(*idx->keys) + sizeof(*idx->posts));
+	for (size_t i = 0; i < idx->cap; ++i)
+		n += idx->posts[i].cap * sizeof(uint32_t);
+
+	return n;
+}
+
+/* seek returns the first position in p at or after lo that is not less than
+ * id, galloping forward before falling back to a binary search. */
+static size_t
+seek(const uint32_t *p, size_t lo, size_t n, uint32_t id)
+{
+	size_t step = 1, hi;
+
+	while (lo + step < n && p[lo + step] < id) {
+		lo += step;
+		step *= 2;
+	}
+
+	hi = lo + step < n ? lo + step + 1 : n;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (p[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* search_query finds every record id that contains all the trigrams in q.
+ *
+ * The candidates are stored in a newly allocated array at *out, in ascending
+ * order, which the caller frees with mem_free(MEM_HISTORY, ...). Candidates are not guaranteed to
+ * contain q as a substring, so check them with search_match.
+ *
+ * The number of candidates is returned. If q is shorter than a trigram or an
+ * allocation fails, -1 is returned.
+ */
+int
+search_query(struct search_index *idx, const char *q, uint32_t **out)
+{
+	const uint32_t *lists[SEARCH_QUERY_MAX];
+	size_t lens[SEARCH_QUERY_MAX];
+	size_t nlists = 0, qlen = strlen(q), n;
+	uint32_t *res;
+
+	if (qlen < 3)
+		return -1;
+
+	for (size_t i = 0; i + 3 <= qlen && nlists < SEARCH_QUERY_MAX; ++i) {
+		const uint32_t *p = NULL;
+		size_t len = lookup(idx, trigram(q + i), &p), j;
+
+		if (!len) {
+			*out = NULL;
+			return 0;
+		}
+
+		// Duplicate trigrams would only cost us time.
+		for (j = 0; j < nlists; ++j)
+			if (lists[j] == p)
+				break;
+		if (j < nlists)
+			continue;
+
+		// Insertion sort, shortest list first.
+		for (j = nlists++; j > 0 && lens[j - 1] > len; --j) {
+			lists[j] = lists[j - 1];
+			lens[j] = lens[j - 1];
+		}
+		lists[j] = p;
+		lens[j] = len;
+	}
+
+	if (!(res = mem_malloc(MEM_HISTORY, sizeof(*res) * lens[0])))
+		return -1;
+
+	memcpy(res, lists[0], sizeof(*res) * lens[0]);
+	n = lens[0];
+
+	// Intersect the shortest list with every other list in turn.
+	for (size_t l = 1; l < nlists && n; ++l) {
+		size_t pos = 0, m = 0;
+
+		for (size_t i = 0; i < n; ++i) {
+			pos = seek(lists[l], pos, lens[l], res[i]);
+			if (pos == lens[l])
+				break;
+			if (lists[l][pos] == res[i])
+				res[m++] = res[i];
+		}
+
+		n = m;
+	}
+
+	*out = res;
+	return n;
+}
+
+/* search_match reports whether q appears in the first n bytes of hay,
+ * ignoring ASCII case. */
+int
+search_match(const char *hay, size_t n, const char *q)
+{
+	size_t qlen = strlen(q);
+
+	for (size_t i = 0; i + qlen <= n; ++i) {
+		size_t j;
+
+		for (j = 0; j < qlen; ++j)
+			if (tolower((unsigned char)hay[i + j]) != tolower((unsigned char)q[j]))
+				break;
+
+		if (j == qlen)
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef SEARCH_H_INC
+#define SEARCH_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+/* A list of record ids, always sorted in ascending order. */
+struct search_posting {
+	uint32_t *data;
+	size_t len, cap;
+};
+
+/* search_index is a trigram index over the records of one history segment.
+ *
+ * While the segment is being written to, the index lives in memory and grows
+ * with every record. Once the segment is sealed the index is written out and
+ * mapped back in read-only.
+ */
+struct search_index {
+	// Live index; an open addressed table keyed by trigram.
+	uint32_t *keys;
+	struct search_posting *posts;
+	size_t len, cap;
+
+	// Sealed index, see search_write for the layout.
+	const unsigned char *map;
+	size_t mapsz;
+};
+
+int search_add(struct search_index *idx, uint32_t id, const char *text, size_t n);
+int search_write(struct search_index *idx, const char *path);
+int search_load(struct search_index *idx, const char *path);
+void search_free(struct search_index *idx);
+size_t search_bytes(struct search_index *idx);
+
+int search_query(struct search_index *idx, const char *q, uint32_t **out);
+int search_match(const char *hay, size_t n, const char *q);
+#endif
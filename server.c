@@ -8,19 +8,27 @@
 #include <unistd.h>
 
 #include "bufio.h"
+#include "cap.h"
+#include "capture.h"
 #include "client.h"
 #include "ev.h"
+#include "history.h"
+#include "intern.h"
 #include "irc.h"
 #include "log.h"
-#include "main.h"
+#include "mem.h"
+#include "network.h"
+#include "probe.h"
+#include "ring.h"
 #include "server.h"
+#include "snapshot.h"
+#include "split.h"
+#include "stats.h"
+#include "trace.h"
 #include "vec.h"
+#include "worker.h"
 
-static struct bufio server_bufio = {0};
-
-// Initialized by main
-struct mca_vector server_isupport = {0};
-
+static int srv_cap(struct irc_message *msg);
 static int srv_error(struct irc_message *msg);
 static int srv_isupport(struct irc_message *msg);
 static int srv_ping(struct irc_message *msg);
@@ -30,40 +38,117 @@ static struct {
 	int (*f)(struct irc_message *msg);
 } server_dispatch[] = {
 	{ "005",	srv_isupport },
+	{ "CAP",	srv_cap },
 
 	{ "ERROR",	srv_error },
 	{ "PING",	srv_ping },
 	{ "PONG",	srv_ping },
 };
 
-static void
-server_client_forward(struct irc_message *msg)
+/* server_dispatch_find returns the index of the handler for command in
+ * server_dispatch, or -1 if the message should be passed on to clients. */
+int
+server_dispatch_find(const char *command)
 {
-	// Write the message to a buffer first
-	char buf[2048];
-	int n;
-
-	if ((n = irc_string(msg, buf, sizeof(buf))) == -1)
-		return;
+	for (size_t i = 0; i < sizeof(server_dispatch)/sizeof(*server_dispatch); ++i)
+		if (strcmp(server_dispatch[i].command, command) == 0)
+			return i;
+	return -1;
+}
 
-	// Tell the event loop we want to write out
-	mca_ev_set_write(ev, ircfd, 1);
+/* render serializes msg as it should be seen by clients with caps. */
+static int
+render(struct irc_message *msg, int caps, char *buf, size_t sz)
+{
+	struct irc_message out = *msg;
+	char tags[4096];
+	int n;
 
-	// Chuck stuff onto the buffer
-	debugf("* >> %s", buf);
+	out.tags = cap_tags(caps, msg->tags, tags, sizeof(tags)) ? tags : NULL;
 
-	n += snprintf(buf+n, sizeof(buf)-n, "\r\n");
+	if ((n = irc_string(&out, buf, sz)) == -1 || n + 2 >= sz)
+		return -1;
 
 	// TODO: Handle overfull scenarios gracefully. *printf ALWAYS returns
 	// what it would have written.
+	return n + snprintf(buf+n, sz-n, "\r\n");
+}
+
+/* server_client_forward passes msg on to every registered client, but those
+ * with any of the capabilities in skip. */
+void
+server_client_forward(struct irc_message *msg, int skip)
+{
+	// Clients are grouped by what they negotiated, and the message is
+	// written out once for each group that is actually around.
+	static __thread char bufs[CAP_VARIANTS][4608];
+	int lens[CAP_VARIANTS];
+	struct iobuf *shared[CAP_VARIANTS] = {0}; // For clients with I/O workers
+	int batch = strcmp(msg->command, "BATCH") == 0;
+	uint64_t t = TRACE_BEGIN();
+	int sent = 0;
+
+	for (int i = 0; i < CAP_VARIANTS; ++i)
+		lens[i] = 0;
+
+	debugf("* >> %s%s%s :%s %s", msg->tags ? "@" : "", msg->tags ? msg->tags : "",
+		msg->tags ? " " : "", msg->source ? msg->source : "", msg->command);
 
 	// Send to all clients
-	// TODO: Only those whom are authenticated
-	for (int i = 0; i < clientptr; ++i) {
-		// TODO: This should be a client_... function.
-		mca_ev_set_write(ev, clients[i].fd, 1);
-		bufio_write(&clients[i].b, buf, n);
+	for (int i = 0; i < net->clientptr; ++i) {
+		int caps = net->clients[i].caps & CAP_ALL;
+
+		if (!net->clients[i].registered || (batch && !(caps & CAP_BATCH)) ||
+		    net->clients[i].caps & skip)
+			continue;
+
+		if (!lens[caps])
+			lens[caps] = render(msg, caps, bufs[caps], sizeof(bufs[caps]));
+
+		if (lens[caps] <= 0)
+			continue;
+
+		if (net->clients[i].io) {
+			if (!shared[caps])
+				shared[caps] = iobuf_new(bufs[caps], lens[caps]);
+			if (client_put(&net->clients[i], shared[caps]) != -1)
+				sent++;
+		} else if (client_write(&net->clients[i], bufs[caps], lens[caps]) != -1) {
+			sent++;
+		}
 	}
+
+	for (int i = 0; i < CAP_VARIANTS; ++i)
+		iobuf_put(shared[i]);
+
+	net->stats.forwarded += sent;
+	PROBE2(forward, msg->command, sent);
+
+	TRACE_END("forward", net->clientptr, t);
+}
+
+/* server_write queues n bytes of buf to be sent to the server. buf must
+ * already end in "\r\n".
+ *
+ * The number of bytes written to the send buffer is returned, or -1 upon
+ * failure.
+ */
+static int
+server_write(char *buf, int n)
+{
+	int r;
+
+	// Tell the event loop we want to write out
+	mca_ev_set_write(ev, net->ircfd, 1);
+
+	r = bufio_write(&net->bufio, buf, n);
+	stats_out(&net->stats.server, n, net->bufio.sendptr, r != -1);
+
+	if (r == -1)
+		PROBE3(drop, net->ircfd, n, net->bufio.sendptr);
+	else
+		PROBE3(enqueue, net->ircfd, n, net->bufio.sendptr);
+	return r;
 }
 
 /* server_sendf sends a formatted response (ideally like IRC) to the server
@@ -77,9 +162,6 @@ server_sendf(const char *fmt, ...)
 {
 	char buf[2048];
 
-	// Tell the event loop we want to write out
-	mca_ev_set_write(ev, ircfd, 1);
-
 	// Chuck stuff onto the buffer
 	va_list ap;
 
@@ -94,7 +176,7 @@ server_sendf(const char *fmt, ...)
 	// TODO: Handle overfull scenarios gracefully. *printf ALWAYS returns
 	// what it would have written.
 
-	return bufio_write(&server_bufio, buf, n);
+	return server_write(buf, n);
 }
 
 /* server_sendmsg sends an IRC message to the server.
@@ -108,12 +190,13 @@ server_sendmsg(struct irc_message *msg)
 	char buf[2048];
 	int n;
 
+	// Don't send tags to a server that doesn't know what they are.
+	if (!(net->caps & CAP_MESSAGE_TAGS))
+		msg->tags = NULL;
+
 	if ((n = irc_string(msg, buf, sizeof(buf))) == -1)
 		return -1;
 
-	// Tell the event loop we want to write out
-	mca_ev_set_write(ev, ircfd, 1);
-
 	// Chuck stuff onto the buffer
 	debugf("server >> %s", buf);
 
@@ -122,41 +205,64 @@ server_sendmsg(struct irc_message *msg)
 	// TODO: Handle overfull scenarios gracefully. *printf ALWAYS returns
 	// what it would have written.
 
-	return bufio_write(&server_bufio, buf, n);
+	return server_write(buf, n);
 }
 
 int
 server_readable(void)
 {
-	int n;
+	int n, i;
+	uint64_t t;
+	size_t len;
 
-	if ((n = bufio_readable(&server_bufio, ircfd)) == -1) {
-		warnf("failed reading from server: %s", strerror(errno));
-		close(ircfd);
+	if ((n = bufio_readable(&net->bufio, net->ircfd)) == -1) {
+		warnf("%s: failed reading from server: %s", net->name, strerror(errno));
+		loop_close(net->ircfd);
 		return 0;
 	}
 
 	if (!n) // Partial read
 		return 0;
 
-	debugf("server << %s", server_bufio.recvbuf);
+	debugf("server << %s", net->bufio.recvbuf);
+	t = stats_now();
+	PROBE3(receive, net->ircfd, net->bufio.recvbuf, n);
+	stats_in(&net->stats.server, n);
+	len = strlen(net->bufio.recvbuf);
+	capture_line(CAPTURE_SERVER, net->bufio.recvbuf, len);
 
 	// Parse message
 	struct irc_message msg = {0};
 
-	if (irc_parse(server_bufio.recvbuf, &msg)) {
-		warnf("Failed to parse IRC message from server. Disconnecting.");
-		close(ircfd);
+	if (irc_parse(net->bufio.recvbuf, &msg)) {
+		warnf("%s: failed to parse IRC message from server. Disconnecting.", net->name);
+		loop_close(net->ircfd);
 		return 0;
 	}
+	PROBE2(parse, net->ircfd, msg.command);
+
+	// Anything sent to clients from here on is timed from now.
+	net->stats.rx = t;
 
 	// Try to hit a recognized command.
-	for (size_t i = 0; i < sizeof(server_dispatch)/sizeof(*server_dispatch); ++i)
-		if (strcmp(server_dispatch[i].command, msg.command) == 0)
-			return server_dispatch[i].f(&msg);
+	if ((i = server_dispatch_find(msg.command)) != -1) {
+		uint64_t tr = TRACE_BEGIN();
+
+		PROBE2(dispatch, net->ircfd, msg.command);
+		n = server_dispatch[i].f(&msg);
+		TRACE_END("dispatch", net->ircfd, tr);
+		net->stats.rx = 0;
+		return n;
+	}
 
-	// Fallthrough case: pass it onto everyone.
-	server_client_forward(&msg);
+	// Fallthrough case: pass it onto everyone, local consumers first.
+	if (net->ring)
+		ring_publish(net->ring, net->bufio.recvbuf, len, &msg);
+	history_log(&net->history, &msg, NULL);
+	if (!split_forward(&msg))
+		server_client_forward(&msg, 0);
+	stats_histo_add(&net->stats.forward, stats_now() - t);
+	net->stats.rx = 0;
 
 	return 1;
 }
@@ -164,14 +270,18 @@ server_readable(void)
 void
 server_writable(void)
 {
-	int n = bufio_writable(&server_bufio, ircfd);
+	int queued = net->bufio.sendptr;
+	int n = bufio_writable(&net->bufio, net->ircfd);
+
+	if (n != -1)
+		PROBE3(write, net->ircfd, queued - net->bufio.sendptr, net->bufio.sendptr);
 
 	if (n > 0) { // No more data
 		// Tell the event loop we no longer want to write out
-		mca_ev_set_write(ev, ircfd, 0);
+		mca_ev_set_write(ev, net->ircfd, 0);
 	} else if (n == -1) {
-		warnf("Server write failed: %s", strerror(errno));
-		close(ircfd);
+		warnf("%s: server write failed: %s", net->name, strerror(errno));
+		loop_close(net->ircfd);
 	}
 }
 
@@ -179,8 +289,8 @@ server_writable(void)
 static size_t
 isupport_key(char *key)
 {
-	for (size_t i = 0; i < server_isupport.len; ++i)
-		if (strcmp(server_isupport.data[i], key) == 0)
+	for (size_t i = 0; i < net->isupport.len; ++i)
+		if (strcmp(net->isupport.data[i], key) == 0)
 			return i;
 	return -1;
 }
@@ -189,25 +299,92 @@ isupport_key(char *key)
  * The following section is all command related
  */
 
+/* cap_end finishes capability negotiation with the server, once. */
+static void
+cap_end(void)
+{
+	if (net->capend)
+		return;
+
+	net->capend = 1;
+	server_sendf("CAP END");
+}
+
+int
+srv_cap(struct irc_message *msg)
+{
+	char *sub = msg->params[1], *list, *tok, *save;
+	char buf[512];
+	int more;
+
+	if (!sub)
+		return 1;
+
+	if (strcmp(sub, "LS") == 0) {
+		// "CAP * LS * :..." means that more is on the way.
+		more = msg->params[2] && strcmp(msg->params[2], "*") == 0 && msg->params[3];
+		list = more ? msg->params[3] : msg->params[2];
+
+		snprintf(buf, sizeof(buf), "%s", list ? list : "");
+		for (tok = strtok_r(buf, " ", &save); tok; tok = strtok_r(NULL, " ", &save))
+			net->capwant |= cap_find(tok) & CAP_ALL;
+
+		if (more)
+			return 1;
+
+		if (!net->capwant) {
+			cap_end();
+			return 1;
+		}
+
+		cap_list(net->capwant, buf, sizeof(buf));
+		server_sendf("CAP REQ :%s", buf);
+	} else if (strcmp(sub, "ACK") == 0) {
+		snprintf(buf, sizeof(buf), "%s", msg->params[2] ? msg->params[2] : "");
+		for (tok = strtok_r(buf, " ", &save); tok; tok = strtok_r(NULL, " ", &save)) {
+			if (*tok == '-')
+				net->caps &= ~cap_find(tok + 1);
+			else
+				net->caps |= cap_find(tok);
+		}
+
+		debugf("Server capabilities: %d", net->caps);
+		cap_end();
+	} else if (strcmp(sub, "NAK") == 0) {
+		cap_end();
+	}
+
+	return 1;
+}
+
 int
 srv_error(struct irc_message *msg)
 {
-	errorf("Server error: %s", msg->params[0]); 
-	close(ircfd);
+	errorf("%s: server error: %s", net->name, msg->params[0]);
 
-	// Pass it onto everyone.
-	server_client_forward(msg);
+	// Pass it onto everyone, before they are let go of with the server.
+	server_client_forward(msg, 0);
+	loop_close(net->ircfd);
 	return 0;
 }
 
 int
 srv_isupport(struct irc_message *msg)
 {
+	// What the server says now replaces what it said before the restart.
+	if (net->warm) {
+		for (size_t i = 0; i < net->isupport.len; ++i)
+			mem_free(MEM_ISUPPORT, net->isupport.data[i]);
+		net->isupport.len = 0;
+		net->warm = 0;
+		intern_set_casemap(net->names, CASEMAP_RFC1459);
+	}
+
 	for (size_t i = 1; i < IRC_PARAM_MAX; ++i) {
 		if (!msg->params[i] || strchr(msg->params[i], ' '))
 			break;
 
-		char *v = strdup(msg->params[i]);
+		char *v = mem_strdup(MEM_ISUPPORT, msg->params[i]);
 
 		// Mangles this paramater, but leaves us the key
 		char *eq = strchr(v, '=');
@@ -216,17 +393,28 @@ srv_isupport(struct irc_message *msg)
 
 		size_t j = isupport_key(msg->params[i]);
 
+		if (strcmp(v, "CASEMAPPING") == 0 && eq) {
+			int cm = casemap_find(eq + 1);
+
+			if (cm == -1)
+				warnf("Unknown casemapping %s, keeping the old one", eq + 1);
+			else
+				intern_set_casemap(net->names, cm);
+		}
+
 		// Restore so we can forward this message
 		strcpy(v, msg->params[i]);
 		if (j != -1) {
-			free(server_isupport.data[j]);
-			server_isupport.data[j] = v;
+			mem_free(MEM_ISUPPORT, net->isupport.data[j]);
+			net->isupport.data[j] = v;
 		} else
-			mca_vector_push(&server_isupport, v);
+			mca_vector_push(&net->isupport, v);
 	}
 
+	snapshot_touch();
+
 	// Pass it onto everyone.
-	server_client_forward(msg);
+	server_client_forward(msg, 0);
 
 	return 1;
 }
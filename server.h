@@ -1,10 +1,8 @@
 #include "irc.h"
-#include "vec.h"
-
-extern int ircfd;
-extern struct mca_vector server_isupport;
 
+int server_dispatch_find(const char *command);
 int server_readable(void);
+void server_client_forward(struct irc_message *msg, int skip);
 void server_writable(void);
 
 int server_sendf(const char *fmt, ...);
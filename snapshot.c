@@ -0,0 +1,218 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "intern.h"
+#include "log.h"
+#include "mem.h"
+#include "network.h"
+#include "snapshot.h"
+#include "state.h"
+#include "vec.h"
+
+/* A snapshot is a state (see state.h), of:
+ *
+ *	u32 magic, u32 version, u32 number of networks
+ *
+ * and for each network, its name, casemapping, counters and ISUPPORT tokens.
+ * Networks are found by name when it is loaded, so the list may change in
+ * between.
+ */
+#define SNAPSHOT_MAGIC 0x49434253 // "ICBS"
+#define SNAPSHOT_VERSION 1
+
+static int dirty;
+
+/* snapshot_touch marks the snapshot out of date. Any thread may call it. */
+void
+snapshot_touch(void)
+{
+	__atomic_store_n(&dirty, 1, __ATOMIC_RELAXED);
+}
+
+/* snapshot_dirty reports whether anything changed since the last snapshot. */
+int
+snapshot_dirty(void)
+{
+	return __atomic_load_n(&dirty, __ATOMIC_RELAXED);
+}
+
+/* snapshot_take writes what every network has learnt from its server down
+ * in s, for snapshot_save. The caller holds every loop, or runs the only one.
+ *
+ * On error, -1 is returned and errno is set; s is freed.
+ */
+int
+snapshot_take(struct state *s)
+{
+	__atomic_store_n(&dirty, 0, __ATOMIC_RELAXED);
+
+	state_put32(s, SNAPSHOT_MAGIC);
+	state_put32(s, SNAPSHOT_VERSION);
+	state_put32(s, nnetworks);
+
+	for (int i = 0; i < nnetworks; ++i) {
+		struct network *n = &networks[i];
+
+		state_putstr(s, n->name);
+		state_put32(s, n->names->casemap);
+		state_put64(s, n->stats.connects);
+		state_put64(s, n->stats.forwarded);
+
+		state_put32(s, n->isupport.len);
+		for (size_t j = 0; j < n->isupport.len; ++j)
+			state_putstr(s, n->isupport.data[j]);
+	}
+
+	if (s->err) {
+		state_free(s);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* snapshot_save writes s, from snapshot_take, out to path and frees it. No
+ * loop needs to be held.
+ *
+ * The file is written under a temporary name, synced and renamed into place,
+ * so a half-written snapshot is never picked up, even after a crash.
+ *
+ * On error, -1 is returned and errno is set.
+ */
+int
+snapshot_save(const char *path, struct state *s)
+{
+	char tmp[4096];
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if (!(f = fopen(tmp, "wb"))) {
+		state_free(s);
+		return -1;
+	}
+
+	fwrite(s->p, 1, s->len, f);
+	state_free(s);
+
+	if (fflush(f) | ferror(f) | fsync(fileno(f)) | fclose(f)) {
+		unlink(tmp);
+		return -1;
+	}
+
+	return rename(tmp, path);
+}
+
+/* snapshot_write writes what every network has learnt from its server to
+ * path, as snapshot_take and snapshot_save do. The caller holds every loop,
+ * or runs the only one.
+ *
+ * On error, -1 is returned and errno is set.
+ */
+int
+snapshot_write(const char *path)
+{
+	struct state s = {0};
+
+	if (snapshot_take(&s) == -1)
+		return -1;
+
+	return snapshot_save(path, &s);
+}
+
+/* load_network warms the network the next record is for, if it is still
+ * around and has not heard from its server yet. */
+static void
+load_network(struct state_reader *r)
+{
+	char name[512], tok[512];
+	struct network *n;
+	uint32_t casemap, len;
+	uint64_t connects, forwarded;
+
+	state_getstr(r, name, sizeof(name));
+	casemap = state_get32(r);
+	connects = state_get64(r);
+	forwarded = state_get64(r);
+	len = state_get32(r);
+
+	if (!(n = network_find(name)) || n->isupport.len || r->err) {
+		for (uint32_t i = 0; i < len && !r->err; ++i)
+			state_getstr(r, tok, sizeof(tok));
+		return;
+	}
+
+	intern_set_casemap(n->names, casemap);
+	n->stats.connects = connects;
+	n->stats.forwarded = forwarded;
+
+	for (uint32_t i = 0; i < len && !r->err; ++i) {
+		state_getstr(r, tok, sizeof(tok));
+		if (!r->err)
+			mca_vector_push(&n->isupport, mem_strdup(MEM_ISUPPORT, tok));
+	}
+
+	// Until the server sends its own.
+	n->warm = 1;
+}
+
+/* snapshot_load warms the networks up from the snapshot at path, so that
+ * clients may be greeted as if their server had been connected to all
+ * along. Call it before any loop runs.
+ *
+ * A missing snapshot is not an error, but a damaged one is. On error, -1 is
+ * returned and errno is set; networks may have been partly warmed.
+ */
+int
+snapshot_load(const char *path)
+{
+	struct state_reader r = {0};
+	struct stat st;
+	uint32_t len;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return errno == ENOENT ? 0 : -1;
+
+	if (fstat(fd, &st) == -1 || st.st_size < 12) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	r.p = map;
+	r.len = st.st_size;
+
+	if (state_get32(&r) != SNAPSHOT_MAGIC || state_get32(&r) != SNAPSHOT_VERSION) {
+		munmap(map, st.st_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	len = state_get32(&r);
+	for (uint32_t i = 0; i < len && !r.err; ++i)
+		load_network(&r);
+
+	munmap(map, st.st_size);
+
+	if (r.err) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	infof("snapshot: loaded %u networks from %s", len, path);
+	return 0;
+}
@@ -0,0 +1,17 @@
+#ifndef SNAPSHOT_H_INC
+#define SNAPSHOT_H_INC
+
+// Seconds between snapshots, if anything changed.
+#ifndef SNAPSHOT_INTERVAL
+#define SNAPSHOT_INTERVAL 60
+#endif
+
+struct state;
+
+void snapshot_touch(void);
+int snapshot_dirty(void);
+int snapshot_take(struct state *s);
+int snapshot_save(const char *path, struct state *s);
+int snapshot_write(const char *path);
+int snapshot_load(const char *path);
+#endif
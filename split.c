@@ -0,0 +1,477 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cap.h"
+#include "client.h"
+#include "clk.h"
+#include "intern.h"
+#include "irc.h"
+#include "log.h"
+#include "mem.h"
+#include "network.h"
+#include "server.h"
+#include "split.h"
+
+// How many of those who quit a summary names before counting the rest.
+#define SPLIT_NAMES 8
+
+int split_window;
+
+static __thread int batchid;
+
+/* hostname reports whether the len bytes at s could be a server's name. */
+static int
+hostname(const char *s, size_t len)
+{
+	int dot = 0;
+
+	if (!len || s[0] == '.' || s[len - 1] == '.')
+		return 0;
+
+	for (size_t i = 0; i < len; ++i) {
+		if (s[i] == '.')
+			dot = 1;
+		else if (!isalnum((unsigned char)s[i]) && !strchr("-_*", s[i]))
+			return 0;
+	}
+
+	return dot;
+}
+
+/* netsplit reports whether reason is what servers give as the reason of a
+ * QUIT in a netsplit: the names of the two servers, and nothing else. */
+static int
+netsplit(const char *reason)
+{
+	const char *sp = strchr(reason, ' ');
+
+	return sp && hostname(reason, sp - reason) && hostname(sp + 1, strlen(sp + 1));
+}
+
+static int
+cmpid(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* announce sends a BATCH to c, or if c is NULL, to everyone who supports
+ * them and did not ask for summaries instead. */
+static void
+announce(struct split *sp, int open, struct client *c)
+{
+	struct irc_message m = { .source = "example.com", .command = "BATCH" };
+	char ref[16], servers[sizeof(sp->servers)], *sep;
+
+	snprintf(ref, sizeof(ref), "%cns%d", open ? '+' : '-', sp->batch);
+	m.params[0] = ref;
+
+	if (open) {
+		snprintf(servers, sizeof(servers), "%s", sp->servers);
+		sep = strchr(servers, ' ');
+		*sep = 0;
+
+		m.params[1] = sp->joining ? "netjoin" : "netsplit";
+		m.params[2] = servers;
+		m.params[3] = sep + 1;
+	}
+
+	if (c)
+		client_sendmsg(c, &m);
+	else
+		server_client_forward(&m, CAP_SPLIT_SUMMARY);
+}
+
+/* summarize tells clients that asked for summaries what came of sp. */
+static void
+summarize(struct split *sp)
+{
+	char names[512];
+	size_t len = 0, first = sp->nnicks - sp->quits;
+
+	*names = 0;
+	for (size_t i = first; !sp->joining && i < sp->nnicks && i - first < SPLIT_NAMES; ++i)
+		len += snprintf(names + len, sizeof(names) - len, "%s%s", len ? ", " : "",
+			intern_str(net->names, sp->nicks[i]));
+
+	for (int i = 0; i < net->clientptr; ++i) {
+		struct client *c = &net->clients[i];
+		const char *nick = c->nick ? intern_str(net->names, c->nick) : "*";
+
+		if (!c->registered || !(c->caps & CAP_SPLIT_SUMMARY))
+			continue;
+
+		if (!sp->joining && sp->quits > SPLIT_NAMES)
+			client_sendf(c, ":%s NOTICE %s :Netsplit %s: %zu quit (%s and %zu more)",
+				"example.com", nick, sp->servers, sp->quits, names, sp->quits - SPLIT_NAMES);
+		else if (!sp->joining)
+			client_sendf(c, ":%s NOTICE %s :Netsplit %s: %zu quit (%s)",
+				"example.com", nick, sp->servers, sp->quits, names);
+
+		for (size_t j = 0; sp->joining && j < sp->nchans; ++j)
+			client_sendf(c, ":%s NOTICE %s :Netjoin %s: %zu joined", "example.com",
+				sp->chans[j].name, sp->servers, sp->chans[j].joins);
+	}
+}
+
+/* finish closes the batch of sp, and sends its summaries. */
+static void
+finish(struct split *sp)
+{
+	if (!sp->batch)
+		return;
+
+	announce(sp, 0, NULL);
+	summarize(sp);
+	debugf("%s: %s of %s over, %zu quit, %zu joined", net->name,
+		sp->joining ? "netjoin" : "netsplit", sp->servers, sp->quits, sp->joins);
+
+	// From now on, only ever searched.
+	if (!sp->joining) {
+		qsort(sp->nicks, sp->nnicks, sizeof(*sp->nicks), cmpid);
+		sp->sorted = 1;
+	}
+
+	for (size_t i = 0; i < sp->nchans; ++i)
+		mem_free(MEM_NETWORKS, sp->chans[i].name);
+	sp->nchans = 0;
+	sp->quits = sp->joins = 0;
+	sp->batch = 0;
+}
+
+/* start opens a batch for sp. */
+static void
+start(struct split *sp, int joining)
+{
+	sp->batch = ++batchid;
+	sp->joining = joining;
+	announce(sp, 1, NULL);
+}
+
+/* forget lets go of sp, and of net's splits altogether once none are left. */
+static void
+forget(struct split *sp)
+{
+	finish(sp);
+
+	for (size_t i = 0; i < sp->nnicks; ++i)
+		intern_put(net->names, sp->nicks[i]);
+	mem_free(MEM_NETWORKS, sp->nicks);
+	mem_free(MEM_NETWORKS, sp->chans);
+	memset(sp, 0, sizeof(*sp));
+
+	for (int i = 0; i < SPLIT_MAX; ++i)
+		if (*net->splits[i].servers)
+			return;
+
+	mem_free(MEM_NETWORKS, net->splits);
+	net->splits = NULL;
+	net->loop->splits--;
+}
+
+/* find returns the split between servers, making it if it has to. On error,
+ * NULL is returned. */
+static struct split *
+find(const char *servers)
+{
+	struct split *sp = NULL;
+
+	if (!net->splits) {
+		if (!(net->splits = mem_calloc(MEM_NETWORKS, SPLIT_MAX, sizeof(*net->splits))))
+			return NULL;
+		net->loop->splits++;
+	}
+
+	for (int i = 0; i < SPLIT_MAX; ++i)
+		if (strcmp(net->splits[i].servers, servers) == 0)
+			return &net->splits[i];
+
+	// Make room by forgetting the split heard from the longest ago.
+	for (int i = 0; i < SPLIT_MAX; ++i)
+		if (!sp || net->splits[i].seen < sp->seen)
+			sp = &net->splits[i];
+
+	if (*sp->servers)
+		forget(sp);
+	if (!net->splits && !(sp = find(servers)))
+		return NULL;
+
+	snprintf(sp->servers, sizeof(sp->servers), "%s", servers);
+	return sp;
+}
+
+/* returning finds the split that the nick id quit in, if any. */
+static struct split *
+returning(uint32_t id)
+{
+	for (int i = 0; net->splits && i < SPLIT_MAX; ++i) {
+		struct split *sp = &net->splits[i];
+
+		if (sp->sorted && bsearch(&id, sp->nicks, sp->nnicks, sizeof(id), cmpid))
+			return sp;
+
+		for (size_t j = 0; !sp->sorted && j < sp->nnicks; ++j)
+			if (sp->nicks[j] == id)
+				return sp;
+	}
+
+	return NULL;
+}
+
+static int
+quit(struct split *sp, const char *nick)
+{
+	if (sp->nnicks == sp->nickscap) {
+		size_t cap = sp->nickscap ? sp->nickscap * 2 : 64;
+		uint32_t *p;
+
+		if (!(p = mem_realloc(MEM_NETWORKS, sp->nicks, sizeof(*p) * cap)))
+			return -1;
+
+		sp->nicks = p;
+		sp->nickscap = cap;
+	}
+
+	sp->nicks[sp->nnicks++] = intern_get(net->names, nick);
+	sp->sorted = 0;
+	sp->quits++;
+	return 0;
+}
+
+static int
+join(struct split *sp, const char *chan)
+{
+	size_t i;
+
+	for (i = 0; i < sp->nchans; ++i)
+		if (casemap_cmp(net->names->casemap, sp->chans[i].name, chan) == 0)
+			break;
+
+	if (i == sp->nchans) {
+		if (sp->nchans == sp->chanscap) {
+			size_t cap = sp->chanscap ? sp->chanscap * 2 : 8;
+			struct split_chan *p;
+
+			if (!(p = mem_realloc(MEM_NETWORKS, sp->chans, sizeof(*p) * cap)))
+				return -1;
+
+			sp->chans = p;
+			sp->chanscap = cap;
+		}
+
+		if (!(sp->chans[i].name = mem_strdup(MEM_NETWORKS, chan)))
+			return -1;
+		sp->chans[i].joins = 0;
+		sp->nchans++;
+	}
+
+	sp->chans[i].joins++;
+	sp->joins++;
+	return 0;
+}
+
+/* split_forward passes msg on to clients as part of a netsplit or netjoin,
+ * if it is one. 1 is returned if it was, and 0 if it is left to the caller.
+ *
+ * A QUIT is part of a netsplit if its reason names two servers. A JOIN is
+ * part of a netjoin if its nick quit in a netsplit not too long ago.
+ */
+int
+split_forward(struct irc_message *msg)
+{
+	struct irc_message out = *msg;
+	struct split *sp;
+	char nick[512], tags[4096];
+	uint32_t id;
+
+	// Servers that batch them already are left to it.
+	if (!split_window || !msg->source || !msg->params[0] ||
+	    (msg->tags && strstr(msg->tags, "batch=")))
+		return 0;
+
+	snprintf(nick, sizeof(nick), "%.*s", (int)strcspn(msg->source, "!@"), msg->source);
+
+	if (strcmp(msg->command, "QUIT") == 0 && netsplit(msg->params[0])) {
+		if (!(sp = find(msg->params[0])))
+			return 0;
+
+		if (sp->batch && sp->joining)
+			finish(sp);
+		if (!sp->batch)
+			start(sp, 0);
+		if (quit(sp, nick) == -1)
+			warnf("%s: netsplit of %s: %s", net->name, sp->servers, strerror(errno));
+	} else if (strcmp(msg->command, "JOIN") == 0 && net->splits) {
+		if (!(id = intern_find(net->names, nick)) || !(sp = returning(id)))
+			return 0;
+
+		if (sp->batch && !sp->joining)
+			finish(sp);
+		if (!sp->batch)
+			start(sp, 1);
+		if (join(sp, msg->params[0]) == -1)
+			warnf("%s: netjoin of %s: %s", net->name, sp->servers, strerror(errno));
+	} else {
+		return 0;
+	}
+
+	sp->seen = clk_mono_ms();
+
+	snprintf(tags, sizeof(tags), "%s%sbatch=ns%d", msg->tags ? msg->tags : "",
+		msg->tags ? ";" : "", sp->batch);
+	out.tags = tags;
+	server_client_forward(&out, CAP_SPLIT_SUMMARY);
+	return 1;
+}
+
+/* deadline returns when sp next needs looking at, in ms, monotonic. */
+static long long
+deadline(struct split *sp)
+{
+	return sp->seen + (sp->batch ? split_window : SPLIT_MEMORY);
+}
+
+/* split_timeout returns how long l may wait, in ms, before split_tick has
+ * something to do, or -1 if it may wait forever. */
+int
+split_timeout(struct loop *l)
+{
+	long long now = clk_mono_ms(), t = -1;
+
+	for (int i = 0; l->splits && i < nnetworks; ++i) {
+		struct network *n = &networks[i];
+
+		for (int j = 0; n->loop == l && n->splits && j < SPLIT_MAX; ++j) {
+			long long d;
+
+			if (!*n->splits[j].servers)
+				continue;
+
+			d = deadline(&n->splits[j]) - now;
+			d = d < 0 ? 0 : d;
+			if (t == -1 || d < t)
+				t = d;
+		}
+	}
+
+	return t > INT32_MAX ? INT32_MAX : t;
+}
+
+/* split_tick closes the batches of l's networks that have gone quiet, and
+ * forgets netsplits that are too old to rejoin from. */
+void
+split_tick(struct loop *l)
+{
+	struct network *old = net;
+	long long now = clk_mono_ms();
+
+	for (int i = 0; l->splits && i < nnetworks; ++i) {
+		net = &networks[i];
+
+		for (int j = 0; net->loop == l && net->splits && j < SPLIT_MAX; ++j) {
+			struct split *sp = &net->splits[j];
+
+			if (!*sp->servers || deadline(sp) > now)
+				continue;
+
+			if (sp->batch)
+				finish(sp);
+			else
+				forget(sp);
+		}
+	}
+
+	net = old;
+}
+
+/* batched reports whether a client gets the lines of netsplits in batches,
+ * if it is registered and has caps. */
+static int
+batched(int registered, int caps)
+{
+	return registered && (caps & (CAP_BATCH | CAP_SPLIT_SUMMARY)) == CAP_BATCH;
+}
+
+/* tell opens or closes every batch open on net for c alone. */
+static void
+tell(struct client *c, int open)
+{
+	for (int i = 0; net->splits && i < SPLIT_MAX; ++i)
+		if (net->splits[i].batch)
+			announce(&net->splits[i], open, c);
+}
+
+/* split_register opens the batches under way for c, which just registered,
+ * as lines of them are tagged for it from now on. */
+void
+split_register(struct client *c)
+{
+	if (batched(c->registered, c->caps))
+		tell(c, 1);
+}
+
+/* split_caps opens the batches under way for c, if it gets them now that its
+ * capabilities went from old to caps, or closes them if it no longer does.
+ * Only what open asks for is done: closing comes before c is told of the
+ * change, while it can still be sent one, and opening after. */
+void
+split_caps(struct client *c, int old, int caps, int open)
+{
+	int was = batched(c->registered, old), is = batched(c->registered, caps);
+
+	if (open ? !was && is : was && !is)
+		tell(c, open);
+}
+
+/* split_batches stores the batches n has open in ids, up to max of them, and
+ * returns how many there are. */
+int
+split_batches(struct network *n, int *ids, int max)
+{
+	int len = 0;
+
+	for (int i = 0; n->splits && i < SPLIT_MAX && len < max; ++i)
+		if (n->splits[i].batch)
+			ids[len++] = n->splits[i].batch;
+
+	return len;
+}
+
+/* split_abandon closes batch id, which the process before opened and never
+ * got to close, for the clients of n. */
+void
+split_abandon(struct network *n, int id)
+{
+	struct split sp = { .batch = id };
+
+	net = n;
+	announce(&sp, 0, NULL);
+}
+
+/* split_free lets go of whatever n is keeping for netsplits. */
+void
+split_free(struct network *n)
+{
+	if (!n->splits)
+		return;
+
+	for (int i = 0; i < SPLIT_MAX; ++i) {
+		struct split *sp = &n->splits[i];
+
+		for (size_t j = 0; j < sp->nnicks; ++j)
+			intern_put(n->names, sp->nicks[j]);
+		for (size_t j = 0; j < sp->nchans; ++j)
+			mem_free(MEM_NETWORKS, sp->chans[j].name);
+		mem_free(MEM_NETWORKS, sp->nicks);
+		mem_free(MEM_NETWORKS, sp->chans);
+	}
+
+	mem_free(MEM_NETWORKS, n->splits);
+	n->splits = NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef SPLIT_H_INC
+#define SPLIT_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+// How many netsplits a network keeps track of at once.
+#define SPLIT_MAX 4
+
+// How long, in ms, those who quit in a netsplit are remembered, for their
+// return to be known as its netjoin.
+#define SPLIT_MEMORY (30 * 60 * 1000)
+
+struct client;
+struct irc_message;
+struct loop;
+struct network;
+
+/* A netsplit between two servers, and then the netjoin healing it. While
+ * lines of either are coming in, clients that support batches get them in
+ * one, and clients that asked for summaries get nothing until it is over. */
+struct split {
+	char servers[256]; // "hub.example.com leaf.example.com", or empty if unused
+	long long seen; // ms, monotonic, of the last line of it
+	int batch; // Open batch, or 0
+	int joining; // Whether what is coming in is the netjoin
+
+	// Who quit, as ids in the network's names; sorted once the netsplit
+	// is over.
+	uint32_t *nicks;
+	size_t nnicks, nickscap;
+	int sorted;
+
+	// Of the netsplit or netjoin under way, for summaries.
+	size_t quits, joins;
+	struct split_chan {
+		char *name;
+		size_t joins;
+	} *chans;
+	size_t nchans, chanscap;
+};
+
+/* The window, in ms, over which lines are coalesced, or 0 if they are not. */
+extern int split_window;
+
+int split_forward(struct irc_message *msg);
+int split_timeout(struct loop *l);
+void split_tick(struct loop *l);
+void split_register(struct client *c);
+void split_caps(struct client *c, int old, int caps, int open);
+int split_batches(struct network *n, int *ids, int max);
+void split_abandon(struct network *n, int id);
+void split_free(struct network *n);
+#endif
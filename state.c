@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "mem.h"
+#include "state.h"
+
+/* state_put appends n bytes of data to s. Once an allocation has failed, s
+ * is left alone and err is set. */
+void
+state_put(struct state *s, const void *data, size_t n)
+{
+	if (s->err)
+		return;
+
+	if (s->len + n > s->cap) {
+		size_t cap = s->cap ? s->cap : 4096;
+		char *p;
+
+		while (cap < s->len + n)
+			cap *= 2;
+
+		if (!(p = mem_realloc(MEM_NETWORKS, s->p, cap))) {
+			s->err = 1;
+			return;
+		}
+
+		s->p = p;
+		s->cap = cap;
+	}
+
+	memcpy(s->p + s->len, data, n);
+	s->len += n;
+}
+
+void
+state_put32(struct state *s, uint32_t v)
+{
+	state_put(s, &v, sizeof(v));
+}
+
+void
+state_put64(struct state *s, uint64_t v)
+{
+	state_put(s, &v, sizeof(v));
+}
+
+void
+state_putbytes(struct state *s, const void *data, size_t n)
+{
+	state_put32(s, n);
+	state_put(s, data, n);
+}
+
+void
+state_putstr(struct state *s, const char *str)
+{
+	state_putbytes(s, str ? str : "", str ? strlen(str) : 0);
+}
+
+/* state_putfd refers to fd, which is sent along with the state, or to none if it
+ * is -1. */
+void
+state_putfd(struct state *s, int fd)
+{
+	if (fd == -1) {
+		state_put32(s, UINT32_MAX);
+		return;
+	}
+
+	if (s->nfds == s->fdcap) {
+		size_t cap = s->fdcap ? s->fdcap * 2 : 64;
+		int *fds;
+
+		if (!(fds = mem_realloc(MEM_NETWORKS, s->fds, sizeof(*fds) * cap))) {
+			s->err = 1;
+			return;
+		}
+
+		s->fds = fds;
+		s->fdcap = cap;
+	}
+
+	state_put32(s, s->nfds);
+	s->fds[s->nfds++] = fd;
+}
+
+/* state_get reads the next n bytes of r into data, or zeroes, and sets err,
+ * if there are not that many left. */
+void
+state_get(struct state_reader *r, void *data, size_t n)
+{
+	if (r->err || r->len - r->off < n) {
+		r->err = 1;
+		memset(data, 0, n);
+		return;
+	}
+
+	memcpy(data, r->p + r->off, n);
+	r->off += n;
+}
+
+uint32_t
+state_get32(struct state_reader *r)
+{
+	uint32_t v;
+
+	state_get(r, &v, sizeof(v));
+	return v;
+}
+
+uint64_t
+state_get64(struct state_reader *r)
+{
+	uint64_t v;
+
+	state_get(r, &v, sizeof(v));
+	return v;
+}
+
+/* state_getbytes returns the next bytes of the state, and sets n to how many there
+ * are. They are not terminated. */
+const char *
+state_getbytes(struct state_reader *r, size_t *n)
+{
+	const char *p;
+
+	*n = state_get32(r);
+	if (r->err || r->len - r->off < *n) {
+		r->err = 1;
+		*n = 0;
+		return "";
+	}
+
+	p = r->p + r->off;
+	r->off += *n;
+	return p;
+}
+
+/* state_getstr reads a string into buf, which is always terminated. */
+void
+state_getstr(struct state_reader *r, char *buf, size_t sz)
+{
+	size_t n;
+	const char *p = state_getbytes(r, &n);
+
+	if (n >= sz)
+		r->err = 1;
+	snprintf(buf, sz, "%.*s", (int)n, p);
+}
+
+/* state_getfd returns the fd written with state_putfd, or -1. */
+int
+state_getfd(struct state_reader *r)
+{
+	uint32_t i = state_get32(r);
+
+	if (i == UINT32_MAX)
+		return -1;
+	if (i >= r->nfds) {
+		r->err = 1;
+		return -1;
+	}
+	return r->fds[i];
+}
+
+/* state_free frees what s holds. */
+void
+state_free(struct state *s)
+{
+	mem_free(MEM_NETWORKS, s->fds);
+	mem_free(MEM_NETWORKS, s->p);
+	memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,42 @@
+#ifndef STATE_H_INC
+#define STATE_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+/* Binary state, written out in host byte order to be read back by this same
+ * build of icbm: by the next process on upgrade, or at startup from a
+ * snapshot. fds are not written out, but collected in order, for the caller
+ * to send along. */
+struct state {
+	char *p;
+	size_t len, cap;
+	int err;
+
+	int *fds;
+	size_t nfds, fdcap;
+};
+
+struct state_reader {
+	const char *p;
+	size_t len, off;
+	int err;
+
+	const int *fds;
+	size_t nfds;
+};
+
+void state_put(struct state *s, const void *data, size_t n);
+void state_put32(struct state *s, uint32_t v);
+void state_put64(struct state *s, uint64_t v);
+void state_putbytes(struct state *s, const void *data, size_t n);
+void state_putstr(struct state *s, const char *str);
+void state_putfd(struct state *s, int fd);
+void state_free(struct state *s);
+
+void state_get(struct state_reader *r, void *data, size_t n);
+uint32_t state_get32(struct state_reader *r);
+uint64_t state_get64(struct state_reader *r);
+const char *state_getbytes(struct state_reader *r, size_t *n);
+void state_getstr(struct state_reader *r, char *buf, size_t sz);
+int state_getfd(struct state_reader *r);
+#endif
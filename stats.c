@@ -0,0 +1,128 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <time.h>
+
+#include "clk.h"
+#include "mem.h"
+#include "stats.h"
+
+const struct histo stats_nohisto;
+
+/* stats_now returns a precise monotonic time in ns. */
+uint64_t
+stats_now(void)
+{
+	struct timespec ts;
+
+	// The loop's cached clock only moves every few milliseconds, which is
+	// far coarser than a wakeup usually takes.
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* stats_init starts the clock on uptime. */
+void
+stats_init(struct stats *s)
+{
+	s->started = clk_mono_ms();
+	s->lastsec = clk_mono.tv_sec;
+}
+
+/* stats_tick rolls the per second rate over, if the second has changed. It
+ * expects the loop's clock to have been refreshed already. */
+void
+stats_tick(struct stats *s)
+{
+	if (clk_mono.tv_sec == s->lastsec)
+		return;
+
+	s->persec = (s->forwarded - s->lastforwarded) / (clk_mono.tv_sec - s->lastsec);
+	s->lastforwarded = s->forwarded;
+	s->lastsec = clk_mono.tv_sec;
+}
+
+/* stats_wake marks the start of a loop iteration. */
+void
+stats_wake(struct stats_loop *l)
+{
+	l->wake = stats_now();
+}
+
+/* stats_loop_done marks the end of a loop iteration. */
+void
+stats_loop_done(struct stats_loop *l)
+{
+	if (l->wake)
+		histo_add(&l->loop, stats_now() - l->wake);
+	l->wake = 0;
+}
+
+/* stats_queued marks that the connection's output now ends at end, in
+ * bytes, if what was queued was caused by a line from the server.
+ *
+ * When too many lines are waiting, the new ones are folded into the newest
+ * mark, which makes them look as old as it.
+ */
+void
+stats_queued(struct stats *s, struct stats_lat *l, uint64_t end)
+{
+	struct stats_mark *m;
+
+	if (!s->rx)
+		return;
+
+	if (l->len == STATS_MARKS) {
+		l->marks[(l->head + l->len - 1) % STATS_MARKS].end = end;
+		return;
+	}
+
+	m = &l->marks[(l->head + l->len++) % STATS_MARKS];
+	m->end = end;
+	m->rx = s->rx;
+	m->queued = stats_now();
+}
+
+/* stats_written counts n bytes written out to the connection, and the
+ * latency of every line that is now completely out, both for the connection
+ * and for its network's s. */
+void
+stats_written(struct stats *s, struct stats_lat *l, size_t n)
+{
+	struct stats_mark *m;
+	uint64_t now = 0;
+
+	l->written += n;
+
+	while (l->len && (m = &l->marks[l->head])->end <= l->written) {
+		if (!now)
+			now = stats_now();
+
+		histo_small_add(&l->queue, now - m->queued);
+		histo_small_add(&l->write, now - m->rx);
+		stats_histo_add(&s->queue, now - m->queued);
+		stats_histo_add(&s->write, now - m->rx);
+
+		l->head = (l->head + 1) % STATS_MARKS;
+		l->len--;
+	}
+}
+
+/* stats_histo_add counts v in *h, allocating it first if need be. If that
+ * fails, v is not counted. */
+void
+stats_histo_add(struct histo **h, uint64_t v)
+{
+	if (!*h && !(*h = mem_calloc(MEM_NETWORKS, 1, sizeof(**h))))
+		return;
+	histo_add(*h, v);
+}
+
+/* stats_free frees the histograms of s. */
+void
+stats_free(struct stats *s)
+{
+	mem_free(MEM_NETWORKS, s->forward);
+	mem_free(MEM_NETWORKS, s->queue);
+	mem_free(MEM_NETWORKS, s->write);
+	s->forward = s->queue = s->write = NULL;
+}
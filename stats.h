@@ -0,0 +1,105 @@
+#ifndef STATS_H_INC
+#define STATS_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+#include "histo.h"
+
+/* Counters for one connection. Like everything else here, they are only
+ * touched by the loop the connection is on, so they need no locking. */
+struct stats_conn {
+	uint64_t lines_in, bytes_in;
+	uint64_t lines_out, bytes_out;
+	uint64_t dropped; // Lines that did not fit in the send buffer
+	size_t sendq_max; // High-water mark of the send buffer
+};
+
+#define STATS_MARKS 32
+
+/* Where a line caused by the server ends in a connection's output, and when
+ * it was received and queued, in ns. */
+struct stats_mark {
+	uint64_t end, rx, queued;
+};
+
+/* Latency of the lines queued for one connection, measured up to the write
+ * that gets the last of them out. */
+struct stats_lat {
+	struct stats_mark marks[STATS_MARKS]; // Oldest at head
+	int head, len;
+	uint64_t written; // Bytes, matches bytes_out once everything is out
+
+	struct histo_small queue; // Queued to written
+	struct histo_small write; // Received to written
+};
+
+/* Counters for one event loop. */
+struct stats_loop {
+	uint64_t wake; // ns, when poll(2) last returned
+	struct histo loop; // ns spent handling each wakeup
+};
+
+/* Counters for one network. The histograms are only allocated once something
+ * is counted in them, as most networks of a busy host are idle; read them
+ * through stats_histo. */
+struct stats {
+	long long started; // ms, monotonic
+
+	uint64_t forwarded; // Lines from the server written to clients
+	uint64_t persec; // Of the above, over the last whole second
+	uint64_t lastforwarded;
+	long long lastsec;
+	struct histo *forward; // ns from reading a line to queueing it for everyone
+
+	uint64_t connects; // To the server
+
+	uint64_t rx; // When the server line being handled was read, or 0
+	struct histo *queue, *write; // As in stats_lat, over every client
+
+	struct stats_conn server;
+};
+
+uint64_t stats_now(void);
+void stats_init(struct stats *s);
+void stats_tick(struct stats *s);
+void stats_wake(struct stats_loop *l);
+void stats_loop_done(struct stats_loop *l);
+void stats_queued(struct stats *s, struct stats_lat *l, uint64_t end);
+void stats_written(struct stats *s, struct stats_lat *l, size_t n);
+void stats_histo_add(struct histo **h, uint64_t v);
+void stats_free(struct stats *s);
+
+extern const struct histo stats_nohisto;
+
+/* stats_histo returns h, or an empty histogram if it has not been allocated
+ * yet. */
+static inline const struct histo *
+stats_histo(const struct histo *h)
+{
+	return h ? h : &stats_nohisto;
+}
+
+/* stats_in counts a line of n bytes read off a connection. */
+static inline void
+stats_in(struct stats_conn *s, size_t n)
+{
+	s->lines_in++;
+	s->bytes_in += n;
+}
+
+/* stats_out counts a line of n bytes queued for a connection, or dropped if
+ * ok is false. queued is how much is waiting to be sent after it. */
+static inline void
+stats_out(struct stats_conn *s, size_t n, size_t queued, int ok)
+{
+	if (!ok) {
+		s->dropped++;
+		return;
+	}
+
+	s->lines_out++;
+	s->bytes_out += n;
+	if (queued > s->sendq_max)
+		s->sendq_max = queued;
+}
+#endif
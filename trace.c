@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "mem.h"
+#include "trace.h"
+
+#define TRACE_EVENTS (64*1024) // Per thread, must be a power of two
+
+/* trace_ev is a span that has ended. */
+struct trace_ev {
+	const char *name;
+	long arg;
+	uint64_t start, dur; // ns, monotonic
+};
+
+/* trace_ring is written to by exactly one thread. Once it is full, the
+ * oldest events are overwritten. */
+struct trace_ring {
+	uint64_t head;
+	int tid;
+	const char *name;
+	struct trace_ev ev[TRACE_EVENTS];
+};
+
+int trace_on = 0;
+const char *trace_path = "icbm-trace.json";
+
+static struct trace_ring **rings;
+static int nrings, maxrings; // One per thread, as many as trace_init was told
+static __thread struct trace_ring *ring;
+static __thread int noring; // Set once the calling thread did not get one
+static __thread const char *thread_name;
+
+/* trace_now returns a precise monotonic time in ns. It is never 0. */
+uint64_t
+trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ring_get returns the ring of the calling thread, making it if need be. */
+static struct trace_ring *
+ring_get(void)
+{
+	static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+	struct trace_ring *r;
+	int i;
+
+	if (ring)
+		return ring;
+	if (noring)
+		return NULL;
+
+	if (!(r = mem_calloc(MEM_TRACE, 1, sizeof(*r)))) {
+		noring = 1;
+		return NULL;
+	}
+
+	r->name = thread_name;
+
+	pthread_mutex_lock(&mu);
+	if ((i = nrings) < maxrings) {
+		r->tid = i + 1;
+		rings[i] = r;
+		__atomic_store_n(&nrings, i + 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&mu);
+
+	if (i >= maxrings) {
+		mem_free(MEM_TRACE, r);
+		noring = 1;
+		warnf("Trace: all %d rings are taken, leaving %s out", maxrings,
+			thread_name ? thread_name : "a thread");
+		return NULL;
+	}
+
+	return ring = r;
+}
+
+/* trace_init makes room for up to threads threads to be traced; any more
+ * are left out.
+ *
+ * On error, -1 is returned.
+ */
+int
+trace_init(int threads)
+{
+	if (!(rings = mem_calloc(MEM_TRACE, threads, sizeof(*rings))))
+		return -1;
+
+	maxrings = threads;
+	return 0;
+}
+
+/* trace_thread names the calling thread in dumps. name must live forever. */
+void
+trace_thread(const char *name)
+{
+	thread_name = name;
+	if (ring)
+		ring->name = name;
+}
+
+/* trace_event records a span that started at start and ends now. It is not
+ * meant to be called directly; see TRACE_END. */
+void
+trace_event(const char *name, long arg, uint64_t start)
+{
+	struct trace_ring *r;
+	struct trace_ev *e;
+
+	// Tracing may have been turned off since the span started.
+	if (!trace_on || !(r = ring_get()))
+		return;
+
+	e = &r->ev[r->head & (TRACE_EVENTS - 1)];
+	e->name = name;
+	e->arg = arg;
+	e->start = start;
+	e->dur = trace_now() - start;
+
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* trace_dump writes every event still in the rings to path as Chrome trace
+ * JSON. The rings are left as they were.
+ *
+ * Events recorded by other threads while the dump is taken may be missing
+ * or mangled.
+ *
+ * On error, -1 is returned.
+ */
+int
+trace_dump(const char *path)
+{
+	FILE *f;
+	int len = __atomic_load_n(&nrings, __ATOMIC_ACQUIRE), first = 1;
+
+	if (!(f = fopen(path, "w")))
+		return -1;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+	for (int i = 0; i < len; ++i) {
+		struct trace_ring *r = rings[i];
+		uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		uint64_t tail = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0;
+
+		if (r->name) {
+			fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+				"\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", (int)getpid(), r->tid, r->name);
+			first = 0;
+		}
+
+		for (; tail != head; ++tail) {
+			struct trace_ev *e = &r->ev[tail & (TRACE_EVENTS - 1)];
+
+			fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,"
+				"\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"arg\":%ld}}", first ? "" : ",\n",
+				e->name, (int)getpid(), r->tid, e->start / 1e3, e->dur / 1e3, e->arg);
+			first = 0;
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+
+	if (fclose(f) == EOF)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef TRACE_H_INC
+#define TRACE_H_INC
+#include <stdint.h>
+
+/* Tracing records how long things take into a ring per thread, which can be
+ * dumped as Chrome trace JSON and opened in Perfetto or chrome://tracing.
+ *
+ * A span is timed like this:
+ *
+ *	uint64_t t = TRACE_BEGIN();
+ *	...
+ *	TRACE_END("read", fd, t);
+ *
+ * While tracing is off, each of the two costs a single branch. name must be
+ * a string that lives forever, such as a literal.
+ */
+#define TRACE_BEGIN() (__builtin_expect(trace_on, 0) ? trace_now() : 0)
+#define TRACE_END(name, arg, t) do { \
+	if (__builtin_expect((t) != 0, 0)) \
+		trace_event(name, arg, t); \
+} while (0)
+
+extern int trace_on;
+extern const char *trace_path;
+
+uint64_t trace_now(void);
+void trace_event(const char *name, long arg, uint64_t start);
+int trace_init(int threads);
+void trace_thread(const char *name);
+int trace_dump(const char *path);
+#endif
@@ -0,0 +1,681 @@
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE // For SCM_RIGHTS and MSG_NOSIGNAL
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "intern.h"
+#include "log.h"
+#include "mem.h"
+#include "network.h"
+#include "split.h"
+#include "state.h"
+#include "upgrade.h"
+#include "worker.h"
+
+/* How the state of one process is handed to the next:
+ *
+ *	u64 length of the state, u32 number of fds
+ *	the state
+ *	the fds, in chunks of UPGRADE_FDS, each sent with one byte
+ *
+ * and the new process answers with one byte once it has taken over. The
+ * state refers to fds by their index in the order they are sent.
+ */
+#define UPGRADE_MAGIC 0x49434255 // "ICBU"
+#define UPGRADE_VERSION 4
+#define UPGRADE_FDS 200
+#define UPGRADE_STATE_MAX (1u << 31)
+#define UPGRADE_TIMEOUT 30000 // ms, for the new process to take over
+
+extern char **environ;
+
+/* putbufio writes what b has received but not handled, then what it has
+ * queued but not sent. */
+static void
+putbufio(struct state *s, const struct bufio *b)
+{
+	state_putbytes(s, b->recvbuf + b->last_recvptr, b->recvptr - b->last_recvptr);
+	state_putbytes(s, b->sendbuf, b->sendptr);
+}
+
+static void
+putconn(struct state *s, const struct stats_conn *st)
+{
+	state_put64(s, st->lines_in);
+	state_put64(s, st->bytes_in);
+	state_put64(s, st->lines_out);
+	state_put64(s, st->bytes_out);
+	state_put64(s, st->dropped);
+	state_put64(s, st->sendq_max);
+}
+
+static void
+getconn(struct state_reader *r, struct stats_conn *st)
+{
+	st->lines_in = state_get64(r);
+	st->bytes_in = state_get64(r);
+	st->lines_out = state_get64(r);
+	st->bytes_out = state_get64(r);
+	st->dropped = state_get64(r);
+	st->sendq_max = state_get64(r);
+}
+
+/* save writes down everything the next process needs to carry on. The
+ * caller holds every loop and worker. */
+static void
+save(struct state *s, const int *listenfds, int nlisten, int metricsfd, int ringfd)
+{
+	uint32_t n;
+
+	state_put32(s, UPGRADE_MAGIC);
+	state_put32(s, UPGRADE_VERSION);
+	state_put32(s, nlisten);
+	for (int i = 0; i < nlisten; ++i)
+		state_putfd(s, listenfds[i]);
+	state_putfd(s, metricsfd);
+	state_putfd(s, ringfd);
+
+	state_put32(s, nnetworks);
+	for (int i = 0; i < nnetworks; ++i) {
+		struct network *n = &networks[i];
+		int batches[SPLIT_MAX], len;
+
+		state_putstr(s, n->name);
+		state_putfd(s, n->ircfd);
+		state_put32(s, n->caps);
+		state_put32(s, n->capend);
+		state_put32(s, n->capwant);
+		state_put32(s, n->names->casemap);
+		state_put64(s, n->stats.started);
+		state_put64(s, n->stats.connects);
+		state_put64(s, n->stats.forwarded);
+		putconn(s, &n->stats.server);
+		putbufio(s, &n->bufio);
+
+		state_put32(s, n->isupport.len);
+		for (size_t j = 0; j < n->isupport.len; ++j)
+			state_putstr(s, n->isupport.data[j]);
+
+		// Only that they are open; the next process closes them.
+		len = split_batches(n, batches, SPLIT_MAX);
+		state_put32(s, len);
+		for (int j = 0; j < len; ++j)
+			state_put32(s, batches[j]);
+
+		state_put32(s, n->clientptr);
+		for (int j = 0; j < n->clientptr; ++j) {
+			struct client *c = &n->clients[j];
+
+			state_putfd(s, c->fd);
+			state_putstr(s, c->nick ? intern_str(n->names, c->nick) : NULL);
+			state_put32(s, c->user);
+			state_put32(s, c->caps);
+			state_put32(s, c->capping);
+			state_put32(s, c->registered);
+			putconn(s, &c->st);
+
+			// Writes of clients with a worker are queued there.
+			state_putbytes(s, c->b.recvbuf + c->b.last_recvptr, c->b.recvptr - c->b.last_recvptr);
+			if (c->io)
+				state_putbytes(s, c->io->b.sendbuf, c->io->b.sendptr);
+			else
+				state_putbytes(s, c->b.sendbuf, c->b.sendptr);
+		}
+	}
+
+	// Every loop has a lobby; the new process puts them all in loop 0's.
+	n = 0;
+	for (int i = 0; i < nloops; ++i)
+		n += loops[i].nlobby;
+
+	state_put32(s, n);
+	for (int i = 0; i < nloops; ++i) {
+		for (size_t j = 0; j < loops[i].nlobby; ++j) {
+			struct lobby *lb = &loops[i].lobby[j];
+
+			state_putfd(s, lb->fd);
+			state_put64(s, lb->uid);
+			state_putbytes(s, lb->buf, lb->len);
+		}
+	}
+}
+
+static int
+sendall(int fd, const void *data, size_t n)
+{
+	const char *p = data;
+
+	while (n) {
+		ssize_t r = send(fd, p, n, MSG_NOSIGNAL);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == -1)
+			return -1;
+
+		p += r;
+		n -= r;
+	}
+
+	return 0;
+}
+
+static int
+recvall(int fd, void *data, size_t n)
+{
+	char *p = data;
+
+	while (n) {
+		ssize_t r = recv(fd, p, n, 0);
+
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			if (r == 0)
+				errno = EPIPE;
+			return -1;
+		}
+
+		p += r;
+		n -= r;
+	}
+
+	return 0;
+}
+
+static int
+sendfds(int fd, const int *fds, size_t n)
+{
+	for (size_t off = 0; off < n; off += UPGRADE_FDS) {
+		size_t k = n - off < UPGRADE_FDS ? n - off : UPGRADE_FDS;
+		char ctl[CMSG_SPACE(sizeof(int) * UPGRADE_FDS)] = {0};
+		char byte = 'F';
+		struct iovec iov = { &byte, 1 };
+		struct msghdr msg = {0};
+		struct cmsghdr *cm;
+
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * k);
+
+		cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int) * k);
+		memcpy(CMSG_DATA(cm), fds + off, sizeof(int) * k);
+
+		while (sendmsg(fd, &msg, MSG_NOSIGNAL) == -1)
+			if (errno != EINTR)
+				return -1;
+	}
+
+	return 0;
+}
+
+static int
+recvfds(int fd, int *fds, size_t n)
+{
+	for (size_t off = 0; off < n; ) {
+		char ctl[CMSG_SPACE(sizeof(int) * UPGRADE_FDS)];
+		char byte;
+		struct iovec iov = { &byte, 1 };
+		struct msghdr msg = {0};
+		struct cmsghdr *cm;
+		ssize_t r;
+		size_t k;
+
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl;
+		msg.msg_controllen = sizeof(ctl);
+
+		while ((r = recvmsg(fd, &msg, 0)) == -1 && errno == EINTR);
+		if (r <= 0 || (msg.msg_flags & MSG_CTRUNC) || !(cm = CMSG_FIRSTHDR(&msg)) ||
+		    cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+			errno = EPROTO;
+			return -1;
+		}
+
+		k = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (k > n - off) {
+			errno = EPROTO;
+			return -1;
+		}
+
+		memcpy(fds + off, CMSG_DATA(cm), sizeof(int) * k);
+		off += k;
+	}
+
+	return 0;
+}
+
+/* resolve finds the file that running name would, as execvp(3) does, since
+ * only async-signal-safe calls may be made between fork and exec. */
+static int
+resolve(const char *name, char *path, size_t sz)
+{
+	const char *dirs = getenv("PATH");
+
+	if (strchr(name, '/')) {
+		snprintf(path, sz, "%s", name);
+		return 0;
+	}
+
+	for (const char *d = dirs ? dirs : "/usr/bin:/bin"; *d; ) {
+		size_t n = strcspn(d, ":");
+
+		snprintf(path, sz, "%.*s%s%s", (int)n, d, n ? "/" : "", name);
+		if (access(path, X_OK) == 0)
+			return 0;
+
+		d += n;
+		if (*d == ':')
+			d++;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+/* upgrade_start starts the icbm binary named by argv[0] again, and hands
+ * everything over to it: the listener, every server and client connection,
+ * and whatever they have buffered. The caller holds every loop and worker,
+ * and has drained the workers.
+ *
+ * If 0 is returned, the new process has taken over and this one must exit
+ * without touching anything it handed over. On error, -1 is returned and
+ * this process carries on as if nothing had happened.
+ */
+int
+upgrade_start(char **argv, const int *listenfds, int nlisten, int metricsfd, int ringfd)
+{
+	struct state s = {0};
+	char path[4096], env[32], **envp = NULL, ack;
+	struct pollfd pfd;
+	uint64_t len;
+	uint32_t nfds;
+	size_t nenv = 0;
+	ssize_t got;
+	int sv[2] = { -1, -1 };
+	pid_t pid = -1;
+
+	save(&s, listenfds, nlisten, metricsfd, ringfd);
+	if (s.err || s.len > UPGRADE_STATE_MAX) {
+		errno = ENOMEM;
+		goto fail;
+	}
+
+	if (resolve(argv[0], path, sizeof(path)) == -1)
+		goto fail;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1)
+		goto fail;
+
+	// The new process's end has to survive exec.
+	if (fcntl(sv[1], F_SETFD, 0) == -1)
+		goto fail;
+
+	while (environ[nenv])
+		nenv++;
+	if (!(envp = mem_calloc(MEM_NETWORKS, nenv + 2, sizeof(*envp))))
+		goto fail;
+
+	nenv = 0;
+	for (char **e = environ; *e; ++e)
+		if (strncmp(*e, "ICBM_UPGRADE=", 13) != 0)
+			envp[nenv++] = *e;
+	snprintf(env, sizeof(env), "ICBM_UPGRADE=%d", sv[1]);
+	envp[nenv] = env;
+
+	if ((pid = fork()) == -1)
+		goto fail;
+
+	if (pid == 0) {
+		execve(path, argv, envp);
+		_exit(127);
+	}
+
+	close(sv[1]);
+	sv[1] = -1;
+
+	len = s.len;
+	nfds = s.nfds;
+	if (sendall(sv[0], &len, sizeof(len)) == -1 || sendall(sv[0], &nfds, sizeof(nfds)) == -1 ||
+	    sendall(sv[0], s.p, s.len) == -1 || sendfds(sv[0], s.fds, s.nfds) == -1)
+		goto fail;
+
+	pfd.fd = sv[0];
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, UPGRADE_TIMEOUT) == -1)
+		if (errno != EINTR)
+			goto fail;
+
+	// Nothing at all means it gave up, or never got as far as trying.
+	if ((got = recv(sv[0], &ack, 1, MSG_DONTWAIT)) != 1 || ack != 'K') {
+		errno = got == 0 ? EPIPE : got == -1 ? ETIMEDOUT : EPROTO;
+		goto fail;
+	}
+
+	infof("Upgrade: %s (pid %d) took over %zu fds", path, (int)pid, s.nfds);
+
+	close(sv[0]);
+	mem_free(MEM_NETWORKS, envp);
+	state_free(&s);
+	return 0;
+
+fail:
+	warnf("Upgrade failed, carrying on: %s", strerror(errno));
+
+	if (pid > 0) {
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+	}
+
+	for (int i = 0; i < 2; ++i)
+		if (sv[i] != -1)
+			close(sv[i]);
+
+	mem_free(MEM_NETWORKS, envp);
+	state_free(&s);
+	return -1;
+}
+
+/* closeall closes every fd above stderr but keep. */
+static void
+closeall(int keep)
+{
+	int fds[1024], n;
+	struct dirent *e;
+	DIR *d;
+
+	// Collected first, so that the directory's own fd is left alone.
+	do {
+		if (!(d = opendir("/proc/self/fd")))
+			return;
+
+		n = 0;
+		while ((e = readdir(d)) && n < sizeof(fds)/sizeof(*fds)) {
+			int fd = atoi(e->d_name);
+
+			if (fd > 2 && fd != keep && fd != dirfd(d))
+				fds[n++] = fd;
+		}
+		closedir(d);
+
+		for (int i = 0; i < n; ++i)
+			close(fds[i]);
+	} while (n == sizeof(fds)/sizeof(*fds));
+}
+
+/* upgrade_fd returns the socket of the process this one is taking over from,
+ * or -1 if it was started afresh. Any other fd it left open is closed, as
+ * only what is handed over may be kept. */
+int
+upgrade_fd(void)
+{
+	const char *env = getenv("ICBM_UPGRADE");
+	int fd;
+
+	if (!env)
+		return -1;
+
+	fd = atoi(env);
+	unsetenv("ICBM_UPGRADE");
+
+	closeall(fd);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+/* resume_client attaches a client of the process before to n, or hangs up
+ * on it if n is NULL. The caller has switched to n's loop. */
+static void
+resume_client(struct network *n, struct state_reader *r)
+{
+	int fd = state_getfd(r), user, caps, capping, registered;
+	struct stats_conn st;
+	const char *in, *out;
+	char nick[512];
+	size_t inlen, outlen;
+	struct client *c;
+
+	state_getstr(r, nick, sizeof(nick));
+	user = state_get32(r);
+	caps = state_get32(r);
+	capping = state_get32(r);
+	registered = state_get32(r);
+	getconn(r, &st);
+	in = state_getbytes(r, &inlen);
+	out = state_getbytes(r, &outlen);
+
+	if (fd == -1)
+		return;
+
+	if (!n || r->err || inlen >= sizeof(c->b.recvbuf)) {
+		close(fd);
+		return;
+	}
+
+	if (!(c = network_attach(n, fd)))
+		return;
+
+	if (*nick)
+		c->nick = intern_get(n->names, nick);
+	c->user = user;
+	c->caps = caps;
+	c->capping = capping;
+	c->registered = registered;
+
+	memcpy(c->b.recvbuf, in, inlen);
+	c->b.recvptr = inlen;
+
+	if (outlen)
+		client_write(c, (char *)out, outlen);
+	c->st = st;
+
+	// Marks are set against bytes_out, so what has been written has to
+	// carry on from it too, less what is still to go.
+	c->lat.written = st.bytes_out - outlen;
+}
+
+/* resume_network takes over the server connection and clients of the
+ * network called name in the process before. If there is no such network
+ * any more, they are let go of. */
+static void
+resume_network(struct state_reader *r)
+{
+	char name[512], tok[512];
+	struct network *n;
+	int fd, caps, capend, capwant, casemap;
+	uint64_t started, connects, forwarded;
+	struct stats_conn server;
+	const char *in, *out;
+	size_t inlen, outlen;
+	int batches[SPLIT_MAX], nbatches = 0;
+	uint32_t len;
+
+	state_getstr(r, name, sizeof(name));
+	fd = state_getfd(r);
+	caps = state_get32(r);
+	capend = state_get32(r);
+	capwant = state_get32(r);
+	casemap = state_get32(r);
+	started = state_get64(r);
+	connects = state_get64(r);
+	forwarded = state_get64(r);
+	getconn(r, &server);
+	in = state_getbytes(r, &inlen);
+	out = state_getbytes(r, &outlen);
+
+	if (!(n = network_find(name)))
+		warnf("Upgrade: %s is gone, hanging up on it", name);
+
+	if (n && fd != -1 && !r->err && inlen < sizeof(n->bufio.recvbuf)) {
+		n->ircfd = fd;
+		n->resumed = 1;
+		n->caps = caps;
+		n->capend = capend;
+		n->capwant = capwant;
+		n->stats.started = started;
+		n->stats.connects = connects;
+		n->stats.forwarded = forwarded;
+		n->stats.server = server;
+		intern_set_casemap(n->names, casemap);
+
+		memcpy(n->bufio.recvbuf, in, inlen);
+		n->bufio.recvptr = inlen;
+
+		loop_own(n->loop, fd, n, OWN_SERVER);
+		mca_ev_append(n->loop->ev, fd, MCA_EV_READ);
+		if (outlen && bufio_write(&n->bufio, (char *)out, outlen) != -1)
+			mca_ev_set_write(n->loop->ev, fd, 1);
+	} else if (fd != -1) {
+		close(fd);
+	}
+
+	len = state_get32(r);
+	for (uint32_t i = 0; i < len && !r->err; ++i) {
+		state_getstr(r, tok, sizeof(tok));
+		if (n && n->resumed)
+			mca_vector_push(&n->isupport, mem_strdup(MEM_ISUPPORT, tok));
+	}
+
+	len = state_get32(r);
+	for (uint32_t i = 0; i < len && !r->err; ++i) {
+		int id = state_get32(r);
+		if (nbatches < SPLIT_MAX)
+			batches[nbatches++] = id;
+	}
+
+	// Clients are attached on their network's loop.
+	if (n) {
+		loop = n->loop;
+		ev = n->loop->ev;
+		net = n;
+	}
+
+	len = state_get32(r);
+	for (uint32_t i = 0; i < len && !r->err; ++i)
+		resume_client(n, r);
+
+	// Clients in the middle of a netsplit's batch are told it is over.
+	for (int i = 0; n && !r->err && i < nbatches; ++i)
+		split_abandon(n, batches[i]);
+
+	loop = &loops[0];
+	ev = loops[0].ev;
+	net = NULL;
+}
+
+/* upgrade_restore takes over from the process before, through fd. Networks
+ * it was connected to are marked resumed, and their clients attached. The up
+ * to max listeners it had are stored in listenfds and counted in nlisten, and
+ * its metrics and ring sockets in metricsfd and ringfd.
+ * Call it on loop 0, once the networks have their loops and workers have
+ * started, but before any loop runs.
+ *
+ * On error, -1 is returned, and this process should exit so that the one
+ * before carries on.
+ */
+int
+upgrade_restore(int fd, int *listenfds, int *nlisten, int max, int *metricsfd, int *ringfd)
+{
+	struct state_reader r = {0};
+	uint64_t len;
+	uint32_t nfds, n;
+	char *state = NULL;
+	int *fds = NULL;
+
+	if (recvall(fd, &len, sizeof(len)) == -1 || recvall(fd, &nfds, sizeof(nfds)) == -1)
+		goto fail;
+
+	if (len > UPGRADE_STATE_MAX || nfds > INT32_MAX / sizeof(int)) {
+		errno = EPROTO;
+		goto fail;
+	}
+
+	if (!(state = mem_malloc(MEM_NETWORKS, len ? len : 1)) ||
+	    !(fds = mem_malloc(MEM_NETWORKS, sizeof(*fds) * (nfds ? nfds : 1))))
+		goto fail;
+
+	if (recvall(fd, state, len) == -1 || recvfds(fd, fds, nfds) == -1)
+		goto fail;
+
+	r.p = state;
+	r.len = len;
+	r.fds = fds;
+	r.nfds = nfds;
+
+	if (state_get32(&r) != UPGRADE_MAGIC || state_get32(&r) != UPGRADE_VERSION) {
+		errno = EPROTO;
+		goto fail;
+	}
+
+	n = state_get32(&r);
+	for (uint32_t i = 0; i < n && !r.err; ++i) {
+		int lfd = state_getfd(&r);
+
+		if (lfd != -1 && *nlisten < max)
+			listenfds[(*nlisten)++] = lfd;
+		else if (lfd != -1)
+			close(lfd);
+	}
+	*metricsfd = state_getfd(&r);
+	*ringfd = state_getfd(&r);
+
+	n = state_get32(&r);
+	for (uint32_t i = 0; i < n && !r.err; ++i)
+		resume_network(&r);
+
+	n = state_get32(&r);
+	for (uint32_t i = 0; i < n && !r.err; ++i) {
+		struct lobby *lb;
+		const char *buf;
+		size_t buflen;
+		int lfd = state_getfd(&r);
+		long uid = state_get64(&r);
+
+		buf = state_getbytes(&r, &buflen);
+		if (lfd == -1 || buflen > sizeof(loop->lobby->buf) || lobby_add(lfd, uid) == -1)
+			continue;
+
+		lb = &loop->lobby[loop->nlobby - 1];
+		memcpy(lb->buf, buf, buflen);
+		lb->len = buflen;
+	}
+
+	if (r.err) {
+		errno = EPROTO;
+		goto fail;
+	}
+
+	if (sendall(fd, "K", 1) == -1)
+		goto fail;
+
+	infof("Upgrade: took over %u fds", nfds);
+
+	close(fd);
+	mem_free(MEM_NETWORKS, state);
+	mem_free(MEM_NETWORKS, fds);
+	return 0;
+
+fail:
+	errorf("Failed to take over: %s", strerror(errno));
+	close(fd);
+	mem_free(MEM_NETWORKS, state);
+	mem_free(MEM_NETWORKS, fds);
+	return -1;
+}
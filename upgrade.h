@@ -0,0 +1,7 @@
+#ifndef UPGRADE_H_INC
+#define UPGRADE_H_INC
+
+int upgrade_fd(void);
+int upgrade_start(char **argv, const int *listenfds, int nlisten, int metricsfd, int ringfd);
+int upgrade_restore(int fd, int *listenfds, int *nlisten, int max, int *metricsfd, int *ringfd);
+#endif
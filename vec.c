@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "mem.h"
 #include "vec.h"
 
 /* mca_vector_new creates a new instance of mca_vector.
@@ -36,7 +37,7 @@
 struct mca_vector *
 mca_vector_new(size_t cap)
 {
-	struct mca_vector *new = malloc(sizeof(struct mca_vector));
+	struct mca_vector *new = mem_malloc(MEM_VEC, sizeof(struct mca_vector));
 	if (!new)
 		return NULL;
 
@@ -52,8 +53,8 @@ mca_vector_new(size_t cap)
 void
 mca_vector_free(struct mca_vector *v)
 {
-	free(v->data);
-	free(v);
+	mem_free(MEM_VEC, v->data);
+	mem_free(MEM_VEC, v);
 }
 
 /* Ensures that there is enough room for another "n" elements.
@@ -67,7 +68,7 @@ mca_vector_ensure(struct mca_vector *v, size_t n)
 	size_t new_size = v->len + n;
 
 	if (new_size > v->cap) {
-		void **newdata = realloc(v->data, sizeof(void *)*new_size);
+		void **newdata = mem_realloc(MEM_VEC, v->data, sizeof(void *)*new_size);
 		if (!newdata)
 			return -1;
 
@@ -0,0 +1,472 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "clk.h"
+#include "log.h"
+#include "mem.h"
+#include "network.h"
+#include "probe.h"
+#include "trace.h"
+#include "worker.h"
+
+struct worker *workers;
+int nworkers;
+
+static unsigned next; // Worker to give the next client to, modulo nworkers
+
+// Workers with messages they have not been woken up for, by this thread.
+static __thread uint64_t unkicked;
+
+/* iobuf_new copies len bytes of data into a new iobuf, which the caller
+ * holds the only reference to. On error, NULL is returned. */
+struct iobuf *
+iobuf_new(const char *data, size_t len)
+{
+	struct iobuf *b;
+
+	if (!(b = mem_malloc(MEM_IO, sizeof(*b) + len)))
+		return NULL;
+
+	b->refs = 1;
+	b->len = len;
+	memcpy(b->data, data, len);
+	return b;
+}
+
+static struct iobuf *
+iobuf_ref(struct iobuf *b)
+{
+	__atomic_add_fetch(&b->refs, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+/* iobuf_put lets go of a reference to b. */
+void
+iobuf_put(struct iobuf *b)
+{
+	if (b && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		mem_free(MEM_IO, b);
+}
+
+static int
+ioq_init(struct ioq *q)
+{
+	if (!(q->cells = mem_malloc(MEM_IO, sizeof(*q->cells) * WORKER_QUEUE)))
+		return -1;
+
+	for (uint64_t i = 0; i < WORKER_QUEUE; ++i)
+		q->cells[i].seq = i;
+	q->head = q->tail = 0;
+	return 0;
+}
+
+/* ioq_push adds m to q, from any thread. If q is full, -1 is returned. */
+static int
+ioq_push(struct ioq *q, struct iomsg *m)
+{
+	uint64_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	struct ioq_cell *c;
+
+	for (;;) {
+		int64_t dif;
+
+		c = &q->cells[pos & (WORKER_QUEUE - 1)];
+		dif = (int64_t)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+			    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return -1;
+		} else {
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	c->m = *m;
+	__atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* ioq_pop takes the oldest message off q, from its worker only. If q is
+ * empty, -1 is returned. */
+static int
+ioq_pop(struct ioq *q, struct iomsg *m)
+{
+	struct ioq_cell *c = &q->cells[q->head & (WORKER_QUEUE - 1)];
+
+	if (__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) != q->head + 1)
+		return -1;
+
+	*m = c->m;
+	__atomic_store_n(&c->seq, q->head + WORKER_QUEUE, __ATOMIC_RELEASE);
+	__atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE); // See worker_drain
+	return 0;
+}
+
+static int
+post(struct worker *w, struct iomsg *m)
+{
+	if (ioq_push(&w->q, m) == -1)
+		return -1;
+
+	unkicked |= 1ULL << w->l.id;
+	return 0;
+}
+
+/* worker_kick wakes up every worker this thread has queued something for
+ * since it last did. Loops call it once per iteration, so that a burst of
+ * lines costs each worker one wakeup. */
+void
+worker_kick(void)
+{
+	for (int i = 0; unkicked; ++i) {
+		if (!(unkicked & (1ULL << i)))
+			continue;
+
+		unkicked &= ~(1ULL << i);
+		loop_wake(&workers[i].l);
+	}
+}
+
+/* worker_open gives the send side of c to the worker with the fewest
+ * clients, round robin among equals. From then on, c's writes go through
+ * worker_write.
+ *
+ * On error, -1 is returned and c is left alone.
+ */
+int
+worker_open(struct client *c)
+{
+	struct iomsg m = { IO_OPEN };
+	struct ioconn *io;
+	struct worker *w;
+
+	// Loops may open clients at the same time.
+	w = &workers[__atomic_fetch_add(&next, 1, __ATOMIC_RELAXED) % nworkers];
+	for (int i = 0; i < nworkers; ++i)
+		if (__atomic_load_n(&workers[i].nconns, __ATOMIC_RELAXED) <
+		    __atomic_load_n(&w->nconns, __ATOMIC_RELAXED))
+			w = &workers[i];
+
+	if (!(io = mem_calloc(MEM_IO, 1, sizeof(*io))))
+		return -1;
+
+	io->fd = c->fd;
+	io->b.sendmax = c->b.sendmax;
+	io->w = w;
+	m.io = io;
+
+	if (post(w, &m) == -1) {
+		mem_free(MEM_IO, io);
+		return -1;
+	}
+
+	__atomic_add_fetch(&w->nconns, 1, __ATOMIC_RELAXED);
+	c->io = io;
+	return 0;
+}
+
+/* worker_write queues b to be written to io, taking a reference to it. rx
+ * is when the server line behind it was read, or 0.
+ *
+ * If the worker is too far behind, -1 is returned and b is dropped.
+ */
+int
+worker_write(struct ioconn *io, struct iobuf *b, uint64_t rx)
+{
+	struct iomsg m = { IO_WRITE, io, b, rx };
+
+	if (!b)
+		return -1;
+
+	iobuf_ref(b);
+	if (post(io->w, &m) == -1) {
+		iobuf_put(b);
+		return -1;
+	}
+	return 0;
+}
+
+/* worker_close has the worker write out what it can to io, then close its
+ * fd and free it. The caller must have let go of the fd already. */
+void
+worker_close(struct ioconn *io)
+{
+	struct iomsg m = { IO_CLOSE, io };
+
+	// This one must not be lost, or the fd would never be closed. The
+	// worker is draining the queue, so there will be room soon.
+	while (post(io->w, &m) == -1) {
+		worker_kick();
+		sched_yield();
+	}
+}
+
+static void
+handle(struct worker *w, struct iomsg *m)
+{
+	struct ioconn *io = m->io;
+	int r;
+
+	switch (m->op) {
+	case IO_OPEN:
+		loop_own(&w->l, io->fd, NULL, OWN_IO);
+		w->l.owners[io->fd].io = io;
+		mca_ev_append(ev, io->fd, 0);
+		break;
+	case IO_WRITE:
+		if (io->dead) {
+			iobuf_put(m->buf);
+			break;
+		}
+
+		mca_ev_set_write(ev, io->fd, 1);
+		r = bufio_write(&io->b, m->buf->data, m->buf->len);
+
+		if (r == -1) {
+			io->dropped++;
+			PROBE3(drop, io->fd, m->buf->len, io->b.sendptr);
+		} else {
+			PROBE3(enqueue, io->fd, m->buf->len, io->b.sendptr);
+
+			io->queued += m->buf->len;
+			if (io->b.sendptr > io->sendq_max)
+				io->sendq_max = io->b.sendptr;
+
+			w->stats.rx = m->rx;
+			stats_queued(&w->stats, &io->lat, io->queued);
+			w->stats.rx = 0;
+		}
+
+		iobuf_put(m->buf);
+		break;
+	case IO_CLOSE:
+		// Last words, such as an ERROR, if they fit.
+		if (io->b.sendptr && !io->dead)
+			bufio_writable(&io->b, io->fd);
+
+		mca_ev_remove(ev, io->fd);
+		loop_own(&w->l, io->fd, NULL, OWN_NONE);
+		close(io->fd);
+
+		bufio_free(&io->b);
+		mem_free(MEM_IO, io);
+		__atomic_sub_fetch(&w->nconns, 1, __ATOMIC_RELAXED);
+		break;
+	}
+}
+
+static void
+evwake(struct mca_ev *, void *userdata)
+{
+	struct worker *w = userdata;
+
+	clk_refresh();
+	stats_wake(&w->l.stats);
+	loop_lock(&w->l);
+}
+
+static int
+evread(struct mca_ev *, int fd, void *userdata)
+{
+	struct worker *w = userdata;
+	struct iomsg m;
+	uint64_t n, t = TRACE_BEGIN();
+	int handled = 0;
+
+	if (fd != w->l.wake)
+		return 0;
+
+	read(fd, &n, sizeof(n));
+	while (ioq_pop(&w->q, &m) == 0) {
+		handle(w, &m);
+		handled++;
+	}
+
+	TRACE_END("drain", handled, t);
+	return 0;
+}
+
+static int
+evwrite(struct mca_ev *, int fd, void *userdata)
+{
+	struct worker *w = userdata;
+	struct owner o = loop_owner(&w->l, fd);
+	struct ioconn *io = o.io;
+	uint64_t t = TRACE_BEGIN();
+	int queued, n;
+
+	if (o.kind != OWN_IO || io->dead)
+		return 0;
+
+	queued = io->b.sendptr;
+	n = bufio_writable(&io->b, fd);
+
+	if (n != -1) {
+		PROBE3(write, fd, queued - io->b.sendptr, io->b.sendptr);
+		stats_written(&w->stats, &io->lat, queued - io->b.sendptr);
+	}
+
+	if (n > 0) {
+		mca_ev_set_write(ev, fd, 0);
+	} else if (n == -1) {
+		// The client's loop notices, and sends IO_CLOSE.
+		warnf("Write failed to fd %d: %s", fd, strerror(errno));
+		io->dead = 1;
+		mca_ev_set_write(ev, fd, 0);
+		shutdown(fd, SHUT_RDWR);
+	}
+
+	TRACE_END("write", fd, t);
+	return 0;
+}
+
+static int
+evremove(struct mca_ev *, int fd, void *)
+{
+	// Closing is left to IO_CLOSE, which is on its way.
+	return 0;
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct iomsg m;
+
+	loop = &w->l;
+	ev = w->l.ev;
+	trace_thread(w->l.name);
+
+	for (;;) {
+		loop_unlock(&w->l);
+
+		if (mca_ev_poll(ev, -1) == -1 && errno != EINTR) {
+			errorf("poll: %s", strerror(errno));
+			break;
+		}
+
+		stats_loop_done(&w->l.stats);
+
+		// Stopped once every loop has, so nothing more is coming.
+		if (__atomic_load_n(&w->stopping, __ATOMIC_ACQUIRE))
+			break;
+	}
+
+	while (ioq_pop(&w->q, &m) == 0)
+		handle(w, &m);
+	mca_ev_flush(ev, -1);
+	loop_unlock(&w->l);
+	return NULL;
+}
+
+/* worker_start starts n I/O workers. Signals should be blocked.
+ *
+ * On error, -1 is returned.
+ */
+int
+worker_start(int n)
+{
+	if (n > WORKERS_MAX)
+		n = WORKERS_MAX;
+
+	if (!(workers = mem_calloc(MEM_IO, n, sizeof(*workers))))
+		return -1;
+
+	for (int i = 0; i < n; ++i) {
+		struct worker *w = &workers[i];
+
+		if (loop_init(&w->l, i) == -1 || ioq_init(&w->q) == -1)
+			return -1;
+
+		snprintf(w->l.name, sizeof(w->l.name), "io %d", i);
+		mca_ev_set_userdata(w->l.ev, w);
+		w->l.ev->on_wake = evwake;
+		w->l.ev->on_readable = evread;
+		w->l.ev->on_writable = evwrite;
+		w->l.ev->on_remove = evremove;
+
+		if (pthread_create(&w->l.thread, NULL, worker_main, w) != 0)
+			return -1;
+		nworkers++;
+	}
+
+	return 0;
+}
+
+/* worker_stop has every worker write out what it has, then waits for them
+ * and frees them. No loop may be running. */
+void
+worker_stop(void)
+{
+	for (int i = 0; i < nworkers; ++i) {
+		__atomic_store_n(&workers[i].stopping, 1, __ATOMIC_RELEASE);
+		loop_wake(&workers[i].l);
+	}
+
+	for (int i = 0; i < nworkers; ++i) {
+		struct worker *w = &workers[i];
+
+		pthread_join(w->l.thread, NULL);
+
+		// The clients still around are closed with their networks.
+		for (size_t fd = 0; fd < w->l.nowners; ++fd) {
+			struct ioconn *io = w->l.owners[fd].io;
+
+			if (w->l.owners[fd].kind != OWN_IO)
+				continue;
+
+			bufio_free(&io->b);
+			mem_free(MEM_IO, io);
+		}
+
+		mem_free(MEM_IO, w->q.cells);
+		stats_free(&w->stats);
+		loop_free(&w->l);
+	}
+
+	mem_free(MEM_IO, workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+/* worker_drain waits for every worker to have handled all it was sent.
+ * Nothing may be sending more, so the caller must hold every loop. */
+void
+worker_drain(void)
+{
+	for (int i = 0; i < nworkers; ++i) {
+		struct ioq *q = &workers[i].q;
+
+		loop_wake(&workers[i].l);
+		while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+			sched_yield();
+	}
+}
+
+/* worker_lock_all holds every worker still, so that the counters of their
+ * clients may be read. Loops lock them in order, and workers take no other
+ * lock, so this cannot deadlock. */
+void
+worker_lock_all(void)
+{
+	for (int i = 0; i < nworkers; ++i)
+		pthread_mutex_lock(&workers[i].l.mu);
+}
+
+void
+worker_unlock_all(void)
+{
+	for (int i = 0; i < nworkers; ++i)
+		pthread_mutex_unlock(&workers[i].l.mu);
+}
@@ -0,0 +1,91 @@
+#ifndef WORKER_H_INC
+#define WORKER_H_INC
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bufio.h"
+#include "client.h"
+#include "network.h"
+#include "stats.h"
+
+#define WORKERS_MAX 64
+#define WORKER_QUEUE (64*1024) // Messages, must be a power of two
+
+/* iobuf is a line that is shared by every client it is queued for. The last
+ * one to let go of it frees it. */
+struct iobuf {
+	uint32_t refs;
+	uint32_t len;
+	char data[];
+};
+
+/* ioconn is the send side of a client whose writes are done by an I/O
+ * worker. Only the worker touches it, apart from reading its counters with
+ * the worker's mu held. It outlives the client, until the worker closes the
+ * fd. */
+struct ioconn {
+	int fd;
+	int dead; // A write failed, so the client is on its way out
+	struct bufio b; // Only the send half is used
+	uint64_t queued; // Bytes, up to the end of the send buffer
+	uint64_t dropped;
+	size_t sendq_max;
+	struct stats_lat lat;
+	struct worker *w;
+};
+
+/* iomsg is what a loop asks of a worker. */
+struct iomsg {
+	int op;
+	struct ioconn *io;
+	struct iobuf *buf; // IO_WRITE only
+	uint64_t rx; // When the server line behind it was read, or 0
+};
+
+enum { IO_OPEN, IO_WRITE, IO_CLOSE };
+
+/* A bounded queue with any number of producers and one consumer, after
+ * Dmitry Vyukov's. Each cell's seq says whose turn it is. */
+struct ioq_cell {
+	uint64_t seq;
+	struct iomsg m;
+};
+
+struct ioq {
+	struct ioq_cell *cells;
+	char pad0[64];
+	uint64_t tail; // Producers
+	char pad1[64];
+	uint64_t head; // Consumer
+	char pad2[64];
+};
+
+/* worker is a thread with an event loop of its own, which writes out to the
+ * clients it has been given. */
+struct worker {
+	struct loop l;
+	struct ioq q;
+	int stopping;
+	int nconns;
+
+	// Only rx, queue and write are used, over all its clients.
+	struct stats stats;
+};
+
+extern struct worker *workers;
+extern int nworkers;
+
+struct iobuf *iobuf_new(const char *data, size_t len);
+void iobuf_put(struct iobuf *b);
+
+int worker_start(int n);
+void worker_stop(void);
+void worker_kick(void);
+void worker_drain(void);
+void worker_lock_all(void);
+void worker_unlock_all(void);
+
+int worker_open(struct client *c);
+int worker_write(struct ioconn *io, struct iobuf *b, uint64_t rx);
+void worker_close(struct ioconn *io);
+#endif